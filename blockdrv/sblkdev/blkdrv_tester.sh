@@ -33,9 +33,13 @@ fi
 sudo dmesg -C
 df -h|grep ${DISK}
 
-runcmd "sudo dd if=/dev/urandom of=${MOUNTPT}/t1 bs=512 count=3"
-runcmd "sudo dd if=/dev/urandom of=${MOUNTPT}/t2 bs=2k count=1"
-runcmd "sudo dd if=/dev/urandom of=${MOUNTPT}/t3 bs=4k count=1"
+# Data source: /dev/urandom is slow; if the cz_enh_miscdrv module's loaded,
+# use it's (much faster, and reproducible) pseudo-random cpat device instead
+SRC=/dev/urandom
+[ -c /dev/cpat_miscdev ] && SRC=/dev/cpat_miscdev
+runcmd "sudo dd if=${SRC} of=${MOUNTPT}/t1 bs=512 count=3"
+runcmd "sudo dd if=${SRC} of=${MOUNTPT}/t2 bs=2k count=1"
+runcmd "sudo dd if=${SRC} of=${MOUNTPT}/t3 bs=4k count=1"
 
 runcmd "sleep 3 ; sync"
 
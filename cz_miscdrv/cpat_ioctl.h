@@ -0,0 +1,41 @@
+/*
+ * cpat_ioctl.h
+ * Header for the 'cpat' (pattern source) device of the cz_enh_miscdrv.c
+ * kernel module; include it in your user-space app to issue the ioctl's.
+ *
+ * What's read from /dev/cpat_miscdev is a function of just (mode, seed, file
+ * offset); so the same mode & seed always give the same data, and you can
+ * lseek()/pread() anywhere into the stream (f.e. to verify a block read back
+ * from a disk).
+ * Author: Kaiwan N Billimoria
+ * License: MIT/GPLv2
+ */
+#ifndef __CPAT_IOCTL_H__
+#define __CPAT_IOCTL_H__
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#endif
+
+/* The modes; each 8-byte word 'i' of the stream (i = offset / 8) is: */
+#define CPAT_MODE_PATTERN	0	/* the seed, big-endian (so 0xdeadface'deadface
+					 * reads as de ad fa ce de ad fa ce ...) */
+#define CPAT_MODE_COUNTER	1	/* seed + i, little-endian */
+#define CPAT_MODE_PRNG		2	/* splitmix64(seed, i), little-endian */
+#define CPAT_MODE_MAX		CPAT_MODE_PRNG
+
+/* The 'magic' number for our driver; see Documentation/ioctl-number.txt */
+#define CPAT_IOC_MAGIC		0xCB
+
+/* Set / Query the mode (one of CPAT_MODE_*) */
+#define CPAT_IOCSMODE		_IOW(CPAT_IOC_MAGIC, 0, int)
+#define CPAT_IOCGMODE		_IOR(CPAT_IOC_MAGIC, 1, int)
+/* Set / Query the seed (for CPAT_MODE_PATTERN, it's the pattern itself) */
+#define CPAT_IOCSSEED		_IOW(CPAT_IOC_MAGIC, 2, __u64)
+#define CPAT_IOCGSEED		_IOR(CPAT_IOC_MAGIC, 3, __u64)
+
+#endif
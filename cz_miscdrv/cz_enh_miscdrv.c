@@ -5,11 +5,18 @@
  * Uses char 'misc' framework, major # 10.
  * This driver implements two char 'misc' devices; minors are dynamically alloted:
  * a) zero source        : /dev/czero_miscdev
- * b) sink (null device) : /dev/cnul_miscdev
+ * b) sink (null device) : /dev/cnul_miscdev (optionally checksums the data
+ *                         written; see it's sysfs files)
+ * c) pattern source     : /dev/cpat_miscdev (see cpat_ioctl.h)
+ * Also, there's a built-in benchmark of ways to zero a user buffer; just
+ *  cat /sys/kernel/debug/cz_enh_miscdrv/bench
  *
  * This version's 'czero' implementation is superior to the previous one
  * (cz_miscdrv.c); here, you can read any number of 'zero' bytes from it (the
- * previous implementation was limited to one page).
+ * previous implementation was limited to one page). Also, it's fast: no kernel
+ * buffer, no copying; the user buffer's simply zeroed in place (see
+ * czero_read_iter()). It can also be mmap()'ed (private mappings only), and
+ * splice()'d / sendfile()'d from, without any copying at all.
  *
  * Author: Kaiwan N Billimoria
  * License: MIT/GPLv2
@@ -32,6 +39,17 @@
 #include <linux/fs.h>		/* no_llseek */
 #include <linux/slab.h>		/* kmalloc */
 #include <linux/miscdevice.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/mm.h>		/* ZERO_PAGE, vma */
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/mutex.h>
+#include <linux/device.h>	/* DEVICE_ATTR_*() */
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mman.h>		/* vm_mmap() */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 //--- copy_[to|from]_user()
 #include <linux/version.h>
@@ -40,13 +58,149 @@
 #else
 #include <asm/uaccess.h>
 #endif
+/* (after linux/version.h, as it needs KERNEL_VERSION()) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>	/* crc32c() moved here */
+#else
+#include <linux/crc32c.h>
+#endif
+#include "cpat_ioctl.h"
 
 /* ----------The czero_* functionality routines
  *
  * czero is designed to be a zero source
  */
+/*
+ * Zero at most this much of the user buffer at a time; a huge read should
+ * still let others run, and be interruptible.
+ */
+#define CZ_ZERO_CHUNK	(1024 * 1024)
+
+/*
+ * czero_read_iter:
+ * The zero source, done right: there's no need to allocate a kernel buffer of
+ * zeroes and copy_to_user() it over and over - that's both a memory read and a
+ * write per byte, and a kzalloc() per call. Instead, iov_iter_zero() clears
+ * the user buffer(s) in place (it's clear_user() underneath, i.e. f.e. a
+ * 'rep stosb' on x86). Being a read_iter method, it also serves readv(),
+ * preadv2() and io_uring reads, not just read().
+ *
+ * Try:
+ *  dd if=/dev/czero_miscdev of=/dev/null bs=1M count=10000
+ * and compare with the same from /dev/zero; they should be about the same.
+ */
+static ssize_t czero_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t done = 0;
+
+	pr_debug("process %s [pid %d] to read %zu bytes\n",
+		 current->comm, current->pid, iov_iter_count(to));
+
+	while (iov_iter_count(to)) {
+		size_t chunk = min_t(size_t, iov_iter_count(to), CZ_ZERO_CHUNK), n;
+
+		n = iov_iter_zero(chunk, to);
+		done += n;
+		if (n < chunk)		/* hit a bad user address */
+			return done ? done : -EFAULT;
+		if (signal_pending(current))
+			return done ? done : -ERESTARTSYS;
+		if (need_resched()) {
+			if (iocb->ki_flags & IOCB_NOWAIT)
+				return done ? done : -EAGAIN;
+			cond_resched();
+		}
+	}
+	return done;
+}
+
+#ifdef CONFIG_MMU
+/*
+ * czero_mmap:
+ * Just as with /dev/zero, a private mapping of czero simply becomes an
+ * anonymous one: with no vm_ops, a read fault maps the kernel's one shared
+ * zero page (read-only) and a write fault gives the process it's own freshly
+ * zeroed page - i.e. copy-on-write of the zero page. So mmap()'ing a huge
+ * buffer costs nothing until it's written to.
+ *
+ * A shared mapping of /dev/zero is really shmem (shared anonymous memory);
+ * shmem_zero_setup() isn't exported to modules though, so we don't do those.
+ */
+static int czero_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_SHARED)
+		return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	vma_set_anonymous(vma);
+#else
+	vma->vm_ops = NULL;
+#endif
+	return 0;
+}
+#endif
+
+/*
+ * czero_splice_read:
+ * splice() (and hence sendfile()) from czero: instead of allocating pipe pages
+ * and zeroing them, we fill the pipe with references to the shared zero page;
+ * whoever consumes the pipe (a file, a socket, ...) reads the zeroes straight
+ * from it. Nothing gets copied or cleared here at all.
+ * The pipe buffers are read-only: they can't be stolen (no try_steal) and a
+ * write to the pipe never merges into them (they don't have
+ * PIPE_BUF_FLAG_CAN_MERGE set), so the zero page stays zero.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static void czero_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations czero_pipe_buf_ops = {
+	.release = czero_pipe_buf_release,
+	.get = generic_pipe_buf_get,
+};
+
+/* splice_to_pipe() couldn't use all of them (pipe full) */
+static void czero_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+static ssize_t czero_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+				 size_t len, unsigned int flags)
+{
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &czero_pipe_buf_ops,
+		.spd_release = czero_spd_release,
+	};
+	struct page *zpage = ZERO_PAGE(0);
+
+	while (len && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		size_t n = min_t(size_t, len, PAGE_SIZE);
+
+		get_page(zpage);
+		pages[spd.nr_pages] = zpage;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = n;
+		partial[spd.nr_pages].private = 0;
+		spd.nr_pages++;
+		len -= n;
+	}
+	/* at most 16 pages a call; splice()/sendfile() just call us again */
+	return splice_to_pipe(pipe, &spd);
+}
+#endif
+
+#if 0
 /*
  * czero_read:
+ * (The earlier implementation; superseded by czero_read_iter() above, and kept
+ * here for reference.)
  * Simple zero source implementation: just fill a buffer with zeroes
  * and pass it back to user-space.
  * This is an enhanced version of the earier czero_read_onepage() method (see
@@ -153,7 +307,6 @@ static ssize_t czero_read(struct file *filp, char __user *buf, size_t count, lof
 	return status;
 }
 
-#if 0
 static ssize_t czero_read_onepage(struct file *filp, char __user *buf,
 				  size_t count, loff_t *offp)
 {
@@ -197,6 +350,184 @@ static ssize_t czero_write(struct file *filp, const char __user *buf,
 	return -ENOSYS;		// 'Function not implemented'
 }
 
+/* ----------The cpat_* functionality routines
+ *
+ * cpat is a fast, reproducible, data source: a repeating pattern, an
+ * incrementing counter or pseudo-random data (see cpat_ioctl.h). Handy f.e.
+ * to fill up a disk under test with data you can later verify, at a far
+ * higher rate than /dev/urandom can manage.
+ * The mode & seed are per open file; they start out as the module parameters
+ * below (which you can change at runtime, via sysfs, for the benefit of
+ * scripts that can't issue an ioctl, like dd).
+ */
+static int pat_mode = CPAT_MODE_PRNG;
+module_param(pat_mode, int, 0644);
+MODULE_PARM_DESC(pat_mode,
+		 "cpat: mode of new opens: 0=repeating pattern, 1=counter, 2=pseudo-random (default)");
+static unsigned long long pat_seed = 0xdeadfacedeadfaceULL;
+module_param(pat_seed, ullong, 0644);
+MODULE_PARM_DESC(pat_seed, "cpat: seed (or the pattern) of new opens (default 0xdeadfacedeadface)");
+
+struct cpat_ctx {
+	struct mutex lock;	/* protects all below */
+	int mode;
+	u64 seed;
+	u64 *buf;		/* one page; the stream's generated into it */
+};
+
+/*
+ * splitmix64 (S. Vigna): fast, and it passes BigCrush; being counter-based,
+ * word 'i' of the stream depends only on the seed and 'i' - which is what
+ * lets us seek anywhere into it. (Not for crypto of course!)
+ */
+static inline u64 cpat_splitmix64(u64 seed, u64 i)
+{
+	u64 z = seed + (i + 1) * 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Generate @n words of the stream, from word # @w on.
+ * It's done a 64-bit word at a time (the old FILL_PATTERN code went byte by
+ * byte). Why not SIMD? The kernel's built to not touch the FPU/vector
+ * registers; using them means kernel_fpu_begin()/end() (arch-specific, and
+ * it disables preemption), and on a page at a time the win is marginal.
+ */
+static void cpat_fill(const struct cpat_ctx *ctx, u64 *buf, u64 w, unsigned int n)
+{
+	u64 v = (__force u64)cpu_to_be64(ctx->seed);
+	unsigned int i;
+
+	switch (ctx->mode) {
+	case CPAT_MODE_PATTERN:
+		for (i = 0; i < n; i++)
+			buf[i] = v;
+		break;
+	case CPAT_MODE_COUNTER:
+		for (i = 0; i < n; i++)
+			buf[i] = (__force u64)cpu_to_le64(ctx->seed + w + i);
+		break;
+	default:
+		for (i = 0; i < n; i++)
+			buf[i] = (__force u64)cpu_to_le64(cpat_splitmix64(ctx->seed, w + i));
+	}
+}
+
+/*
+ * Generate the stream from the file offset on, a page at a time, and copy it
+ * to the user buffer(s).
+ */
+static ssize_t cpat_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct cpat_ctx *ctx = iocb->ki_filp->private_data;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!mutex_trylock(&ctx->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+
+	while (iov_iter_count(to)) {
+		unsigned int off = iocb->ki_pos & 7;
+		size_t len = min_t(size_t, iov_iter_count(to), PAGE_SIZE - off), n;
+
+		cpat_fill(ctx, ctx->buf, iocb->ki_pos >> 3, DIV_ROUND_UP(off + len, 8));
+		n = copy_to_iter((u8 *)ctx->buf + off, len, to);
+		iocb->ki_pos += n;
+		done += n;
+		if (n < len) {
+			ret = -EFAULT;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+	mutex_unlock(&ctx->lock);
+
+	return done ? done : ret;
+}
+
+static long cpat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cpat_ctx *ctx = filp->private_data;
+	void __user *uarg = (void __user *)arg;
+	long ret = 0;
+	int mode;
+	u64 seed;
+
+	if (_IOC_TYPE(cmd) != CPAT_IOC_MAGIC)
+		return -ENOTTY;
+
+	mutex_lock(&ctx->lock);
+	switch (cmd) {
+	case CPAT_IOCSMODE:
+		if (get_user(mode, (int __user *)uarg))
+			ret = -EFAULT;
+		else if (mode < 0 || mode > CPAT_MODE_MAX)
+			ret = -EINVAL;
+		else
+			ctx->mode = mode;
+		break;
+	case CPAT_IOCGMODE:
+		ret = put_user(ctx->mode, (int __user *)uarg);
+		break;
+	case CPAT_IOCSSEED:
+		if (copy_from_user(&seed, uarg, sizeof(seed)))
+			ret = -EFAULT;
+		else
+			ctx->seed = seed;
+		break;
+	case CPAT_IOCGSEED:
+		if (copy_to_user(uarg, &ctx->seed, sizeof(ctx->seed)))
+			ret = -EFAULT;
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+static int cpat_open(struct inode *inode, struct file *filp)
+{
+	struct cpat_ctx *ctx;
+	int mode = READ_ONCE(pat_mode);
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->buf = (u64 *)__get_free_page(GFP_KERNEL);
+	if (!ctx->buf) {
+		kfree(ctx);
+		return -ENOMEM;
+	}
+	mutex_init(&ctx->lock);
+	ctx->mode = (mode >= 0 && mode <= CPAT_MODE_MAX) ? mode : CPAT_MODE_PRNG;
+	ctx->seed = READ_ONCE(pat_seed);
+	/* (the misc core had set it to our miscdevice; we don't need that) */
+	filp->private_data = ctx;
+
+	return 0;
+}
+
+static int cpat_release(struct inode *inode, struct file *filp)
+{
+	struct cpat_ctx *ctx = filp->private_data;
+
+	free_page((unsigned long)ctx->buf);
+	kfree(ctx);
+	return 0;
+}
+
 /* ----------The cnul_* functionality routines
  *
  * cnul is designed to be a sink; but let's make it useful by ret 0,
@@ -218,17 +549,159 @@ static ssize_t cnul_read(struct file *filp, char __user *buf, size_t count, loff
 }
 
 /*
- * The signature of the driver 'method' is IDENTICAL to the file_operations member..
- * ssize_t (*write) (struct file *, const char __user *, size_t, loff_t *);
+ * cnul statistics, and it's (optional) checksum mode; all of it's visible (and
+ * the mode & a reset settable) via sysfs, under /sys/class/misc/cnul_miscdev/ :
+ *  bytes         : # bytes written since the last reset
+ *  bytes_per_sec : the throughput, from the first to the latest write
+ *  checksum      : 0 (default) = just discard the data; 1 = consume it, running
+ *                  it all through crc32c (writers then get serialized)
+ *  crc32c        : the crc32c of all the data written (in checksum mode)
+ *  reset         : write anything to clear all the above (but checksum)
+ * So f.e. 'dd if=/dev/cpat_miscdev of=/dev/cnul_miscdev bs=1M count=1024' with
+ * checksum on gives you an end-to-end integrity check & a copy benchmark.
+ */
+static atomic64_t cnul_bytes;
+static atomic64_t cnul_t_first, cnul_t_last;	/* ktime (ns) of the 1st & latest write */
+static bool cnul_checksum;
+static DEFINE_MUTEX(cnul_crc_lock);	/* protects the two below */
+static u32 cnul_crc = ~0U;
+static void *cnul_buf;			/* one page; the data's copied in here to checksum it */
+
+/* Consume all the data, checksumming it; returns the # bytes consumed */
+static ssize_t cnul_crc_iter(struct iov_iter *from)
+{
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	if (mutex_lock_interruptible(&cnul_crc_lock))
+		return -ERESTARTSYS;
+	while (iov_iter_count(from)) {
+		size_t len = min_t(size_t, iov_iter_count(from), PAGE_SIZE), n;
+
+		n = copy_from_iter(cnul_buf, len, from);
+		/* the lib crc32c is arch-accelerated (f.e. SSE4.2 crc32 insn on x86) */
+		cnul_crc = crc32c(cnul_crc, cnul_buf, n);
+		done += n;
+		if (n < len) {
+			ret = -EFAULT;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+	mutex_unlock(&cnul_crc_lock);
+
+	return done ? done : ret;
+}
+
+/*
+ * The sink. Note: no printk's here (not even a pr_debug()) - with DEBUG on,
+ * they'd easily cost more than everything else we do per write.
+ * Being a write_iter method, writev(), pwritev2() and io_uring writes work too.
  */
-static ssize_t cnul_write(struct file *filp, const char __user *buf,
-			  size_t count, loff_t *offp)
+static ssize_t cnul_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	s64 now = ktime_get_ns();
+	ssize_t ret = iov_iter_count(from);
+
+	if (READ_ONCE(cnul_checksum)) {
+		ret = cnul_crc_iter(from);
+		if (ret <= 0)
+			return ret;
+	} else
+		iov_iter_advance(from, ret);	/* a write to the nul device should always succeed! */
+
+	atomic64_cmpxchg(&cnul_t_first, 0, now);
+	atomic64_set(&cnul_t_last, ktime_get_ns());
+	atomic64_add(ret, &cnul_bytes);
+	return ret;
+}
+
+/*------------------ cnul sysfs files --------------------------------*/
+static ssize_t bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%lld\n", atomic64_read(&cnul_bytes));
+}
+static DEVICE_ATTR_RO(bytes);
+
+static ssize_t bytes_per_sec_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u64 bytes = atomic64_read(&cnul_bytes);
+	u64 ns = atomic64_read(&cnul_t_last) - atomic64_read(&cnul_t_first);
+
+	if (!bytes || !ns)
+		return scnprintf(buf, PAGE_SIZE, "0\n");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", mul_u64_u64_div_u64(bytes, NSEC_PER_SEC, ns));
+#else
+	/* (overflows after ~18 TB; reset before that) */
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 div64_u64(bytes * USEC_PER_SEC, max_t(u64, ns / NSEC_PER_USEC, 1)));
+#endif
+}
+static DEVICE_ATTR_RO(bytes_per_sec);
+
+static ssize_t crc32c_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u32 crc;
+
+	mutex_lock(&cnul_crc_lock);
+	crc = ~cnul_crc;	/* the usual final inversion */
+	mutex_unlock(&cnul_crc_lock);
+	return scnprintf(buf, PAGE_SIZE, "0x%08x\n", crc);
+}
+static DEVICE_ATTR_RO(crc32c);
+
+static void cnul_reset(void)
+{
+	mutex_lock(&cnul_crc_lock);
+	cnul_crc = ~0U;
+	atomic64_set(&cnul_bytes, 0);
+	atomic64_set(&cnul_t_first, 0);
+	atomic64_set(&cnul_t_last, 0);
+	mutex_unlock(&cnul_crc_lock);
+}
+
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	cnul_reset();
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static ssize_t checksum_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE(cnul_checksum));
+}
+
+/* switching modes starts afresh */
+static ssize_t checksum_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
-	pr_debug("process %s [pid %d], count=%zu\n\tjiffies=%lu\n",
-		 current->comm, current->pid, count, jiffies);
+	bool on;
+	int ret = kstrtobool(buf, &on);
+
+	if (ret)
+		return ret;
+	WRITE_ONCE(cnul_checksum, on);
+	cnul_reset();
 	return count;
-	/* a write() to the nul device should always succeed! */
 }
+static DEVICE_ATTR_RW(checksum);
+
+static struct attribute *cnul_attrs[] = {
+	&dev_attr_bytes.attr,
+	&dev_attr_bytes_per_sec.attr,
+	&dev_attr_crc32c.attr,
+	&dev_attr_reset.attr,
+	&dev_attr_checksum.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(cnul);
 
 /* The 'null' device as a char 'misc' device */
 static const struct file_operations cz_cnul_misc_fops = {
@@ -236,7 +709,7 @@ static const struct file_operations cz_cnul_misc_fops = {
 	.llseek = no_llseek,
 #endif
 	.read = cnul_read,
-	.write = cnul_write,
+	.write_iter = cnul_write_iter,
 };
 
 static struct miscdevice cz_cnul_miscdev = {
@@ -246,6 +719,7 @@ static struct miscdevice cz_cnul_miscdev = {
 				 * also populated within /sys/class/misc/ and /sys/devices/virtual/misc/ */
 	.mode = 0666,		/* ... dev node perms set as specified here */
 	.fops = &cz_cnul_misc_fops,	/* connect to this driver's 'functionality' */
+	.groups = cnul_groups,	/* it's sysfs files get created along with the device */
 };
 
 /* The 'zero' device as a char 'misc' device */
@@ -253,7 +727,16 @@ static const struct file_operations cz_czero_misc_fops = {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)	// commit 868941b
 	.llseek = no_llseek,
 #endif
-	.read = czero_read,
+	.read_iter = czero_read_iter,
+#ifdef CONFIG_MMU
+	.mmap = czero_mmap,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	.splice_read = czero_splice_read,
+#else
+	/* older pipe_buf_operations differ; let the VFS use read_iter on the pipe */
+	.splice_read = generic_file_splice_read,
+#endif
 	.write = czero_write,
 };
 
@@ -266,6 +749,200 @@ static struct miscdevice cz_czero_miscdev = {
 	.fops = &cz_czero_misc_fops,	/* connect to this driver's 'functionality' */
 };
 
+/* The 'pattern' device as a char 'misc' device */
+static const struct file_operations cz_cpat_misc_fops = {
+	.open = cpat_open,
+	.release = cpat_release,
+	.llseek = default_llseek,	/* seek anywhere into the stream */
+	.read_iter = cpat_read_iter,
+	.unlocked_ioctl = cpat_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
+};
+
+static struct miscdevice cz_cpat_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "cpat_miscdev",
+	.mode = 0666,
+	.fops = &cz_cpat_misc_fops,
+};
+
+/* ----------The built-in benchmark
+ *
+ * How fast can we hand user-space a zeroed buffer, and which way is best, for
+ * what size? Read the debugfs 'bench' file to measure (it takes a few seconds):
+ *  copy/page  : the old czero_read(): kzalloc() a page (per read), then
+ *               copy_to_user() it a page at a time
+ *  clear_user : one clear_user() over the whole buffer
+ *  iov_iter   : iov_iter_zero() over the whole buffer (as czero_read_iter()
+ *               does, but for the 1 MB chunking)
+ *  mmap       : a private mapping (as czero_mmap() sets up) and a read of each
+ *               page, faulting in the shared zero page; then the munmap
+ * The first three 'zero' a scratch buffer that's mapped into the reader's
+ * address space (and pre-faulted; so, careful, it takes up 64 MB of RAM while
+ * the benchmark runs). The table has the throughput in GB/s (10^9 bytes/s).
+ */
+#define CZB_MIN_SZ	64
+#define CZB_MAX_SZ	(64 * 1024 * 1024)
+#define CZB_MIN_NS	(20 * NSEC_PER_MSEC)	/* time each (method, size) at least this long */
+#define CZB_MAX_ITERS	(1UL << 24)
+
+enum { CZB_COPY_PAGE, CZB_CLEAR_USER, CZB_IOV_ITER, CZB_MMAP, CZB_NR };
+static const char * const czb_names[CZB_NR] = {
+	"copy/page", "clear_user", "iov_iter", "mmap"
+};
+
+static DEFINE_MUTEX(czb_lock);	/* one run at a time */
+static struct dentry *cz_dbg_root;
+
+static int czb_copy_page(unsigned long ubuf, size_t len)
+{
+	size_t mcount = min_t(size_t, len, PAGE_SIZE), off;
+	void *zbuf = kzalloc(mcount, GFP_KERNEL);
+	int ret = 0;
+
+	if (!zbuf)
+		return -ENOMEM;
+	for (off = 0; off < len; off += mcount) {
+		if (copy_to_user((void __user *)(ubuf + off), zbuf, min(mcount, len - off))) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	kfree(zbuf);
+	return ret;
+}
+
+static int czb_iov_iter(unsigned long ubuf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void __user *)ubuf, .iov_len = len };
+	struct iov_iter iter;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	iov_iter_init(&iter, ITER_DEST, &iov, 1, len);
+#else
+	iov_iter_init(&iter, READ, &iov, 1, len);
+#endif
+	return iov_iter_zero(len, &iter) == len ? 0 : -EFAULT;
+}
+
+/*
+ * An anonymous private mapping's exactly what a private mmap of czero becomes,
+ * so we needn't open the device to time it.
+ */
+static int czb_mmap(size_t len)
+{
+	unsigned long addr, off;
+	char c;
+	int ret = 0;
+
+	addr = vm_mmap(NULL, 0, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, 0);
+	if (IS_ERR_VALUE(addr))
+		return (int)addr;
+	for (off = 0; off < len; off += PAGE_SIZE) {
+		if (get_user(c, (char __user *)(addr + off))) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	vm_munmap(addr, len);
+	return ret;
+}
+
+/* Returns the time (ns) @iters runs of method @m over @len bytes took, or -errno */
+static s64 czb_run(int m, unsigned long ubuf, size_t len, unsigned long iters)
+{
+	u64 t0 = ktime_get_ns();
+	unsigned long i;
+	int ret = 0;
+
+	for (i = 0; i < iters && !ret; i++) {
+		switch (m) {
+		case CZB_COPY_PAGE:
+			ret = czb_copy_page(ubuf, len);
+			break;
+		case CZB_CLEAR_USER:
+			ret = clear_user((void __user *)ubuf, len) ? -EFAULT : 0;
+			break;
+		case CZB_IOV_ITER:
+			ret = czb_iov_iter(ubuf, len);
+			break;
+		default:
+			ret = czb_mmap(len);
+		}
+	}
+	return ret ? ret : ktime_get_ns() - t0;
+}
+
+static int czb_show(struct seq_file *m, void *v)
+{
+	unsigned long ubuf;
+	size_t len;
+	int meth, ret = 0;
+
+	if (mutex_lock_interruptible(&czb_lock))
+		return -ERESTARTSYS;
+	ubuf = vm_mmap(NULL, 0, CZB_MAX_SZ, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, 0);
+	if (IS_ERR_VALUE(ubuf)) {
+		ret = (int)ubuf;
+		goto out;
+	}
+
+	seq_puts(m, "# zeroing a user buffer: throughput in GB/s\n");
+	seq_printf(m, "# %10s", "size");
+	for (meth = 0; meth < CZB_NR; meth++)
+		seq_printf(m, " %12s", czb_names[meth]);
+	seq_putc(m, '\n');
+
+	for (len = CZB_MIN_SZ; len <= CZB_MAX_SZ && !ret; len <<= 1) {
+		seq_printf(m, "%12zu", len);
+		for (meth = 0; meth < CZB_NR; meth++) {
+			unsigned long iters = 1;
+			u64 centi;
+			s64 ns;
+
+			/* keep doubling the # of runs until it takes long enough to time well */
+			for (;;) {
+				ns = czb_run(meth, ubuf, len, iters);
+				if (ns < 0 || ns >= CZB_MIN_NS || iters >= CZB_MAX_ITERS)
+					break;
+				iters <<= 1;
+				cond_resched();
+			}
+			if (ns < 0) {
+				ret = ns;
+				break;
+			}
+			centi = div64_u64((u64)len * iters * 100, max_t(s64, ns, 1));
+			seq_printf(m, " %9llu.%02llu", centi / 100, centi % 100);
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+		}
+		seq_putc(m, '\n');
+	}
+	vm_munmap(ubuf, CZB_MAX_SZ);
+ out:
+	mutex_unlock(&czb_lock);
+	return ret;
+}
+
+static int czb_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, czb_show, NULL);
+}
+
+static const struct file_operations czb_fops = {
+	.owner = THIS_MODULE,
+	.open = czb_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 /*
  * Register the char 'misc' framework driver with the kernel.
  */
@@ -274,10 +951,14 @@ static int __init cz_init_module(void)
 	int ret;
 	struct device *dev;
 
+	cnul_buf = (void *)__get_free_page(GFP_KERNEL);
+	if (!cnul_buf)
+		return -ENOMEM;
+
 	ret = misc_register(&cz_czero_miscdev);
 	if (ret != 0) {
 		pr_notice("misc device registration 1 failed, aborting\n");
-		return ret;
+		goto out_fail_czero;
 	}
 	dev = cz_czero_miscdev.this_device;
 	dev_info(dev, "cz czero misc driver (major # 10) registered, minor# = %d,"
@@ -286,18 +967,41 @@ static int __init cz_init_module(void)
 	ret = misc_register(&cz_cnul_miscdev);
 	if (ret != 0) {
 		pr_notice("misc device registration 2 failed, aborting\n");
-		return ret;
+		goto out_fail_cnul;
 	}
 	dev_info(dev, "cz cnul misc driver (major # 10) registered, minor# = %d,"
 		 " dev node is /dev/%s\n", cz_cnul_miscdev.minor, cz_cnul_miscdev.name);
 
+	ret = misc_register(&cz_cpat_miscdev);
+	if (ret != 0) {
+		pr_notice("misc device registration 3 failed, aborting\n");
+		goto out_fail_cpat;
+	}
+	dev_info(dev, "cz cpat misc driver (major # 10) registered, minor# = %d,"
+		 " dev node is /dev/%s\n", cz_cpat_miscdev.minor, cz_cpat_miscdev.name);
+
+	/* (not being able to create these isn't fatal) */
+	cz_dbg_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("bench", 0400, cz_dbg_root, NULL, &czb_fops);
+
 	return 0;		/* success */
+
+ out_fail_cpat:
+	misc_deregister(&cz_cnul_miscdev);
+ out_fail_cnul:
+	misc_deregister(&cz_czero_miscdev);
+ out_fail_czero:
+	free_page((unsigned long)cnul_buf);
+	return ret;
 }
 
 static void __exit cz_cleanup_module(void)
 {
+	debugfs_remove_recursive(cz_dbg_root);
+	misc_deregister(&cz_cpat_miscdev);
 	misc_deregister(&cz_cnul_miscdev);
 	misc_deregister(&cz_czero_miscdev);
+	free_page((unsigned long)cnul_buf);
 	pr_info("Unregistered.\n");
 }
 
@@ -305,5 +1009,5 @@ module_init(cz_init_module);
 module_exit(cz_cleanup_module);
 
 MODULE_AUTHOR("Kaiwan NB, kaiwanTECH");
-MODULE_DESCRIPTION("Simple (demo) null and zero memory char (misc) driver");
+MODULE_DESCRIPTION("Simple (demo) null, zero and pattern memory char (misc) driver");
 MODULE_LICENSE("Dual MIT/GPL");
@@ -61,4 +61,52 @@ runcmd "sudo dmesg -c"
 echo
 echo "Test both czero and cnul misc devices:"
 runcmd "dd if=/dev/czero_miscdev of=/dev/cnul_miscdev bs=8k count=3 ; sudo dmesg -c"
+
+echo
+echo "=== Throughput: czero vs the kernel's /dev/zero (should be in the same ballpark
+with cz_enh_miscdrv):"
+runcmd "dd if=/dev/czero_miscdev of=/dev/null bs=1M count=4096"
+runcmd "dd if=/dev/zero of=/dev/null bs=1M count=4096"
+
+[ -c /dev/cpat_miscdev ] && {
+  PARAMS=/sys/module/${DRVNAME}/parameters
+  echo
+  echo "=== Test the cpat misc device:"
+  echo "--- pseudo-random (the default); the same seed must give the same data each time:"
+  runcmd "dd if=/dev/cpat_miscdev bs=64k count=16 2>/dev/null | md5sum"
+  runcmd "dd if=/dev/cpat_miscdev bs=64k count=16 2>/dev/null | md5sum"
+  echo "--- reading from an offset must give the same data as seen there in the stream:"
+  runcmd "dd if=/dev/cpat_miscdev bs=1000 count=5 2>/dev/null | tail -c 17 | hexdump -C"
+  runcmd "dd if=/dev/cpat_miscdev bs=1 skip=4983 count=17 2>/dev/null | hexdump -C"
+  echo "--- a counter, then a repeating pattern:"
+  runcmd "echo 1 | sudo tee ${PARAMS}/pat_mode ; echo 0 | sudo tee ${PARAMS}/pat_seed"
+  runcmd "dd if=/dev/cpat_miscdev bs=64 count=1 2>/dev/null | hexdump -C"
+  runcmd "echo 0 | sudo tee ${PARAMS}/pat_mode ; echo 0xdeadfacedeadface | sudo tee ${PARAMS}/pat_seed"
+  runcmd "dd if=/dev/cpat_miscdev bs=64 count=1 2>/dev/null | hexdump -C"
+  runcmd "echo 2 | sudo tee ${PARAMS}/pat_mode"
+  echo "--- throughput: cpat (pseudo-random) vs the kernel's /dev/urandom:"
+  runcmd "dd if=/dev/cpat_miscdev of=/dev/null bs=1M count=1024"
+  runcmd "dd if=/dev/urandom of=/dev/null bs=1M count=1024"
+}
+
+CNUL=/sys/class/misc/cnul_miscdev
+[ -f ${CNUL}/checksum ] && {
+  echo
+  echo "=== Test the cnul misc device's stats & checksum mode:"
+  runcmd "echo 0 | sudo tee ${CNUL}/checksum"
+  runcmd "dd if=/dev/czero_miscdev of=/dev/cnul_miscdev bs=1M count=4096"
+  runcmd "cat ${CNUL}/bytes ${CNUL}/bytes_per_sec"
+  echo "--- end-to-end: the crc32c must match that of the same data, computed in userspace"
+  echo "    (if you've got a crc32c utility; f.e. from the 'libcrc32c' or 'crc32c' packages):"
+  runcmd "echo 1 | sudo tee ${CNUL}/checksum"
+  runcmd "dd if=/dev/czero_miscdev of=/dev/cnul_miscdev bs=1M count=1024"
+  runcmd "cat ${CNUL}/bytes ${CNUL}/bytes_per_sec ${CNUL}/crc32c"
+  runcmd "echo 0 | sudo tee ${CNUL}/checksum"
+}
+
+sudo test -f /sys/kernel/debug/${DRVNAME}/bench && {
+  echo
+  echo "=== Benchmark: ways to zero a user buffer (takes a few seconds):"
+  runcmd "sudo cat /sys/kernel/debug/${DRVNAME}/bench"
+}
 exit 0
@@ -18,6 +18,70 @@
  * The 'tx' routine then peeks into the SKB, displaying it's vitals (we even show
  * the packet content, including the eth, IP, UDP headers and the data payload!).
  *
+ * Loopback mode (module parameter loopback=1):
+ * Every transmitted frame is put 'on the wire' - the Rx ring of the queue pair
+ * it was sent on - and received right back on this interface by that queue's
+ * NAPI poll routine (with GRO). This makes the driver a self-contained packet
+ * source and sink, handy for measuring stack throughput without a real NIC.
+ * F.e.
+ *   sudo insmod ./veth_netdrv.ko loopback=1 num_queues=4
+ *
+ * XDP: native XDP programs run on this Rx path (XDP_PASS/DROP/TX/REDIRECT), and
+ * the interface can be the target of a XDP_REDIRECT (ndo_xdp_xmit). F.e.
+ *   sudo ip link set dev veth xdpdrv obj xdp_filter.o sec xdp
+ * AF_XDP sockets can bind to any of our queues in zero-copy (XDP_ZEROCOPY) mode;
+ * frames are then received straight into, and transmitted from, their UMEM.
+ *
+ * Flow accounting: Tx'ed IPv4 frames are matched against a runtime table of
+ * (wildcard-able) 5-tuple rules, each with it's own packet/byte counters; by
+ * default there's one rule, for our userspace app's UDP port. F.e.
+ *   echo "add tcp 10.0.0.1 * * 80" | sudo tee /sys/kernel/debug/vnet/veth/flows
+ *   sudo cat /sys/kernel/debug/vnet/veth/flows
+ *
+ * Traffic generator: per-CPU kthreads can inject UDP frames (of configurable
+ * size, rate and # of flows) straight into our Rx path, reporting the Mpps
+ * achieved; a repeatable load source for benchmarking the stack. F.e.
+ *   echo "size 64 flows 16 threads 4" | sudo tee /sys/kernel/debug/vnet/veth/gen
+ *   echo start | sudo tee /sys/kernel/debug/vnet/veth/gen
+ *   sudo cat /sys/kernel/debug/vnet/veth/gen
+ *
+ * Multiple interfaces: 'num_devs' of them are created at load - veth, veth1,
+ * veth2, ... - each fully independent (it's own queues, rings, stats, debugfs
+ * dir, ...). With 'paired=1' they come in peer pairs, veth<->veth1 and so on:
+ * whatever one transmits, the other receives (regardless of 'loopback'), just as
+ * with the kernel's own veth pairs; move the ends into network namespaces to
+ * build multi-hop (routing/forwarding) topologies. More can be added (and any
+ * removed) at runtime, f.e.
+ *   echo "add pair" | sudo tee /sys/kernel/debug/vnet/ctl
+ *   echo "del veth3" | sudo tee /sys/kernel/debug/vnet/ctl
+ *   sudo cat /sys/kernel/debug/vnet/ctl
+ * Or, with iproute2 (any number of queues up to 16, MTU up to 9000):
+ *   sudo ip link add vn0 numtxqueues 4 numrxqueues 4 mtu 9000 type vnet
+ *   sudo ip link add vn1 type vnet
+ *   echo "pair vn0 vn1" | sudo tee /sys/kernel/debug/vnet/ctl
+ *   sudo ip link del vn0
+ *
+ * Link impairment: a netem-like stage on the 'wire' - right as frames leave the
+ * Tx ring - shapes (token bucket), delays (with jitter), loses and reorders
+ * them, per interface, without any qdisc overhead. F.e. a 100 Mbit/s, 20 ms
+ * RTT, lossy link between a pair:
+ *   echo "rate 100000 delay 10000 jitter 500 loss 1000" | sudo tee /sys/kernel/debug/vnet/veth/impair
+ *   echo off | sudo tee /sys/kernel/debug/vnet/veth/impair
+ *
+ * RSS: in loopback mode, a frame's Rx queue is picked just as a real multi-queue
+ * NIC does it - a Toeplitz hash over it's IPv4 5-tuple (which also becomes
+ * skb->hash) indexes an indirection table - and that queue's 'interrupt' (it's
+ * NAPI poll) is raised on that queue's own CPU. The table and key are set with
+ * the usual tools, f.e.
+ *   sudo ethtool -X veth equal 2	# or: weight 1 2 ..., or: hkey <40 bytes>
+ *   ethtool -x veth
+ *
+ * Timestamping (SO_TIMESTAMPING): software Tx timestamps are taken on entry to
+ * vnet_start_xmit(), and - once enabled via SIOCSHWTSTAMP (f.e.
+ * 'hwstamp_ctl -i veth -t 1 -r 1') - 'hardware' ones too: on Tx completion
+ * (i.e. when the frame hits the 'wire') and on Rx delivery to the stack. They're
+ * from CLOCK_REALTIME, as there's no PHC. See talker_dgram / listener_dgram -T.
+ *
  * To try it out:
  * 1. cd <netdrv_veth>
  * 2. cd netdriver/
@@ -28,7 +92,16 @@
  * It should work.. watch the kernel log with 'journalctl -f -k'
 
  *---------------------------------------------------------------------------------
- * Sample output when a UDP packet with the right port# is detected in the Tx path:
+ * Looking at the packets:
+ * Earlier versions SKB_PEEK()'d (hex dumped) every matching packet in the Tx path;
+ * that limits throughput to printk speed. Now, do:
+ *   echo 100 | sudo tee /sys/module/veth_netdrv/parameters/capture_every
+ *   sudo cat /sys/kernel/debug/vnet/veth/capture
+ * to sample 1 in 100 frames (rate-limited by the capture_rate param) into a
+ * lockless per-CPU ring and read back their headers.
+ *
+ * Sample output (from the older SKB_PEEK version) when a UDP packet with the right
+ * port# is detected in the Tx path:
 [ ... ]
 (added the emphasis)                 vvv                vvvvvvvvvv
 buggy_veth_netdrv:vnet_start_xmit(): UDP pkt::src=21124 dest=54295 len=6400
@@ -81,296 +154,4029 @@ Len:       2       14                    20                   8           x
  */
 #include "../veth_common.h"
 
+static int loopback;
+module_param(loopback, int, 0644);
+MODULE_PARM_DESC(loopback, "set this to 1 to loop transmitted frames back into our own Rx path (via NAPI);"
+"default (0) is that transmitted frames are simply dropped");
+
+static int num_queues = 1;
+module_param(num_queues, int, 0444);
+MODULE_PARM_DESC(num_queues, "number of Tx/Rx queue pairs (1.." __stringify(VNET_MAX_QUEUES) "; default 1)");
+
+static int ring_size = VNET_RING_SIZE;
+module_param(ring_size, int, 0444);
+MODULE_PARM_DESC(ring_size, "number of frames each Tx and Rx ring can hold (default " __stringify(VNET_RING_SIZE) ")");
+
+static int tx_coalesce_usecs;
+module_param(tx_coalesce_usecs, int, 0444);
+MODULE_PARM_DESC(tx_coalesce_usecs, "Tx completion 'interrupt' coalescing delay, in us;"
+"default (0) is to complete transmitted frames right away");
+
+static int capture_every;
+module_param(capture_every, int, 0644);
+MODULE_PARM_DESC(capture_every, "sample 1 in every N frames (per CPU) into the debugfs capture ring;"
+"default (0) is that capture is off");
+
+static int capture_rate = 1000;
+module_param(capture_rate, int, 0644);
+MODULE_PARM_DESC(capture_rate, "max frames captured per second, per CPU (default 1000)");
+
+static int num_devs = 1;
+module_param(num_devs, int, 0444);
+MODULE_PARM_DESC(num_devs, "number of interfaces to create at load (0.." __stringify(VNET_MAX_DEVS) "; default 1);"
+"more can be added at runtime, via debugfs (vnet/ctl)");
+
+static int paired;
+module_param(paired, int, 0444);
+MODULE_PARM_DESC(paired, "set this to 1 to create the interfaces as peer pairs (veth<->veth1, veth2<->veth3, ..):"
+"what one transmits, the other receives; default (0) is unpaired");
+
+static struct dentry *vnet_dbg_root, *vnet_dbg_ctl;
+
+/* all our interfaces; the list (and the ida) is protected by vnet_devs_lock */
+static LIST_HEAD(vnet_devs);
+static DEFINE_MUTEX(vnet_devs_lock);
+static DEFINE_IDA(vnet_ida);
+
+/*
+ * Per-queue counters. Each set is only ever updated by it's owner - usually
+ * the queue pair's NAPI poll - so the u64_stats seqcount is all we need (for
+ * 32-bit readers), no lock.
+ */
+struct vnet_qstats {
+	u64 packets;
+	u64 bytes;
+	u64 drops;
+	struct u64_stats_sync syncp;
+};
+
+/* Link impairment counters; owned by the Tx queue's NAPI poll (as is the rest) */
+struct vnet_impair_stats {
+	u64 throttled;			/* times the shaper held the Tx ring back */
+	u64 lost;
+	u64 reordered;			/* sent right away, overtaking the delay line */
+	u64 delayed;
+	u64 overlimit;			/* dropped, as the delay line was full */
+	struct u64_stats_sync syncp;
+};
+
+struct stVnetIntfCtx;
+/*
+ * A Tx queue: a software descriptor ring, as a real NIC would have. The xmit
+ * path (holding the Tx queue lock) is it's only producer, the queue pair's NAPI
+ * poll - our 'Tx completion interrupt' - it's only consumer.
+ */
+struct vnet_txq {
+	struct ptr_ring ring;
+	struct hrtimer timer;		/* Tx completion coalescing */
+	struct stVnetIntfCtx *pstCtx;
+	u16 qid;
+	struct vnet_qstats stats;	/* updated on Tx completion */
+	/* the link impairment stage; see vnet_impair() */
+	struct sk_buff_head delayq;	/* the delay line, in order of due time */
+	u64 delay_last;			/* due time of it's last frame */
+	struct hrtimer wire_timer;	/* next frame due off the delay line, or tokens */
+	struct rnd_state rnd;
+	struct vnet_impair_stats istats;
+} ____cacheline_aligned_in_smp;
+
+/* XDP verdict counters; owned by the Rx queue's NAPI poll */
+struct vnet_xdp_stats {
+	u64 pass;
+	u64 drop;
+	u64 tx;
+	u64 redirect;
+	struct u64_stats_sync syncp;
+};
+
+struct vnet_rq {
+	struct napi_struct napi;
+	struct stVnetIntfCtx *pstCtx;
+	/*
+	 * Frames 'on the wire', awaiting Rx: either skbs (from our xmit path) or
+	 * xdp_frames (redirected to us via ndo_xdp_xmit), the latter tagged with
+	 * VNET_XDP_FLAG in the pointer's low bit.
+	 */
+	struct ptr_ring ring;
+	u16 qid;
+	struct vnet_qstats stats;
+	struct vnet_xdp_stats xdp_stats;
+	struct xdp_rxq_info xdp_rxq;
+	struct xdp_mem_info xdp_mem;	/* our own Rx buffers' mem model */
+	struct page_pool *page_pool;	/* our own Rx buffers; see vnet_rq_create_page_pool() */
+	/* frames accepted by ndo_xdp_xmit; updated under the ring's producer lock */
+	struct vnet_qstats xmit_stats;
+	/* AF_XDP zero-copy socket bound to this queue, if any */
+	struct xsk_buff_pool *xsk_pool;
+	struct vnet_qstats xsk_tx_stats;
+	/* our 'IRQ': the CPU this queue's NAPI poll is raised on, via an IPI */
+	int irq_cpu;
+	call_single_data_t csd;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * A capture record: the leading VNET_CAP_SNAPLEN bytes of a frame (enough for
+ * the Eth + IP + L4 headers), plus a little metadata. 'seq' lets a reader on
+ * another CPU detect (and retry) a record that's being overwritten under it.
+ */
+#define VNET_CAP_RECS		128	/* records per CPU ring */
+#define VNET_CAP_SNAPLEN	96
+
+struct vnet_cap_rec {
+	seqcount_t seq;
+	u64 ts;			/* ktime_get_ns() */
+	u16 len;		/* original frame length */
+	u16 gso_size;		/* non-zero: a TSO/GSO super-frame */
+	u8 caplen;
+	u8 qid;
+	char dir;		/* 'T'x or 'R'x */
+	u8 data[VNET_CAP_SNAPLEN];
+};
+
+/* Only ever written by it's own CPU (with BHs off), so it needs no lock */
+struct vnet_cap_ring {
+	unsigned int head;	/* next slot to write */
+	unsigned int skip;	/* frames to let by until the next sample */
+	unsigned long win_start;	/* rate limiting: 1s window, in jiffies */
+	unsigned int win_count;
+	struct vnet_cap_rec rec[VNET_CAP_RECS];
+};
+
+/* The in-kernel traffic generator; see vnet_gen_start() */
+struct vnet_gen_thread {
+	struct task_struct *task;
+	struct stVnetIntfCtx *pstCtx;
+	unsigned int cpu;
+	u16 qid;
+	struct sk_buff **tmpl;		/* the pre-built frames, one per flow */
+	unsigned int ntmpl;
+	u64 sent;
+	u64 ring_full;			/* frames dropped as the Rx ring was full */
+	struct u64_stats_sync syncp;
+};
+
+struct vnet_gen {
+	bool running;			/* all of this is protected by the RTNL lock */
+	unsigned int size;		/* frame length, from the eth header on */
+	unsigned int flows;
+	unsigned int threads;
+	u64 rate;			/* frames/s, over all threads; 0 = flat out */
+	__be32 saddr, daddr;
+	__be16 dport;
+	struct vnet_gen_thread *thr;
+	unsigned int nthr;
+	u64 t_start, t_end;		/* ktime_get_ns() */
+};
+
+/*
+ * Link impairment config; set under RTNL, read locklessly. The token bucket
+ * is shared by all Tx queues (it's one link), so it has a lock of it's own; it's
+ * taken just twice per Tx completion run, not per frame.
+ */
+#define VNET_IMPAIR_RATE_MAX	100000000ULL	/* kbit/s, i.e. 100 Gbit/s */
+#define VNET_IMPAIR_BURST_MIN	(2 * 65536)	/* bytes; fits any GSO frame */
+#define VNET_IMPAIR_LIMIT	10000		/* frames on each queue's delay line */
+
+struct vnet_impair {
+	bool on;
+	u64 rate;			/* bytes/s; 0 = unlimited */
+	u32 burst_cfg;			/* bytes; 0 = auto */
+	u32 delay_ns, jitter_ns;
+	u32 loss, reorder;		/* probability, as a fraction of 2^32 */
+	u32 loss_ppm, reorder_ppm;	/* ... as it was set */
+	u32 limit;
+	spinlock_t lock;		/* the token bucket */
+	u64 burst;			/* bytes */
+	u64 tokens;			/* bytes */
+	u64 t_last;			/* ns; when the bucket was last refilled */
+};
+
+/*
+ * RSS. The Toeplitz hash of an input is the XOR, over every set bit of it, of
+ * the 32-bit window of the key starting at that bit position. So, per input
+ * byte position and value, that XOR can be precomputed once per key (12 KB for
+ * an IPv4 5-tuple); the per-packet hash is then just 12 lookups.
+ */
+#define VNET_RSS_KEY_SIZE	40	/* as most NICs have it */
+#define VNET_RSS_INDIR_SIZE	128
+#define VNET_RSS_INPUT_MAX	12	/* saddr, daddr, sport, dport */
+
+struct vnet_rss {
+	u8 key[VNET_RSS_KEY_SIZE];
+	u8 indir[VNET_RSS_INDIR_SIZE];	/* Rx queue #s */
+	u32 tbl[VNET_RSS_INPUT_MAX][256];
+};
+
+struct vnet_flow_table;
 struct stVnetIntfCtx {
 	struct net_device *netdev;
-	int txpktnum, rxpktnum;
-	int tx_bytes, rx_bytes;
 	unsigned int data_xform;
 	spinlock_t lock;
+	unsigned int num_queues;
+	unsigned int tx_ring_size;
+	unsigned int rx_ring_size;
+	u32 tx_coal_usecs;
+	struct vnet_cap_ring __percpu *cap;
+	struct dentry *dbg_dir;
+	struct bpf_prog __rcu *xdp_prog;
+	struct vnet_flow_table *flows;
+	struct vnet_gen gen;
+	struct hwtstamp_config tstamp;	/* 'hardware' timestamping config; RTNL */
+	struct vnet_rss rss;		/* updated under RTNL, read locklessly */
+	struct vnet_impair impair;
+	struct net_device __rcu *peer;	/* the other end of our pair, if any; RTNL */
+	struct platform_device *pdev;
+	struct list_head list;		/* on vnet_devs */
+	struct vnet_txq txq[VNET_MAX_QUEUES];
+	struct vnet_rq rq[VNET_MAX_QUEUES];
 };
-static struct stVnetIntfCtx *gpstCtx;
 
-/*
- * The Tx entry point.
- * Runs in process context.
- * To get to the Tx path, try:
- * - running our "custom" simple datagram app "talker_dgram"
- *   ./talker_dgram <IP addr> "<some msg>"
- * - 'ping -c1 10.10.1.x , with 'x' != IP addr (5, in our current setup;
- *   also but realize that ping won't actually work on a local interface).
- * Use a network analyzer (eg Wireshark) to see packets flowing across the interface..
-*/
-static int tx_pkt_count;	//, rx_pkt_count;
-static int vnet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
+static inline void vnet_qstats_add(struct vnet_qstats *qs, u64 packets, u64 bytes)
 {
-	struct iphdr *ip;
-	struct udphdr *udph;
-	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	u64_stats_update_begin(&qs->syncp);
+	qs->packets += packets;
+	qs->bytes += bytes;
+	u64_stats_update_end(&qs->syncp);
+}
 
-//#define SHOW_TIME_SPINLOCK_HELD
-#undef SHOW_TIME_SPINLOCK_HELD
-#ifdef SHOW_TIME_SPINLOCK_HELD
-	u64 ts1, ts2;
-#endif
+#define VNET_XDP_FLAG		BIT(0)
 
-	if (!skb) {		// paranoia!
-		pr_alert("skb NULL!\n");
-		return -EAGAIN;
-	}
-	//SKB_PEEK(skb);
+static inline bool vnet_is_xdp_frame(void *ptr)
+{
+	return (unsigned long)ptr & VNET_XDP_FLAG;
+}
 
-/*
-   The to-be-Tx packet:
-Len:      2       14                    20                   8           x
-         +----------------------------------------------------------------------+
-         |  |  Eth II Hdr  |         IPv4 Hdr         |  UDP Hdr   |  Data      |
-         +----------------------------------------------------------------------+
-         ^  ^                                                            ^      ^
-         |  |                                                            |      |
-skb-> head data                                                        tail   end
-*/
+static inline struct xdp_frame *vnet_ptr_to_xdp(void *ptr)
+{
+	return (void *)((unsigned long)ptr & ~VNET_XDP_FLAG);
+}
 
-	/*---------Packet Filtering :) --------------*/
-	/* If the outgoing packet is not of the UDP protocol, discard it */
-	ip = ip_hdr(skb);
-	if (ip->protocol != IPPROTO_UDP) {	// not UDP proto?
-		pr_cont("x");
-		//pr_debug("not UDP,disregarding pkt..\n");
-		goto out_tx;
-	}
-	//SKB_PEEK(skb);
+static inline void *vnet_xdp_to_ptr(struct xdp_frame *frame)
+{
+	return (void *)((unsigned long)frame | VNET_XDP_FLAG);
+}
 
-	/* If the outgoing packet (of protocol UDP) does not have destination port=54295,
-	 * then it's not sent to our n/w interface via our talker_dgram app, so simply ignore it.
-	 */
-	udph = udp_hdr(skb);
-	pr_debug("UDP pkt::src=%d dest=%d len=%u\n", ntohs(udph->source), ntohs(udph->dest),
-		 udph->len);
-	if (udph->dest != ntohs(PORTNUM))	// port # 54295
-		goto out_tx;
-	//------------------------------
-
-	pr_info("ah, a UDP packet Tx via our app (dest port %d)\n", PORTNUM);
-	SKB_PEEK(skb);
-
-#if 0				// already seen with the SKB_PEEK()
-	pr_debug("data payload:\n");	// it's after the Eth + IP + UDP headers
-	print_hex_dump_bytes(" ", DUMP_PREFIX_OFFSET, skb->head + 16 + 20 + 8, skb->len);
-#endif
+static void vnet_ring_free(void *ptr)
+{
+	if (vnet_is_xdp_frame(ptr))
+		xdp_return_frame(vnet_ptr_to_xdp(ptr));
+	else
+		kfree_skb(ptr);
+}
 
-	/* Update stat counters; ugly with the silly time delta calculation... */
-	spin_lock(&pstCtx->lock);
-#ifdef SHOW_TIME_SPINLOCK_HELD
-	ts1 = ktime_get_real_ns();
-#endif
+/*---------------------------- Sampled packet capture ------------------------
+ * Replaces dumping every packet via printk (which caps throughput at printk
+ * speed!). When enabled via the capture_every module parameter, 1 in N frames
+ * seen on this CPU - subject to capture_rate per second - has it's headers
+ * copied into this CPU's ring; the rings are read via
+ *  /sys/kernel/debug/vnet/<intf>/capture
+ * When capture is off, all it costs the hot path is one (unlikely) branch.
+ */
+/*
+ * We advertise checksum offload, so the stack leaves the L4 checksum of most
+ * frames for 'the hardware' to fill in (CHECKSUM_PARTIAL). Finish it - in the
+ * captured copy only - so the capture shows what would go on a real wire. A
+ * GSO super-frame has no single correct checksum; it's left as is.
+ */
+static void vnet_cap_csum_fixup(const struct sk_buff *skb, struct vnet_cap_rec *rec)
+{
+	int start, off;
+	__wsum csum;
+
+	if (skb->ip_summed != CHECKSUM_PARTIAL || skb_is_gso(skb))
+		return;
+	start = skb_checksum_start_offset(skb);
+	off = start + skb->csum_offset;
+	if (start < 0 || off + sizeof(__sum16) > rec->caplen)
+		return;
+	csum = skb_checksum(skb, start, skb->len - start, 0);
+	put_unaligned(csum_fold(csum) ?: CSUM_MANGLED_0, (__sum16 *)(rec->data + off));
+}
 
-	pstCtx->txpktnum = ++tx_pkt_count;
-	pstCtx->tx_bytes += skb->len;
+static void __vnet_capture(struct stVnetIntfCtx *pstCtx, struct sk_buff *skb, u16 qid,
+			   char dir, int every)
+{
+	struct vnet_cap_ring *cr = this_cpu_ptr(pstCtx->cap);
+	struct vnet_cap_rec *rec;
+	unsigned int caplen;
 
-#ifdef SHOW_TIME_SPINLOCK_HELD
-	ts2 = ktime_get_real_ns();
-#endif
-	spin_unlock(&pstCtx->lock);
+	if (cr->skip) {
+		cr->skip--;
+		return;
+	}
+	cr->skip = every - 1;
 
-#ifdef SHOW_TIME_SPINLOCK_HELD
-	SHOW_DELTA(ts2, ts1);
-#endif
+	if (time_after_eq(jiffies, cr->win_start + HZ)) {
+		cr->win_start = jiffies;
+		cr->win_count = 0;
+	}
+	if (cr->win_count >= READ_ONCE(capture_rate))
+		return;
+	cr->win_count++;
 
-#if 0
-	pr_debug("Emulating Rx by artificially invoking vnet_rx() now...\n");
-	vnet_rx((unsigned long)ndev, skb);
-#endif
- out_tx:
-	dev_kfree_skb(skb);
-	return 0;
+	rec = &cr->rec[cr->head % VNET_CAP_RECS];
+	caplen = min_t(unsigned int, skb->len, VNET_CAP_SNAPLEN);
+
+	write_seqcount_begin(&rec->seq);
+	rec->ts = ktime_get_ns();
+	rec->len = min_t(unsigned int, skb->len, U16_MAX);
+	rec->qid = qid;
+	rec->dir = dir;
+	rec->gso_size = skb_is_gso(skb) ? skb_shinfo(skb)->gso_size : 0;
+	/* skb_copy_bits() copes with non-linear (paged) skbs as well */
+	rec->caplen = skb_copy_bits(skb, 0, rec->data, caplen) ? 0 : caplen;
+	if (rec->caplen)
+		vnet_cap_csum_fixup(skb, rec);
+	write_seqcount_end(&rec->seq);
+	WRITE_ONCE(cr->head, cr->head + 1);
 }
 
-static int vnet_open(struct net_device *ndev)
+static inline void vnet_capture(struct stVnetIntfCtx *pstCtx, struct sk_buff *skb, u16 qid,
+				char dir)
 {
-	QP;
+	int every = READ_ONCE(capture_every);
 
-	netif_carrier_on(ndev);
-	netif_start_queue(ndev);
-	return 0;
+	if (unlikely(every > 0))
+		__vnet_capture(pstCtx, skb, qid, dir, every);
 }
 
-static int vnet_stop(struct net_device *ndev)
+/* Take a consistent snapshot of @src; false if the slot's never been written */
+static bool vnet_cap_read(struct vnet_cap_rec *src, struct vnet_cap_rec *dst)
 {
-	QP;
-	netif_stop_queue(ndev);
-	netif_carrier_off(ndev);
-	return 0;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&src->seq);
+		dst->ts = src->ts;
+		dst->len = src->len;
+		dst->gso_size = src->gso_size;
+		dst->caplen = src->caplen;
+		dst->qid = src->qid;
+		dst->dir = src->dir;
+		memcpy(dst->data, src->data, sizeof(dst->data));
+	} while (read_seqcount_retry(&src->seq, seq));
+
+	return dst->ts != 0;
 }
 
-// Do an 'ifconfig veth' to see the effect of this 'getstats' routine..
-static struct net_device_stats ndstats;
-static struct net_device_stats *vnet_get_stats(struct net_device *ndev)
+/* seq_file iterator; the position encodes (cpu * VNET_CAP_RECS + slot) */
+static void *vnet_cap_start(struct seq_file *m, loff_t *pos)
 {
-	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	unsigned int cpu = *pos / VNET_CAP_RECS;
 
-	spin_lock(&pstCtx->lock);
-	ndstats.rx_packets = pstCtx->rxpktnum;
-	ndstats.rx_bytes = pstCtx->rx_bytes;
-	ndstats.tx_packets = pstCtx->txpktnum;
-	ndstats.tx_bytes = pstCtx->tx_bytes;
-	spin_unlock(&pstCtx->lock);
+	cpu = cpumask_next((int)cpu - 1, cpu_possible_mask);
+	if (cpu >= nr_cpu_ids)
+		return NULL;
+	if (cpu != *pos / VNET_CAP_RECS)
+		*pos = (loff_t)cpu * VNET_CAP_RECS;
+	return pos;
+}
 
-	return &ndstats;
+static void *vnet_cap_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return vnet_cap_start(m, pos);
 }
 
-static void vnet_tx_timeout(struct net_device *ndev, unsigned int txq)
+static void vnet_cap_stop(struct seq_file *m, void *v)
 {
-	pr_info("!! Tx timed out !!\n");
 }
 
-static const struct net_device_ops vnet_netdev_ops = {
-	.ndo_open = vnet_open,
-	.ndo_stop = vnet_stop,
-	.ndo_get_stats = vnet_get_stats,
-//      .ndo_do_ioctl           = vnet_ioctl,
-	.ndo_start_xmit = vnet_start_xmit,
-	.ndo_tx_timeout = vnet_tx_timeout,
-};
+static int vnet_cap_show(struct seq_file *m, void *v)
+{
+	struct stVnetIntfCtx *pstCtx = m->private;
+	loff_t pos = *(loff_t *)v;
+	unsigned int cpu = pos / VNET_CAP_RECS, slot = pos % VNET_CAP_RECS;
+	struct vnet_cap_ring *cr = per_cpu_ptr(pstCtx->cap, cpu);
+	struct vnet_cap_rec rec;
 
-/*
-FIXME: [  579.273860] Device 'vnet.0' does not have a release() function, it is broken and must be fixed.
-*/
-static u8 veth_MAC_addr[6] = { 0x48, 0x0F, 0x0E, 0x0D, 0x0A, 0x02 };
+	/* oldest record first */
+	slot = (READ_ONCE(cr->head) + slot) % VNET_CAP_RECS;
+	if (!vnet_cap_read(&cr->rec[slot], &rec))
+		return 0;
 
-static int vnet_probe(struct platform_device *pdev)
+	seq_printf(m, "# cpu %u q %u %s len %u ts %llu",
+		   cpu, rec.qid, rec.dir == 'T' ? "tx" : "rx", rec.len, rec.ts);
+	if (rec.gso_size)
+		seq_printf(m, " gso %u", rec.gso_size);
+	seq_putc(m, '\n');
+	seq_hex_dump(m, "", DUMP_PREFIX_OFFSET, 16, 1, rec.data, rec.caplen, true);
+	return 0;
+}
+
+static const struct seq_operations vnet_cap_sops = {
+	.start = vnet_cap_start,
+	.next = vnet_cap_next,
+	.stop = vnet_cap_stop,
+	.show = vnet_cap_show,
+};
+DEFINE_SEQ_ATTRIBUTE(vnet_cap);
+
+static int vnet_cap_alloc(struct stVnetIntfCtx *pstCtx)
 {
-	struct net_device *ndev = NULL;
-	int res = 0;
+	int cpu, i;
 
-	QP;
-	ndev = alloc_etherdev(sizeof(struct stVnetIntfCtx));
-	if (!ndev) {
-		pr_alert("alloc_etherdev failed!\n");
+	pstCtx->cap = alloc_percpu(struct vnet_cap_ring);
+	if (!pstCtx->cap)
 		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct vnet_cap_ring *cr = per_cpu_ptr(pstCtx->cap, cpu);
+
+		for (i = 0; i < VNET_CAP_RECS; i++)
+			seqcount_init(&cr->rec[i].seq);
 	}
-#if 0
-	SET_NETDEV_DEV(ndev, &pdev->dev);
-	/* we can't do this here, as the 'pdev->dev'
-	   is a pointer to the 'device' structure, not the net_device ...
-	   So, to make this work, (being able to lookup the net_device struct at will),
-	   we *need* one global pointer to our "driver context"; this is 'gpstCtx' & is
-	   initialized below.. */
-#endif
+	return 0;
+}
 
-	ether_setup(ndev);
-	strscpy(ndev->name, INTF_NAME, strlen(INTF_NAME) + 1);
-	memcpy(ndev->dev_addr, veth_MAC_addr, sizeof(veth_MAC_addr));
+/*------------------------- Flow classification table -----------------------
+ * Transmitted (IPv4) frames are classified against a runtime table of 5-tuple
+ * rules, each with it's own (per-CPU) packet and byte counters. Any field of a
+ * rule may be wildcarded. All rules live in one hash table, keyed on their
+ * masked tuple; a lookup probes it once per distinct mask in use, most
+ * specific first (a 'tuple space search'), so thousands of rules cost no more
+ * than a few hash probes - never a linear scan. Managed via
+ *  /sys/kernel/debug/vnet/<intf>/flows :
+ *   echo "add udp * * * 54295" > flows	# proto saddr sport daddr dport
+ *   echo "del 3" > flows
+ *   echo flush > flows
+ *   cat flows				# the rules, with their counters
+ */
+#define VNET_FLOW_HASH_BITS	12
+#define VNET_FLOW_MAX_RULES	65536
 
-#if 0
-	MAC addr..ndo methods:open xmit stop get_stats do_ioctl ? iomem addr irq
-#endif
-	if (!is_valid_ether_addr(ndev->dev_addr)) {
-		pr_debug("%s: Invalid ethernet MAC address. Please set using ifconfig\n",
-			 ndev->name);
-	}
+/* the fields of a rule that must match */
+#define VNET_FK_PROTO		BIT(0)
+#define VNET_FK_SADDR		BIT(1)
+#define VNET_FK_SPORT		BIT(2)
+#define VNET_FK_DADDR		BIT(3)
+#define VNET_FK_DPORT		BIT(4)
+#define VNET_FK_NMASKS		32
 
-	/* keep the default flags, just add NOARP */
-	ndev->flags |= IFF_NOARP;
+/* all in network byte order; sized as a multiple of u32, for jhash2() */
+struct vnet_flow_key {
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	u8 proto;
+	u8 pad[3];
+};
 
-	ndev->watchdog_timeo = 8 * HZ;
-	spin_lock_init(&gpstCtx->lock);
+struct vnet_flow_ctr {
+	u64 packets;
+	u64 bytes;
+	struct u64_stats_sync syncp;
+};
 
-	/* Initializing the netdev ops struct is essential; else, we Oops.. */
-	ndev->netdev_ops = &vnet_netdev_ops;
+struct vnet_flow_rule {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	struct vnet_flow_key key;	/* already masked */
+	u8 mask;
+	u32 id;
+	struct vnet_flow_ctr __percpu *ctr;
+};
 
-	res = register_netdev(ndev);
-	if (res) {
-		pr_alert("failed to register net device!\n");
-		goto out_regnetdev_fail;
-	}
-	gpstCtx->netdev = ndev;
-	return 0;
+struct vnet_flow_table {
+	DECLARE_HASHTABLE(ht, VNET_FLOW_HASH_BITS);
+	unsigned long masks_in_use;	/* bit n set: some rule uses mask n */
+	unsigned int mask_refs[VNET_FK_NMASKS];
+	unsigned int nr_rules;
+	u32 next_id;
+	struct mutex lock;		/* serializes updaters; lookups use RCU */
+};
 
- out_regnetdev_fail:
-	free_netdev(ndev);
-	return res;
+/* all the masks, most specific (most fields set) first */
+static u8 vnet_fk_mask_order[VNET_FK_NMASKS];
+
+static void __init vnet_flow_init_mask_order(void)
+{
+	int w, m, i = 0;
+
+	for (w = 5; w >= 0; w--)
+		for (m = 0; m < VNET_FK_NMASKS; m++)
+			if (hweight8(m) == w)
+				vnet_fk_mask_order[i++] = m;
 }
 
-static int vnet_remove(struct platform_device *pdev)
+static void vnet_flow_key_mask(const struct vnet_flow_key *key, u8 mask,
+			       struct vnet_flow_key *mkey)
 {
-	struct net_device *ndev = gpstCtx->netdev;
+	memset(mkey, 0, sizeof(*mkey));
+	if (mask & VNET_FK_PROTO)
+		mkey->proto = key->proto;
+	if (mask & VNET_FK_SADDR)
+		mkey->saddr = key->saddr;
+	if (mask & VNET_FK_SPORT)
+		mkey->sport = key->sport;
+	if (mask & VNET_FK_DADDR)
+		mkey->daddr = key->daddr;
+	if (mask & VNET_FK_DPORT)
+		mkey->dport = key->dport;
+}
 
-	QP;
-	unregister_netdev(ndev);
-	free_netdev(ndev);
-	return 0;
+static inline u32 vnet_flow_hash(const struct vnet_flow_key *mkey, u8 mask)
+{
+	return jhash2((const u32 *)mkey, sizeof(*mkey) / sizeof(u32), mask);
+}
+
+/* Find the rule @mkey (masked with @mask) belongs to; caller holds RCU or the lock */
+static struct vnet_flow_rule *vnet_flow_find(struct vnet_flow_table *ft,
+					     const struct vnet_flow_key *mkey, u8 mask)
+{
+	struct vnet_flow_rule *rule;
+
+	hash_for_each_possible_rcu(ft->ht, rule, node, vnet_flow_hash(mkey, mask),
+				   lockdep_is_held(&ft->lock)) {
+		if (rule->mask == mask && !memcmp(&rule->key, mkey, sizeof(*mkey)))
+			return rule;
+	}
+	return NULL;
+}
+
+static struct vnet_flow_rule *vnet_flow_lookup(struct vnet_flow_table *ft,
+					       const struct vnet_flow_key *key)
+{
+	unsigned long masks = READ_ONCE(ft->masks_in_use);
+	struct vnet_flow_rule *rule;
+	struct vnet_flow_key mkey;
+	int i;
+
+	for (i = 0; i < VNET_FK_NMASKS && masks; i++) {
+		u8 m = vnet_fk_mask_order[i];
+
+		if (!(masks & BIT(m)))
+			continue;
+		masks &= ~BIT(m);
+		vnet_flow_key_mask(key, m, &mkey);
+		rule = vnet_flow_find(ft, &mkey, m);
+		if (rule)
+			return rule;
+	}
+	return NULL;
 }
 
 /*
- * Setup a bare-bones platform device & associated driver.
- * Platform devices get bound to their driver simply on the basis of the 'name' field;
- * if they match, the driver core "binds" them, invoking the 'probe' routine. Conversely, the
- * 'remove' method is invoked at unload/shutdown.
- * Done here mainly so that we have a 'probe' method that will get invoked on it's registration.
+ * Account a to-be-Tx'ed frame against the flow rule it matches (if any).
+ * Runs in the xmit path, with BHs off, so this CPU's counters are ours.
  */
-static struct platform_device veth0 = {
-	.name = DRVNAME,
-	.id = 0,
-};
+static void vnet_flow_classify(struct stVnetIntfCtx *pstCtx, struct sk_buff *skb)
+{
+	struct vnet_flow_table *ft = pstCtx->flows;
+	struct vnet_flow_key key = { };
+	struct vnet_flow_rule *rule;
+	struct vnet_flow_ctr *ctr;
+	const struct iphdr *iph;
+	struct iphdr _iph;
+	const __be16 *ports;
+	__be16 _ports[2];
 
-static struct platform_device *veth_platform_devices[] __initdata = {
-	&veth0,
-};
+	if (!READ_ONCE(ft->masks_in_use) || skb->protocol != htons(ETH_P_IP))
+		return;
 
-static struct platform_driver virtnet = {
-	.probe = vnet_probe,
-	.remove = vnet_remove,
-	.driver = {
-		   .name = DRVNAME,
-		   .owner = THIS_MODULE,
-		   },
-};
+/*
+   The to-be-Tx packet:
+Len:      2       14                    20                   8           x
+         +----------------------------------------------------------------------+
+         |  |  Eth II Hdr  |         IPv4 Hdr         |  UDP Hdr   |  Data      |
+         +----------------------------------------------------------------------+
+         ^  ^                                                            ^      ^
+         |  |                                                            |      |
+skb-> head data                                                        tail   end
+*/
+	iph = skb_header_pointer(skb, skb_network_offset(skb), sizeof(_iph), &_iph);
+	if (!iph)
+		return;
+	key.saddr = iph->saddr;
+	key.daddr = iph->daddr;
+	key.proto = iph->protocol;
+	if ((key.proto == IPPROTO_UDP || key.proto == IPPROTO_TCP) && !ip_is_fragment(iph)) {
+		/* the source and dest ports lead both the UDP and the TCP header */
+		ports = skb_header_pointer(skb, skb_network_offset(skb) + iph->ihl * 4,
+					   sizeof(_ports), _ports);
+		if (ports) {
+			key.sport = ports[0];
+			key.dport = ports[1];
+		}
+	}
 
-static int __init vnet_init(void)
+	rcu_read_lock();
+	rule = vnet_flow_lookup(ft, &key);
+	if (rule) {
+		ctr = this_cpu_ptr(rule->ctr);
+		u64_stats_update_begin(&ctr->syncp);
+		ctr->packets++;
+		ctr->bytes += skb->len;
+		u64_stats_update_end(&ctr->syncp);
+	}
+	rcu_read_unlock();
+}
+
+static void vnet_flow_rule_free(struct vnet_flow_rule *rule)
 {
-	int res = 0;
+	free_percpu(rule->ctr);
+	kfree(rule);
+}
 
-	pr_debug("%s: Initializing network driver...\n", DRVNAME);
-	gpstCtx = kzalloc(sizeof(struct stVnetIntfCtx), GFP_KERNEL);
-	if (!gpstCtx)
+static void vnet_flow_rule_free_rcu(struct rcu_head *head)
+{
+	vnet_flow_rule_free(container_of(head, struct vnet_flow_rule, rcu));
+}
+
+static int vnet_flow_add(struct vnet_flow_table *ft, const struct vnet_flow_key *key, u8 mask)
+{
+	struct vnet_flow_rule *rule;
+	int cpu;
+
+	lockdep_assert_held(&ft->lock);
+	if (ft->nr_rules >= VNET_FLOW_MAX_RULES)
+		return -ENOSPC;
+
+	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
+	if (!rule)
+		return -ENOMEM;
+	rule->ctr = alloc_percpu(struct vnet_flow_ctr);
+	if (!rule->ctr) {
+		kfree(rule);
 		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(rule->ctr, cpu)->syncp);
 
-	res = platform_add_devices(veth_platform_devices, ARRAY_SIZE(veth_platform_devices));
-	if (res) {
-		pr_alert("platform_add_devices failed!\n");
-		goto out_fail_pad;
+	vnet_flow_key_mask(key, mask, &rule->key);
+	rule->mask = mask;
+	if (vnet_flow_find(ft, &rule->key, mask)) {
+		vnet_flow_rule_free(rule);
+		return -EEXIST;
 	}
+	rule->id = ++ft->next_id;
 
-	res = platform_driver_register(&virtnet);
-	if (res) {
-		pr_alert("platform_driver_register failed!\n");
-		goto out_fail_pdr;
+	/* publish the rule before lookups can start probing it's mask */
+	hash_add_rcu(ft->ht, &rule->node, vnet_flow_hash(&rule->key, mask));
+	if (ft->mask_refs[mask]++ == 0)
+		WRITE_ONCE(ft->masks_in_use, ft->masks_in_use | BIT(mask));
+	ft->nr_rules++;
+	return 0;
+}
+
+static void vnet_flow_unlink(struct vnet_flow_table *ft, struct vnet_flow_rule *rule)
+{
+	lockdep_assert_held(&ft->lock);
+	hash_del_rcu(&rule->node);
+	if (--ft->mask_refs[rule->mask] == 0)
+		WRITE_ONCE(ft->masks_in_use, ft->masks_in_use & ~BIT(rule->mask));
+	ft->nr_rules--;
+	call_rcu(&rule->rcu, vnet_flow_rule_free_rcu);
+}
+
+static int vnet_flow_del(struct vnet_flow_table *ft, u32 id)
+{
+	struct vnet_flow_rule *rule;
+	int bkt;
+
+	hash_for_each(ft->ht, bkt, rule, node) {
+		if (rule->id == id) {
+			vnet_flow_unlink(ft, rule);
+			return 0;
+		}
 	}
-	// successful platform_driver_register() will cause the registered 'probe'
-	// method to be invoked now..
+	return -ENOENT;
+}
 
-	pr_info("loaded.\n");
-	return res;
+static void vnet_flow_flush(struct vnet_flow_table *ft)
+{
+	struct vnet_flow_rule *rule;
+	struct hlist_node *tmp;
+	int bkt;
 
- out_fail_pdr:
-	platform_driver_unregister(&virtnet);
-	platform_device_unregister(&veth0);
- out_fail_pad:
-	kfree(gpstCtx);
-	return res;
+	hash_for_each_safe(ft->ht, bkt, tmp, rule, node)
+		vnet_flow_unlink(ft, rule);
 }
 
-static void __exit vnet_exit(void)
+static struct vnet_flow_table *vnet_flow_alloc(void)
 {
-#if 0
-	struct net_device *ndev = gpstCtx->netdev;
+	struct vnet_flow_table *ft;
 
-//      unregister_netdev (ndev);
-//      free_netdev (ndev);
-#endif
+	ft = kvzalloc(sizeof(*ft), GFP_KERNEL);
+	if (!ft)
+		return NULL;
+	hash_init(ft->ht);
+	mutex_init(&ft->lock);
+	return ft;
+}
+
+/* Only once there can be no more lookups (the netdev's unregistered) */
+static void vnet_flow_free(struct vnet_flow_table *ft)
+{
+	mutex_lock(&ft->lock);
+	vnet_flow_flush(ft);
+	mutex_unlock(&ft->lock);
+	kvfree(ft);
+}
+
+/* Next whitespace-separated token from *@s, or NULL */
+static char *vnet_next_tok(char **s)
+{
+	char *tok;
+
+	do {
+		tok = strsep(s, " \t");
+	} while (tok && !*tok);
+	return tok;
+}
+
+/* "<proto> <saddr> <sport> <daddr> <dport>", each of which may be '*' */
+static int vnet_flow_parse(char *buf, struct vnet_flow_key *key, u8 *mask)
+{
+	char *tok[5];
+	u16 port;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		tok[i] = vnet_next_tok(&buf);
+		if (!tok[i])
+			return -EINVAL;
+	}
+	memset(key, 0, sizeof(*key));
+	*mask = 0;
+
+	if (strcmp(tok[0], "*")) {
+		if (!strcmp(tok[0], "udp"))
+			key->proto = IPPROTO_UDP;
+		else if (!strcmp(tok[0], "tcp"))
+			key->proto = IPPROTO_TCP;
+		else if (!strcmp(tok[0], "icmp"))
+			key->proto = IPPROTO_ICMP;
+		else if (kstrtou8(tok[0], 0, &key->proto))
+			return -EINVAL;
+		*mask |= VNET_FK_PROTO;
+	}
+	if (strcmp(tok[1], "*")) {
+		if (!in4_pton(tok[1], -1, (u8 *)&key->saddr, -1, NULL))
+			return -EINVAL;
+		*mask |= VNET_FK_SADDR;
+	}
+	if (strcmp(tok[2], "*")) {
+		if (kstrtou16(tok[2], 0, &port))
+			return -EINVAL;
+		key->sport = htons(port);
+		*mask |= VNET_FK_SPORT;
+	}
+	if (strcmp(tok[3], "*")) {
+		if (!in4_pton(tok[3], -1, (u8 *)&key->daddr, -1, NULL))
+			return -EINVAL;
+		*mask |= VNET_FK_DADDR;
+	}
+	if (strcmp(tok[4], "*")) {
+		if (kstrtou16(tok[4], 0, &port))
+			return -EINVAL;
+		key->dport = htons(port);
+		*mask |= VNET_FK_DPORT;
+	}
+	return 0;
+}
+
+static ssize_t vnet_flows_write(struct file *filp, const char __user *ubuf, size_t count,
+				loff_t *ppos)
+{
+	struct stVnetIntfCtx *pstCtx = file_inode(filp)->i_private;
+	struct vnet_flow_table *ft = pstCtx->flows;
+	struct vnet_flow_key key;
+	char kbuf[128], *buf, *cmd;
+	u32 id;
+	u8 mask;
+	int ret;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, ubuf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+	buf = strim(kbuf);
+
+	cmd = vnet_next_tok(&buf);
+	if (!cmd)
+		return -EINVAL;
+
+	mutex_lock(&ft->lock);
+	if (!strcmp(cmd, "add")) {
+		ret = vnet_flow_parse(buf, &key, &mask);
+		if (!ret)
+			ret = vnet_flow_add(ft, &key, mask);
+	} else if (!strcmp(cmd, "del")) {
+		ret = buf ? kstrtou32(strim(buf), 0, &id) : -EINVAL;
+		if (!ret)
+			ret = vnet_flow_del(ft, id);
+	} else if (!strcmp(cmd, "flush")) {
+		vnet_flow_flush(ft);
+		ret = 0;
+	} else
+		ret = -EINVAL;
+	mutex_unlock(&ft->lock);
+
+	return ret ? ret : count;
+}
+
+static void vnet_flow_seq_field(struct seq_file *m, u8 mask, u8 bit, __be32 addr, __be16 port,
+				bool is_addr)
+{
+	if (!(mask & bit))
+		seq_puts(m, "*");
+	else if (is_addr)
+		seq_printf(m, "%pI4", &addr);
+	else
+		seq_printf(m, "%u", ntohs(port));
+}
+
+static int vnet_flows_show(struct seq_file *m, void *v)
+{
+	struct stVnetIntfCtx *pstCtx = m->private;
+	struct vnet_flow_table *ft = pstCtx->flows;
+	struct vnet_flow_rule *rule;
+	int bkt, cpu;
+
+	seq_puts(m, "# id proto saddr:sport -> daddr:dport : packets bytes\n");
+	mutex_lock(&ft->lock);
+	hash_for_each(ft->ht, bkt, rule, node) {
+		u64 packets = 0, bytes = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct vnet_flow_ctr *ctr = per_cpu_ptr(rule->ctr, cpu);
+			unsigned int start;
+			u64 p, b;
+
+			do {
+				start = u64_stats_fetch_begin(&ctr->syncp);
+				p = ctr->packets;
+				b = ctr->bytes;
+			} while (u64_stats_fetch_retry(&ctr->syncp, start));
+			packets += p;
+			bytes += b;
+		}
+
+		seq_printf(m, "%u ", rule->id);
+		if (rule->mask & VNET_FK_PROTO)
+			seq_printf(m, "%u ", rule->key.proto);
+		else
+			seq_puts(m, "* ");
+		vnet_flow_seq_field(m, rule->mask, VNET_FK_SADDR, rule->key.saddr, 0, true);
+		seq_putc(m, ':');
+		vnet_flow_seq_field(m, rule->mask, VNET_FK_SPORT, 0, rule->key.sport, false);
+		seq_puts(m, " -> ");
+		vnet_flow_seq_field(m, rule->mask, VNET_FK_DADDR, rule->key.daddr, 0, true);
+		seq_putc(m, ':');
+		vnet_flow_seq_field(m, rule->mask, VNET_FK_DPORT, 0, rule->key.dport, false);
+		seq_printf(m, " : %llu %llu\n", packets, bytes);
+	}
+	mutex_unlock(&ft->lock);
+	return 0;
+}
+
+static int vnet_flows_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, vnet_flows_show, inode->i_private);
+}
+
+static const struct file_operations vnet_flows_fops = {
+	.owner = THIS_MODULE,
+	.open = vnet_flows_open,
+	.read = seq_read,
+	.write = vnet_flows_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*------------------------------------ XDP ---------------------------------
+ * An attached XDP program runs on every frame our Rx path delivers, in the
+ * queue's NAPI poll, before any skb is built for the stack:
+ *  - frames redirected to us (ndo_xdp_xmit) already are xdp_frames;
+ *  - skbs looped back from our xmit path are copied into a (page_pool) page
+ *    laid out as XDP wants it: XDP_PACKET_HEADROOM, the frame, and room for the
+ *    skb_shared_info at the end, so that on XDP_PASS we can build the skb
+ *    for the stack straight on that page.
+ * XDP_TX: a frame bounced back out goes on the 'wire' just as one redirected
+ * to us does (see vnet_xdp_xmit()): into an Rx ring of our peer, else, in
+ * loopback mode, our own - so a reflector program does see it's frames come
+ * back (and, yes, one that bounces everything has them go round and round; a
+ * poll at a time though). With no other end, they're sent into the void.
+ */
+#define VNET_XDP_MAX_LEN	(PAGE_SIZE - XDP_PACKET_HEADROOM - \
+				 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+#define VNET_XDP_MAX_MTU	(VNET_XDP_MAX_LEN - ETH_HLEN)
+
+/* per NAPI poll tally; folded into the queue's stats at the end of the poll */
+struct vnet_rx_cnt {
+	u32 rcvd;
+	u64 bytes;
+	u32 pass, drop, tx, redirect;	/* XDP verdicts */
+	u32 xsk_tx;
+	u64 xsk_tx_bytes;
+#define VNET_XDP_TX_BULK	16
+	struct xdp_frame *tx_bq[VNET_XDP_TX_BULK];	/* XDP_TX frames yet to go out */
+	u32 tx_n;
+};
+
+static void vnet_xdp_tx_flush(struct vnet_rq *rq, struct vnet_rx_cnt *xc);
+static void vnet_rq_kick(struct stVnetIntfCtx *pstCtx, unsigned long mask);
+
+/* XDP_TX: the frames go out in bulk, at the end of the poll (or when it's full) */
+static void vnet_xdp_tx_queue(struct vnet_rq *rq, struct xdp_frame *frame, struct vnet_rx_cnt *xc)
+{
+	xc->tx_bq[xc->tx_n++] = frame;
+	if (xc->tx_n == VNET_XDP_TX_BULK)
+		vnet_xdp_tx_flush(rq, xc);
+}
+
+/*
+ * Per-queue page_pool: the pages our Rx path copies frames into - for an XDP
+ * program or on the way out of an AF_XDP UMEM - come from, and are recycled
+ * back to, it's own pool, instead of the page allocator. Recycling's lockless
+ * when the page's freed from within our NAPI poll, as on XDP_DROP/TX; pages
+ * of skbs the stack frees elsewhere return via the pool's ptr_ring. (Looped
+ * back skbs without XDP need no buffer at all, they're just passed up.)
+ * With CONFIG_PAGE_POOL_STATS, 'ethtool -S' shows how well it's doing:
+ * rx_pp_alloc_fast is a cache hit, rx_pp_alloc_slow/empty a miss.
+ */
+static int vnet_rq_create_page_pool(struct vnet_rq *rq)
+{
+	struct page_pool_params pp_params = {
+		.order = 0,
+		.pool_size = rq->pstCtx->rx_ring_size,
+		.nid = NUMA_NO_NODE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+		.napi = &rq->napi,	/* allows direct recycling from our NAPI poll */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+		.netdev = rq->pstCtx->netdev,	/* for the page-pool netlink introspection */
+#endif
+	};
+	struct page_pool *pool;
+
+	pool = page_pool_create(&pp_params);
+	if (IS_ERR(pool))
+		return PTR_ERR(pool);
+	rq->page_pool = pool;
+	return 0;
+}
+
+static void vnet_rq_destroy_page_pool(struct vnet_rq *rq)
+{
+	/* pages still in flight keep the pool alive until they come back */
+	page_pool_destroy(rq->page_pool);
+	rq->page_pool = NULL;
+}
+
+/*
+ * Build an skb for the stack around a copy of the @len bytes at @data, in a
+ * page_pool page; it's recycled to the pool when the skb is freed.
+ */
+static struct sk_buff *vnet_pp_build_skb(struct vnet_rq *rq, const void *data, unsigned int len)
+{
+	struct sk_buff *skb;
+	struct page *page;
+	void *va;
+
+	if (unlikely(len > VNET_XDP_MAX_LEN)) {
+		/* won't fit one page (a jumbo frame); fall back to a plain copy */
+		skb = napi_alloc_skb(&rq->napi, len);
+		if (likely(skb))
+			skb_put_data(skb, data, len);
+		return skb;
+	}
+	page = page_pool_dev_alloc_pages(rq->page_pool);
+	if (unlikely(!page))
+		return NULL;
+	va = page_address(page);
+	memcpy(va + XDP_PACKET_HEADROOM, data, len);
+
+	skb = napi_build_skb(va, PAGE_SIZE);
+	if (unlikely(!skb)) {
+		page_pool_put_full_page(rq->page_pool, page, true);
+		return NULL;
+	}
+	skb_mark_for_recycle(skb);
+	skb_reserve(skb, XDP_PACKET_HEADROOM);
+	__skb_put(skb, len);
+	return skb;
+}
+
+static struct sk_buff *vnet_rcv_xdp_frame(struct vnet_rq *rq, struct bpf_prog *prog,
+					  struct xdp_frame *frame, struct vnet_rx_cnt *xc)
+{
+	struct net_device *ndev = rq->pstCtx->netdev;
+	struct xdp_frame orig_frame;
+	struct xdp_buff xdp;
+	struct sk_buff *skb;
+	u32 act;
+
+	if (prog) {
+		xdp_convert_frame_to_buff(frame, &xdp);
+		xdp.rxq = &rq->xdp_rxq;
+
+		act = bpf_prog_run_xdp(prog, &xdp);
+		switch (act) {
+		case XDP_PASS:
+			if (xdp_update_frame_from_buff(&xdp, frame))
+				goto drop;
+			break;
+		case XDP_TX:
+			if (xdp_update_frame_from_buff(&xdp, frame))
+				goto drop;
+			vnet_xdp_tx_queue(rq, frame, xc);
+			return NULL;
+		case XDP_REDIRECT:
+			/* the frame keeps the mem model of whoever allocated it */
+			orig_frame = *frame;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+			/* 6.14 on: there's only the type in the frame; the page_pool is
+			 * found from the page itself
+			 */
+			rq->xdp_rxq.mem.type = frame->mem_type;
+#else
+			rq->xdp_rxq.mem = frame->mem;
+#endif
+			if (xdp_do_redirect(ndev, &xdp, prog)) {
+				frame = &orig_frame;
+				goto drop;
+			}
+			xc->redirect++;
+			return NULL;
+		default:
+			bpf_warn_invalid_xdp_action(ndev, prog, act);
+			fallthrough;
+		case XDP_ABORTED:
+			trace_xdp_exception(ndev, prog, act);
+			fallthrough;
+		case XDP_DROP:
+			goto drop;
+		}
+	}
+
+	skb = xdp_build_skb_from_frame(frame, ndev);	/* also does eth_type_trans() */
+	if (unlikely(!skb))
+		goto drop;
+	xc->pass++;
+	return skb;
+
+ drop:
+	xc->drop++;
+	xdp_return_frame_rx_napi(frame);
+	return NULL;
+}
+
+static struct sk_buff *vnet_rcv_skb_xdp(struct vnet_rq *rq, struct bpf_prog *prog,
+					struct sk_buff *skb, struct vnet_rx_cnt *xc)
+{
+	struct net_device *ndev = rq->pstCtx->netdev;
+	unsigned int len = skb->len + ETH_HLEN;	/* eth_type_trans() pulled the eth hdr */
+	struct xdp_frame *frame;
+	struct xdp_buff xdp;
+	struct page *page;
+	void *va;
+	u32 act;
+
+	if (unlikely(len > VNET_XDP_MAX_LEN))
+		goto drop_skb;
+	page = page_pool_dev_alloc_pages(rq->page_pool);
+	if (unlikely(!page))
+		goto drop_skb;
+	va = page_address(page);
+	if (skb_copy_bits(skb, skb_mac_offset(skb), va + XDP_PACKET_HEADROOM, len)) {
+		page_pool_put_full_page(rq->page_pool, page, true);
+		goto drop_skb;
+	}
+	consume_skb(skb);
+
+	xdp_init_buff(&xdp, PAGE_SIZE, &rq->xdp_rxq);
+	xdp_prepare_buff(&xdp, va, XDP_PACKET_HEADROOM, len, true);
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+	switch (act) {
+	case XDP_PASS:
+		break;
+	case XDP_TX:
+		/* as with XDP_REDIRECT, it's page goes back to our pool in the end */
+		rq->xdp_rxq.mem = rq->xdp_mem;
+		frame = xdp_convert_buff_to_frame(&xdp);
+		if (unlikely(!frame))
+			goto drop_page;
+		vnet_xdp_tx_queue(rq, frame, xc);
+		return NULL;
+	case XDP_REDIRECT:
+		/* it's page goes back to our pool when the target's done with it */
+		rq->xdp_rxq.mem = rq->xdp_mem;
+		if (xdp_do_redirect(ndev, &xdp, prog))
+			goto drop_page;
+		xc->redirect++;
+		return NULL;
+	default:
+		bpf_warn_invalid_xdp_action(ndev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(ndev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		goto drop_page;
+	}
+
+	/* XDP_PASS: the program may have moved the data/meta pointers around */
+	skb = napi_build_skb(va, PAGE_SIZE);
+	if (unlikely(!skb))
+		goto drop_page;
+	/* and back to the pool when the stack frees the skb */
+	skb_mark_for_recycle(skb);
+	skb_reserve(skb, xdp.data - va);
+	__skb_put(skb, xdp.data_end - xdp.data);
+	if (xdp.data_meta != xdp.data)
+		skb_metadata_set(skb, xdp.data - xdp.data_meta);
+	skb->protocol = eth_type_trans(skb, ndev);
+	xc->pass++;
+	return skb;
+
+ drop_page:
+	page_pool_put_full_page(rq->page_pool, page, true);
+	xc->drop++;
+	return NULL;
+ drop_skb:
+	kfree_skb(skb);
+	xc->drop++;
+	return NULL;
+}
+
+/* Register the Rx queue's buffer memory model: UMEM for a zero-copy AF_XDP queue */
+static int vnet_rxq_reg_mem_model(struct vnet_rq *rq)
+{
+	int ret;
+
+	if (rq->xsk_pool) {
+		ret = xdp_rxq_info_reg_mem_model(&rq->xdp_rxq, MEM_TYPE_XSK_BUFF_POOL, NULL);
+		if (!ret)
+			xsk_pool_set_rxq_info(rq->xsk_pool, &rq->xdp_rxq);
+	} else
+		ret = xdp_rxq_info_reg_mem_model(&rq->xdp_rxq, MEM_TYPE_PAGE_POOL, rq->page_pool);
+	if (!ret)
+		rq->xdp_mem = rq->xdp_rxq.mem;
+	return ret;
+}
+
+static int vnet_xdp_set(struct net_device *ndev, struct bpf_prog *prog,
+			struct netlink_ext_ack *extack)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct bpf_prog *old_prog;
+
+	if (prog && ndev->mtu > VNET_XDP_MAX_MTU) {
+		NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP");
+		return -EOPNOTSUPP;
+	}
+	/* NAPI polls pick up the new program on their next run */
+	old_prog = rcu_replace_pointer(pstCtx->xdp_prog, prog, lockdep_rtnl_is_held());
+	if (old_prog)
+		bpf_prog_put(old_prog);
+	return 0;
+}
+
+static int vnet_xsk_pool_setup(struct net_device *ndev, struct xsk_buff_pool *pool, u16 qid);
+
+static int vnet_bpf(struct net_device *ndev, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return vnet_xdp_set(ndev, bpf->prog, bpf->extack);
+	case XDP_SETUP_XSK_POOL:
+		return vnet_xsk_pool_setup(ndev, bpf->xsk.pool, bpf->xsk.queue_id);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * ndo_xdp_xmit: another device XDP_REDIRECTs frames to us, in bulk.
+ * They go on the 'wire' just as our XDP_TX ones do (see vnet_xdp_tx_flush()):
+ * into an Rx ring of our peer, else in loopback mode our own - the whole batch
+ * under a single acquisition of that ring's producer lock - and it's NAPI is
+ * kicked on the flush. With no other end at all, they're 'transmitted' (freed).
+ * Returns the # of frames accepted; the core frees the rest.
+ */
+static int vnet_xdp_xmit(struct net_device *ndev, int n, struct xdp_frame **frames, u32 flags)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct stVnetIntfCtx *dst = NULL;
+	struct net_device *peer;
+	struct vnet_rq *rq, *drq;
+	u64 bytes = 0;
+	int i, nxmit = 0;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+	if (unlikely(!netif_running(ndev) || !netif_carrier_ok(ndev)))
+		return -ENETDOWN;
+
+	rq = &pstCtx->rq[smp_processor_id() % pstCtx->num_queues];
+
+	rcu_read_lock();
+	peer = rcu_dereference(pstCtx->peer);
+	if (peer)
+		dst = netdev_priv(peer);
+	else if (READ_ONCE(loopback))
+		dst = pstCtx;
+
+	if (!dst) {
+		for (i = 0; i < n; i++) {
+			bytes += frames[i]->len;
+			xdp_return_frame(frames[i]);
+		}
+		nxmit = n;
+	} else if (likely(netif_carrier_ok(dst->netdev))) {	/* (else it's rings are gone) */
+		drq = &dst->rq[rq->qid % READ_ONCE(dst->num_queues)];
+		spin_lock(&drq->ring.producer_lock);
+		for (; nxmit < n; nxmit++) {
+			unsigned int len = frames[nxmit]->len;
+
+			if (unlikely(__ptr_ring_produce(&drq->ring, vnet_xdp_to_ptr(frames[nxmit]))))
+				break;
+			bytes += len;
+		}
+		spin_unlock(&drq->ring.producer_lock);
+		if (nxmit && (flags & XDP_XMIT_FLUSH))
+			vnet_rq_kick(dst, BIT(drq->qid));
+	}
+	rcu_read_unlock();
+
+	/* our queue's producer lock serialises it's stats, whichever ring we used */
+	spin_lock(&rq->ring.producer_lock);
+	u64_stats_update_begin(&rq->xmit_stats.syncp);
+	rq->xmit_stats.packets += nxmit;
+	rq->xmit_stats.bytes += bytes;
+	rq->xmit_stats.drops += n - nxmit;
+	u64_stats_update_end(&rq->xmit_stats.syncp);
+	spin_unlock(&rq->ring.producer_lock);
+
+	return nxmit;
+}
+
+/*------------------------------ AF_XDP zero-copy -------------------------
+ * An AF_XDP socket can bind to one of our queues in zero-copy mode; it's
+ * xsk_buff_pool (UMEM) is then that queue's Rx buffer memory:
+ *  - every frame received on the queue is copied (our 'DMA') straight into a
+ *    UMEM buffer taken from the socket's fill ring; the XDP program then
+ *    typically redirects it to the socket (a XSKMAP) - no skb, no more copies;
+ *  - frames the socket transmits (it's Tx ring) are picked up by the queue's
+ *    NAPI poll, sent 'on the wire' - i.e. straight back into this queue's Rx
+ *    in loopback mode - and completed right away.
+ * We only ever touch the UMEM via it's kernel mapping; still, the core insists
+ * on a zero-copy pool being DMA mapped (xp_assign_dev() fails the bind if it
+ * isn't), so we do map it, against vnet_dma_dev() - a device that has a 64-bit
+ * DMA mask set up, so that the mapping's a direct one (no bounce buffers).
+ */
+static void vnet_rx_skb(struct vnet_rq *rq, struct sk_buff *skb, struct vnet_rx_cnt *xc);
+
+/*
+ * A copy of the @len bytes at @data as an xdp_frame, in a page of our page_pool.
+ * (Not via rq->xdp_rxq: on a zero-copy queue, that has the UMEM's mem model.)
+ */
+static struct xdp_frame *vnet_xdp_frame_copy(struct vnet_rq *rq, const void *data,
+					     unsigned int len)
+{
+	struct xdp_rxq_info rxq = rq->xdp_rxq;
+	struct xdp_frame *frame;
+	struct xdp_buff xdp;
+	struct page *page;
+	void *va;
+
+	if (unlikely(len > VNET_XDP_MAX_LEN))
+		return NULL;
+	page = page_pool_dev_alloc_pages(rq->page_pool);
+	if (unlikely(!page))
+		return NULL;
+	va = page_address(page);
+	memcpy(va + XDP_PACKET_HEADROOM, data, len);
+
+	rxq.mem = rq->xdp_mem;
+	xdp_init_buff(&xdp, PAGE_SIZE, &rxq);
+	xdp_prepare_buff(&xdp, va, XDP_PACKET_HEADROOM, len, false);
+	frame = xdp_convert_buff_to_frame(&xdp);
+	if (unlikely(!frame))
+		page_pool_put_full_page(rq->page_pool, page, true);
+	return frame;
+}
+
+/*
+ * Receive a frame into a UMEM buffer and run the XDP program on it. The frame
+ * is either in @skb (from the eth header on) or at @data.
+ */
+static void vnet_rcv_zc(struct vnet_rq *rq, struct xsk_buff_pool *pool, struct bpf_prog *prog,
+			struct sk_buff *skb, const void *data, unsigned int len,
+			struct vnet_rx_cnt *xc)
+{
+	struct net_device *ndev = rq->pstCtx->netdev;
+	struct xdp_frame *frame;
+	struct xdp_buff *xdp;
+	u32 act = XDP_PASS;
+
+	if (unlikely(len > xsk_pool_get_rx_frame_size(pool)))
+		goto drop;
+	xdp = xsk_buff_alloc(pool);
+	if (unlikely(!xdp))	/* fill ring's empty; just as a NIC would, drop */
+		goto drop;
+
+	if (skb) {
+		if (skb_copy_bits(skb, skb_mac_offset(skb), xdp->data, len))
+			goto drop_xdp;
+	} else
+		memcpy(xdp->data, data, len);
+	xdp->data_end = xdp->data + len;
+
+	if (prog)
+		act = bpf_prog_run_xdp(prog, xdp);
+	switch (act) {
+	case XDP_PASS:
+		/* to the stack; the UMEM buffer can't be, so copy out */
+		skb = vnet_pp_build_skb(rq, xdp->data, xdp->data_end - xdp->data);
+		if (unlikely(!skb))
+			goto drop_xdp;
+		xsk_buff_free(xdp);
+		skb->protocol = eth_type_trans(skb, ndev);
+		xc->pass++;
+		vnet_rx_skb(rq, skb, xc);
+		return;
+	case XDP_TX:
+		/* the UMEM buffer's the socket's; what goes out is a copy */
+		frame = vnet_xdp_frame_copy(rq, xdp->data, xdp->data_end - xdp->data);
+		if (unlikely(!frame))
+			goto drop_xdp;
+		xsk_buff_free(xdp);
+		vnet_xdp_tx_queue(rq, frame, xc);
+		return;
+	case XDP_REDIRECT:
+		/* to a XSKMAP, this is the zero-copy delivery to the socket */
+		if (xdp_do_redirect(ndev, xdp, prog))
+			goto drop_xdp;
+		xc->redirect++;
+		return;
+	default:
+		bpf_warn_invalid_xdp_action(ndev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(ndev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		goto drop_xdp;
+	}
+
+ drop_xdp:
+	xsk_buff_free(xdp);
+ drop:
+	xc->drop++;
+}
+
+/* A frame from the Rx ring, on a zero-copy queue; it's consumed */
+static void vnet_rcv_zc_ptr(struct vnet_rq *rq, struct xsk_buff_pool *pool,
+			    struct bpf_prog *prog, void *ptr, struct vnet_rx_cnt *xc)
+{
+	if (vnet_is_xdp_frame(ptr)) {
+		struct xdp_frame *frame = vnet_ptr_to_xdp(ptr);
+
+		vnet_rcv_zc(rq, pool, prog, NULL, frame->data, frame->len, xc);
+		xdp_return_frame_rx_napi(frame);
+	} else {
+		struct sk_buff *skb = ptr;
+
+		vnet_rcv_zc(rq, pool, prog, skb, NULL, skb->len + ETH_HLEN, xc);
+		consume_skb(skb);
+	}
+}
+
+/*
+ * Transmit (up to @budget) frames from the AF_XDP socket's Tx ring.
+ * Returns the # of descriptors processed.
+ */
+static int vnet_xsk_xmit(struct vnet_rq *rq, struct xsk_buff_pool *pool, struct bpf_prog *prog,
+			 int budget, struct vnet_rx_cnt *xc)
+{
+	struct xdp_desc desc;
+	int sent = 0;
+
+	while (sent < budget && xsk_tx_peek_desc(pool, &desc)) {
+		if (READ_ONCE(loopback))
+			vnet_rcv_zc(rq, pool, prog, NULL,
+				    xsk_buff_raw_get_data(pool, desc.addr), desc.len, xc);
+		xc->xsk_tx_bytes += desc.len;
+		sent++;
+	}
+	if (sent) {
+		/* the frame's been copied off the UMEM; complete it right away */
+		xsk_tx_release(pool);
+		xsk_tx_completed(pool, sent);
+		xc->xsk_tx += sent;
+	}
+	return sent;
+}
+
+/*
+ * The device to DMA map UMEMs against: our platform device, or for interfaces
+ * made via 'ip link add' (which have no parent), the module-wide one.
+ */
+static struct platform_device *vnet_dma_pdev;
+
+static struct device *vnet_dma_dev(struct net_device *ndev)
+{
+	return ndev->dev.parent ?: &vnet_dma_pdev->dev;
+}
+
+/* Switch the queue's Rx buffers to @pool (or, if NULL, back to the page pool) */
+static int vnet_xsk_pool_swap(struct net_device *ndev, struct vnet_rq *rq,
+			      struct xsk_buff_pool *pool)
+{
+	bool running = netif_running(ndev);
+	int ret = 0;
+
+	/* quiesce the queue while it's buffer memory model changes under it */
+	if (running)
+		napi_disable(&rq->napi);
+	WRITE_ONCE(rq->xsk_pool, pool);
+	if (running) {
+		xdp_rxq_info_unreg_mem_model(&rq->xdp_rxq);
+		ret = vnet_rxq_reg_mem_model(rq);
+		napi_enable(&rq->napi);
+		/* pick up anything the socket already queued for Tx */
+		local_bh_disable();
+		napi_schedule(&rq->napi);
+		local_bh_enable();
+	}
+	return ret;
+}
+
+/*
+ * XDP_SETUP_XSK_POOL: @pool to enable, NULL to disable (the core does that
+ * too when the socket goes away, or the interface is unregistered).
+ */
+static int vnet_xsk_pool_setup(struct net_device *ndev, struct xsk_buff_pool *pool, u16 qid)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct xsk_buff_pool *old;
+	struct vnet_rq *rq;
+	int ret;
+
+	if (qid >= pstCtx->num_queues)
+		return -EINVAL;
+	rq = &pstCtx->rq[qid];
+	old = rq->xsk_pool;
+	if (pool && old)
+		return -EBUSY;
+	if (!pool && !old)
+		return 0;
+
+	if (pool) {
+		ret = xsk_pool_dma_map(pool, vnet_dma_dev(ndev), 0);
+		if (ret)
+			return ret;
+	}
+	ret = vnet_xsk_pool_swap(ndev, rq, pool);
+	if (ret && pool) {
+		/* the core won't disable what failed to enable; undo it all here */
+		vnet_xsk_pool_swap(ndev, rq, NULL);
+		old = pool;
+	}
+	/* the queue's quiesced & off it by now */
+	if (old)
+		xsk_pool_dma_unmap(old, 0);
+	return ret;
+}
+
+static int vnet_xsk_wakeup(struct net_device *ndev, u32 qid, u32 flags)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct vnet_rq *rq;
+
+	if (unlikely(!netif_running(ndev)))
+		return -ENETDOWN;
+	if (unlikely(qid >= pstCtx->num_queues))
+		return -EINVAL;
+	rq = &pstCtx->rq[qid];
+	if (unlikely(!READ_ONCE(rq->xsk_pool)))
+		return -ENXIO;
+
+	/* our 'interrupt': from process context, so run the softirq right here */
+	if (!napi_if_scheduled_mark_missed(&rq->napi)) {
+		local_bh_disable();
+		napi_schedule(&rq->napi);
+		local_bh_enable();
+	}
+	return 0;
+}
+
+/* Hand an skb to the stack (via GRO) */
+static void vnet_rx_skb(struct vnet_rq *rq, struct sk_buff *skb, struct vnet_rx_cnt *xc)
+{
+	if (unlikely(READ_ONCE(rq->pstCtx->tstamp.rx_filter) != HWTSTAMP_FILTER_NONE)) {
+		/*
+		 * The Rx 'hardware' timestamp: the moment we hand the frame up. It
+		 * lives in the shared info, which a looped back (or generated) skb
+		 * may share with a clone - f.e. the Tx timestamp sitting on the
+		 * sender's error queue - so unshare it first.
+		 */
+		if (unlikely(skb_unclone(skb, GFP_ATOMIC))) {
+			kfree_skb(skb);
+			xc->drop++;
+			return;
+		}
+		skb_hwtstamps(skb)->hwtstamp = ktime_get_real();
+	}
+	xc->rcvd++;
+	xc->bytes += skb->len;
+	if (unlikely(READ_ONCE(capture_every) > 0)) {
+		/* capture from the eth header on, as on Tx */
+		__skb_push(skb, ETH_HLEN);
+		vnet_capture(rq->pstCtx, skb, rq->qid, 'R');
+		__skb_pull(skb, ETH_HLEN);
+	}
+	skb_record_rx_queue(skb, rq->qid);
+	napi_gro_receive(&rq->napi, skb);
+}
+
+/*
+ * vnet_rx()
+ * The Rx 'bottom half': runs in softirq context as (part of) the NAPI poll.
+ * Drains up to @budget frames from the queue's ring, runs the XDP program (if
+ * any) on them and hands the survivors to the stack via GRO.
+ */
+static void vnet_rcv_one(struct vnet_rq *rq, struct bpf_prog *prog, struct xsk_buff_pool *pool,
+			 void *ptr, struct vnet_rx_cnt *xc)
+{
+	struct sk_buff *skb;
+
+	if (pool) {
+		vnet_rcv_zc_ptr(rq, pool, prog, ptr, xc);
+		return;
+	}
+	if (vnet_is_xdp_frame(ptr))
+		skb = vnet_rcv_xdp_frame(rq, prog, vnet_ptr_to_xdp(ptr), xc);
+	else if (prog)
+		skb = vnet_rcv_skb_xdp(rq, prog, ptr, xc);
+	else
+		skb = ptr;
+	if (skb)
+		vnet_rx_skb(rq, skb, xc);
+}
+
+/*
+ * With TSO/GSO and checksum offload advertised, what we 'transmit' and loop
+ * back is typically a 64k super-frame with it's L4 checksum still to be done.
+ * The stack's happy to receive just that (it's what GRO would've built anyway),
+ * so normally we do nothing. But an XDP program or AF_XDP socket expects
+ * wire-format frames: only then do we segment the frame into MTU-sized
+ * packets and have their checksums computed - in software, lazily.
+ * Returns the list of segments (perhaps just @skb), or NULL if it was dropped.
+ */
+static struct sk_buff *vnet_rx_gso_segment(struct sk_buff *skb, struct vnet_rx_cnt *xc)
+{
+	struct sk_buff *segs, *seg;
+
+	if (!skb_is_gso(skb))
+		return skb;
+
+	/* GSO wants skb->data at the eth header, as it'd be on the Tx side */
+	__skb_push(skb, ETH_HLEN);
+	segs = __skb_gso_segment(skb, 0, false);
+	if (IS_ERR_OR_NULL(segs)) {
+		kfree_skb(skb);
+		xc->drop++;
+		return NULL;
+	}
+	consume_skb(skb);
+	for (seg = segs; seg; seg = seg->next)
+		__skb_pull(seg, ETH_HLEN);
+	return segs;
+}
+
+static int vnet_rx(struct vnet_rq *rq, struct bpf_prog *prog, struct xsk_buff_pool *pool,
+		   int budget, struct vnet_rx_cnt *xc)
+{
+	struct sk_buff *skb, *next;
+	int done = 0;
+	void *ptr;
+
+	while (done < budget) {
+		ptr = __ptr_ring_consume(&rq->ring);
+		if (!ptr)
+			break;
+		done++;
+
+		if ((!prog && !pool) || vnet_is_xdp_frame(ptr)) {
+			vnet_rcv_one(rq, prog, pool, ptr, xc);
+			continue;
+		}
+
+		skb_list_walk_safe(vnet_rx_gso_segment(ptr, xc), skb, next) {
+			skb_mark_not_on_list(skb);
+			if (skb->ip_summed == CHECKSUM_PARTIAL && skb_checksum_help(skb)) {
+				kfree_skb(skb);
+				xc->drop++;
+				continue;
+			}
+			vnet_rcv_one(rq, prog, pool, skb, xc);
+		}
+	}
+	return done;
+}
+
+static void vnet_rx_stats_fold(struct vnet_rq *rq, struct vnet_rx_cnt *xc, bool xdp)
+{
+	u64_stats_update_begin(&rq->stats.syncp);
+	rq->stats.packets += xc->rcvd;
+	rq->stats.bytes += xc->bytes;
+	if (!xdp)
+		rq->stats.drops += xc->drop;
+	u64_stats_update_end(&rq->stats.syncp);
+
+	if (xdp) {
+		u64_stats_update_begin(&rq->xdp_stats.syncp);
+		rq->xdp_stats.pass += xc->pass;
+		rq->xdp_stats.drop += xc->drop;
+		rq->xdp_stats.tx += xc->tx;
+		rq->xdp_stats.redirect += xc->redirect;
+		u64_stats_update_end(&rq->xdp_stats.syncp);
+	}
+	if (xc->xsk_tx)
+		vnet_qstats_add(&rq->xsk_tx_stats, xc->xsk_tx, xc->xsk_tx_bytes);
+}
+
+/*------------------------------------ RSS ------------------------------------
+ * Only frames we put 'on the wire' ourselves (loopback) are steered; the ones
+ * redirected to us (ndo_xdp_xmit) or generated in-kernel land in the Rx queue
+ * they were meant for.
+ */
+static void vnet_rss_build_tbl(struct vnet_rss *rss)
+{
+	unsigned int pos, v, bit;
+
+	for (pos = 0; pos < VNET_RSS_INPUT_MAX; pos++) {
+		/* the key windows for the 8 bits of this input byte, MSB first */
+		u64 k = get_unaligned_be64(&rss->key[pos]);
+		u32 win[8];
+
+		for (bit = 0; bit < 8; bit++)
+			win[bit] = (u32)(k >> (32 - bit));
+		for (v = 0; v < 256; v++) {
+			u32 h = 0;
+
+			for (bit = 0; bit < 8; bit++)
+				if (v & (0x80 >> bit))
+					h ^= win[bit];
+			WRITE_ONCE(rss->tbl[pos][v], h);
+		}
+	}
+}
+
+static void vnet_rss_indir_default(struct stVnetIntfCtx *pstCtx)
+{
+	unsigned int i;
+
+	for (i = 0; i < VNET_RSS_INDIR_SIZE; i++)
+		WRITE_ONCE(pstCtx->rss.indir[i], ethtool_rxfh_indir_default(i, pstCtx->num_queues));
+}
+
+static inline u32 vnet_toeplitz(const struct vnet_rss *rss, const u8 *in, unsigned int len)
+{
+	unsigned int i;
+	u32 h = 0;
+
+	for (i = 0; i < len; i++)
+		h ^= READ_ONCE(rss->tbl[i][in[i]]);
+	return h;
+}
+
+/*
+ * Hash the frame (skb->data at the network header) as the 'NIC' would, set
+ * skb->hash and return the Rx queue the indirection table picks; or @qid (the
+ * queue pair it was sent on) if it's not IPv4.
+ */
+static u16 vnet_rss_select(struct stVnetIntfCtx *pstCtx, struct sk_buff *skb, u16 qid)
+{
+	enum pkt_hash_types type = PKT_HASH_TYPE_L3;
+	u8 in[VNET_RSS_INPUT_MAX];
+	unsigned int len = 8;
+	const struct iphdr *iph;
+	struct iphdr _iph;
+	u32 hash;
+
+	if (skb->protocol != htons(ETH_P_IP))
+		return qid;
+	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+	if (!iph || iph->ihl < 5)
+		return qid;
+
+	memcpy(in, &iph->saddr, 8);	/* saddr, daddr */
+	if (!ip_is_fragment(iph) &&
+	    (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) &&
+	    !skb_copy_bits(skb, iph->ihl * 4, &in[8], 4)) {	/* sport, dport */
+		len = VNET_RSS_INPUT_MAX;
+		type = PKT_HASH_TYPE_L4;
+	}
+	hash = vnet_toeplitz(&pstCtx->rss, in, len);
+	if (pstCtx->netdev->features & NETIF_F_RXHASH)
+		skb_set_hash(skb, hash, type);
+	return READ_ONCE(pstCtx->rss.indir[hash % VNET_RSS_INDIR_SIZE]);
+}
+
+/* Our 'Rx interrupt handler', run on the queue's irq_cpu */
+static void vnet_rq_irq(void *info)
+{
+	struct vnet_rq *rq = info;
+
+	napi_schedule(&rq->napi);
+}
+
+/* Raise the Rx 'interrupt' of every queue in @mask, on it's own CPU */
+static void vnet_rq_kick(struct stVnetIntfCtx *pstCtx, unsigned long mask)
+{
+	unsigned int q;
+
+	for_each_set_bit(q, &mask, VNET_MAX_QUEUES) {
+		struct vnet_rq *rq = &pstCtx->rq[q];
+		int ret = 0;
+
+		if (rq->irq_cpu != smp_processor_id())
+			ret = smp_call_function_single_async(rq->irq_cpu, &rq->csd);
+		/* -EBUSY: an IPI's already on it's way; that'll do. Else, poll here */
+		if (rq->irq_cpu == smp_processor_id() || (ret && ret != -EBUSY))
+			napi_schedule(&rq->napi);
+	}
+}
+
+/*
+ * Put the poll's XDP_TX frames on the 'wire', as vnet_xdp_xmit() does with
+ * redirected ones; into the Rx ring of our peer, else in loopback mode our
+ * own, picked by queue #.
+ * Those for our own queue are received on the next poll; any other's kicked.
+ */
+static void vnet_xdp_tx_flush(struct vnet_rq *rq, struct vnet_rx_cnt *xc)
+{
+	struct stVnetIntfCtx *dst = NULL;
+	struct net_device *peer;
+	struct vnet_rq *drq;
+	u32 i, sent = 0;
+
+	if (!xc->tx_n)
+		return;
+
+	rcu_read_lock();
+	peer = rcu_dereference(rq->pstCtx->peer);
+	if (peer)
+		dst = netdev_priv(peer);
+	else if (READ_ONCE(loopback))
+		dst = rq->pstCtx;
+
+	if (!dst) {
+		/* there's no other end; off into the void, like any Tx */
+		for (i = 0; i < xc->tx_n; i++)
+			xdp_return_frame_rx_napi(xc->tx_bq[i]);
+		sent = xc->tx_n;
+	} else if (likely(netif_carrier_ok(dst->netdev))) {	/* (else it's rings are gone) */
+		drq = &dst->rq[rq->qid % READ_ONCE(dst->num_queues)];
+		spin_lock(&drq->ring.producer_lock);
+		for (; sent < xc->tx_n; sent++)
+			if (__ptr_ring_produce(&drq->ring, vnet_xdp_to_ptr(xc->tx_bq[sent])))
+				break;
+		spin_unlock(&drq->ring.producer_lock);
+		if (sent && drq != rq)
+			vnet_rq_kick(dst, BIT(drq->qid));
+	}
+	/* what didn't make it (ring full, or the other end's down) is dropped */
+	for (i = sent; i < xc->tx_n; i++)
+		xdp_return_frame_rx_napi(xc->tx_bq[i]);
+	rcu_read_unlock();
+
+	xc->tx += sent;
+	xc->drop += xc->tx_n - sent;
+	xc->tx_n = 0;
+}
+
+/*----------------------------- Link impairment ------------------------------
+ * Applied as a frame leaves the Tx ring, i.e. goes 'on the wire', in order:
+ *  - rate: a token bucket (bytes/s, shared by all the interface's Tx queues).
+ *    Out of tokens, Tx completion just stops and retries off an hrtimer when
+ *    there'll be enough; the Tx ring fills, BQL and the queue stop throttle the
+ *    stack - just like a slow link does. Nothing's dropped here.
+ *  - loss: random, uniform.
+ *  - reorder: that fraction of frames skips the delay line, overtaking frames
+ *    already on it (so, as with netem, it needs a delay to have any effect).
+ *  - delay and jitter: the frame's held on the (per Tx queue) delay line until
+ *    it's due, off an hrtimer. Jitter varies the delay, but never reorders:
+ *    a frame's never due before the one ahead of it; the delay line's a FIFO,
+ *    so this stays O(1) per frame at any rate.
+ * Randomness is from a per-queue PRNG; cheap, and plenty for this.
+ */
+struct vnet_wire_cb {
+	u64 due;			/* ns, ktime_get_ns() */
+};
+#define VNET_WIRE_CB(skb)	((struct vnet_wire_cb *)(skb)->cb)
+
+/* Refill the bucket and take all of it; returns the # of bytes we may send */
+static u64 vnet_shaper_take(struct vnet_impair *imp, u64 now)
+{
+	u64 tokens, elapsed;
+
+	spin_lock(&imp->lock);
+	/* a second's worth is more than any burst; and keeps the multiply in range */
+	elapsed = min_t(u64, now - imp->t_last, NSEC_PER_SEC);
+	tokens = min(imp->tokens + div_u64(elapsed * imp->rate, NSEC_PER_SEC), imp->burst);
+	imp->tokens = 0;
+	imp->t_last = now;
+	spin_unlock(&imp->lock);
+	return tokens;
+}
+
+/* ... and give back what we didn't use */
+static void vnet_shaper_give(struct vnet_impair *imp, u64 tokens)
+{
+	spin_lock(&imp->lock);
+	imp->tokens = min(imp->tokens + tokens, imp->burst);
+	spin_unlock(&imp->lock);
+}
+
+/* ns until there're @len bytes worth of tokens, having @avail */
+static u64 vnet_shaper_wait(struct vnet_impair *imp, u64 len, u64 avail)
+{
+	u64 rate = READ_ONCE(imp->rate);
+
+	return rate ? div64_u64((len - avail) * NSEC_PER_SEC, rate) : 0;
+}
+
+static inline bool vnet_impair_chance(struct vnet_txq *txq, u32 prob)
+{
+	return prob && prandom_u32_state(&txq->rnd) < prob;
+}
+
+/*
+ * Lose, delay (or reorder) a frame that's just left the Tx ring. Returns true
+ * if it's been consumed - lost, or on the delay line - else it's to go on the
+ * wire right away. *@lost is incremented for frames dropped.
+ */
+static bool vnet_impair(struct vnet_txq *txq, struct vnet_impair *imp, struct sk_buff *skb,
+			u64 now, unsigned int *lost)
+{
+	u32 delay = READ_ONCE(imp->delay_ns), jitter = READ_ONCE(imp->jitter_ns);
+	u64 due;
+
+	if (vnet_impair_chance(txq, READ_ONCE(imp->loss))) {
+		kfree_skb(skb);
+		(*lost)++;
+		u64_stats_update_begin(&txq->istats.syncp);
+		txq->istats.lost++;
+		u64_stats_update_end(&txq->istats.syncp);
+		return true;
+	}
+	if (!delay && !jitter)
+		return false;
+	if (vnet_impair_chance(txq, READ_ONCE(imp->reorder))) {
+		u64_stats_update_begin(&txq->istats.syncp);
+		txq->istats.reordered++;
+		u64_stats_update_end(&txq->istats.syncp);
+		return false;
+	}
+	if (unlikely(skb_queue_len(&txq->delayq) >= READ_ONCE(imp->limit))) {
+		kfree_skb(skb);
+		(*lost)++;
+		u64_stats_update_begin(&txq->istats.syncp);
+		txq->istats.overlimit++;
+		u64_stats_update_end(&txq->istats.syncp);
+		return true;
+	}
+
+	due = now + delay;
+	if (jitter) {
+		/* uniform over [delay - jitter, delay + jitter] */
+		due += reciprocal_scale(prandom_u32_state(&txq->rnd), 2 * jitter + 1);
+		due = due > jitter ? due - jitter : 0;
+	}
+	due = max(due, txq->delay_last);
+	txq->delay_last = due;
+	VNET_WIRE_CB(skb)->due = due;
+	__skb_queue_tail(&txq->delayq, skb);
+	u64_stats_update_begin(&txq->istats.syncp);
+	txq->istats.delayed++;
+	u64_stats_update_end(&txq->istats.syncp);
+	return true;
+}
+
+/* Have the queue's Tx completion run again at @when (ns), unless it's due sooner */
+static void vnet_wire_timer_arm(struct vnet_txq *txq, u64 when)
+{
+	if (hrtimer_is_queued(&txq->wire_timer) &&
+	    ktime_to_ns(hrtimer_get_expires(&txq->wire_timer)) <= when)
+		return;
+	hrtimer_start(&txq->wire_timer, ns_to_ktime(when), HRTIMER_MODE_ABS_SOFT);
+}
+
+static enum hrtimer_restart vnet_wire_timer_fn(struct hrtimer *timer)
+{
+	struct vnet_txq *txq = container_of(timer, struct vnet_txq, wire_timer);
+
+	napi_schedule(&txq->pstCtx->rq[txq->qid].napi);
+	return HRTIMER_NORESTART;
+}
+
+static void vnet_impair_init(struct vnet_impair *imp)
+{
+	spin_lock_init(&imp->lock);
+	imp->limit = VNET_IMPAIR_LIMIT;
+	imp->burst = VNET_IMPAIR_BURST_MIN;
+}
+
+/* Apply a config change; resets the token bucket (to full) */
+static void vnet_impair_update(struct vnet_impair *imp)
+{
+	spin_lock_bh(&imp->lock);
+	imp->burst = imp->burst_cfg ?:
+		max_t(u64, div_u64(imp->rate, MSEC_PER_SEC), VNET_IMPAIR_BURST_MIN);
+	imp->tokens = imp->burst;
+	imp->t_last = ktime_get_ns();
+	spin_unlock_bh(&imp->lock);
+	WRITE_ONCE(imp->on, imp->rate || imp->delay_ns || imp->jitter_ns || imp->loss);
+}
+
+static u32 vnet_ppm_to_prob(u32 ppm)
+{
+	return (u32)div_u64((u64)ppm << 32, 1000000);
+}
+
+/*
+ * rate <kbit/s>, burst <bytes>, delay <us>, jitter <us>, loss <ppm>,
+ * reorder <ppm>, limit <frames>; 0 turns any of them off
+ */
+static int vnet_impair_set(struct vnet_impair *imp, const char *key, const char *val)
+{
+	u64 v;
+
+	if (kstrtou64(val, 0, &v))
+		return -EINVAL;
+	if (!strcmp(key, "rate")) {
+		if (v > VNET_IMPAIR_RATE_MAX)
+			return -EINVAL;
+		WRITE_ONCE(imp->rate, div_u64(v * 1000, 8));
+	} else if (!strcmp(key, "burst")) {
+		if (v && (v < VNET_IMPAIR_BURST_MIN || v > U32_MAX))
+			return -EINVAL;
+		imp->burst_cfg = v;
+	} else if (!strcmp(key, "delay") || !strcmp(key, "jitter")) {
+		if (v > USEC_PER_SEC)
+			return -EINVAL;
+		if (key[0] == 'd')
+			WRITE_ONCE(imp->delay_ns, v * NSEC_PER_USEC);
+		else
+			WRITE_ONCE(imp->jitter_ns, v * NSEC_PER_USEC);
+	} else if (!strcmp(key, "loss") || !strcmp(key, "reorder")) {
+		if (v > 1000000)
+			return -EINVAL;
+		if (key[0] == 'l') {
+			imp->loss_ppm = v;
+			WRITE_ONCE(imp->loss, vnet_ppm_to_prob(v));
+		} else {
+			imp->reorder_ppm = v;
+			WRITE_ONCE(imp->reorder, vnet_ppm_to_prob(v));
+		}
+	} else if (!strcmp(key, "limit")) {
+		if (!v || v > VNET_IMPAIR_LIMIT * 100)
+			return -EINVAL;
+		WRITE_ONCE(imp->limit, v);
+	} else
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * The debugfs handlers that need RTNL mustn't block on it: unregistering an
+ * interface holds RTNL while it removes the interface's debugfs dir (in
+ * vnet_uninit()), and that waits for these very handlers to return. So, just
+ * try for it, and if it's busy have the syscall restarted (by which time the
+ * file may well be gone; the restart then fails cleanly).
+ */
+static int vnet_dbg_rtnl_lock(void)
+{
+	if (!rtnl_trylock())
+		return restart_syscall();
+	return 0;
+}
+
+/* "off" and/or any number of "<param> <value>" pairs */
+static ssize_t vnet_impair_write(struct file *filp, const char __user *ubuf, size_t count,
+				 loff_t *ppos)
+{
+	struct stVnetIntfCtx *pstCtx = file_inode(filp)->i_private;
+	struct vnet_impair *imp = &pstCtx->impair;
+	char kbuf[160], *buf, *key, *val;
+	int ret = 0;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, ubuf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+	buf = strim(kbuf);
+
+	ret = vnet_dbg_rtnl_lock();
+	if (ret)
+		return ret;
+	while (!ret && (key = vnet_next_tok(&buf))) {
+		if (!strcmp(key, "off")) {
+			WRITE_ONCE(imp->rate, 0);
+			WRITE_ONCE(imp->delay_ns, 0);
+			WRITE_ONCE(imp->jitter_ns, 0);
+			WRITE_ONCE(imp->loss, 0);
+			WRITE_ONCE(imp->reorder, 0);
+			imp->loss_ppm = imp->reorder_ppm = imp->burst_cfg = 0;
+		} else {
+			val = vnet_next_tok(&buf);
+			ret = val ? vnet_impair_set(imp, key, val) : -EINVAL;
+		}
+	}
+	/* whatever did get set, takes effect */
+	vnet_impair_update(imp);
+	rtnl_unlock();
+
+	return ret ? ret : count;
+}
+
+static int vnet_impair_show(struct seq_file *m, void *v)
+{
+	struct stVnetIntfCtx *pstCtx = m->private;
+	struct vnet_impair *imp = &pstCtx->impair;
+	unsigned int i;
+	int ret;
+
+	ret = vnet_dbg_rtnl_lock();
+	if (ret)
+		return ret;
+	seq_printf(m, "%s: rate %llu kbit/s burst %llu delay %u us jitter %u us loss %u ppm reorder %u ppm limit %u\n",
+		   imp->on ? "on" : "off", div_u64(imp->rate * 8, 1000), imp->burst,
+		   imp->delay_ns / NSEC_PER_USEC, imp->jitter_ns / NSEC_PER_USEC,
+		   imp->loss_ppm, imp->reorder_ppm, imp->limit);
+	seq_puts(m, "# queue throttled lost reordered delayed overlimit\n");
+	for (i = 0; i < pstCtx->num_queues; i++) {
+		struct vnet_impair_stats *is = &pstCtx->txq[i].istats;
+		u64 throttled, lost, reordered, delayed, overlimit;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin(&is->syncp);
+			throttled = is->throttled;
+			lost = is->lost;
+			reordered = is->reordered;
+			delayed = is->delayed;
+			overlimit = is->overlimit;
+		} while (u64_stats_fetch_retry(&is->syncp, start));
+		seq_printf(m, "%u %llu %llu %llu %llu %llu\n", i, throttled, lost, reordered,
+			   delayed, overlimit);
+	}
+	rtnl_unlock();
+	return 0;
+}
+
+static int vnet_impair_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, vnet_impair_show, inode->i_private);
+}
+
+static const struct file_operations vnet_impair_fops = {
+	.owner = THIS_MODULE,
+	.open = vnet_impair_open,
+	.read = seq_read,
+	.write = vnet_impair_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*----------------------------- Software Tx ring -----------------------------
+ * vnet_start_xmit() just posts the skb to the queue's Tx ring and - unless the
+ * stack says more frames are right behind it (netdev_xmit_more()) - 'rings the
+ * doorbell'. The 'hardware' then raises a Tx completion 'interrupt': the queue
+ * pair's NAPI poll is scheduled, right away or, with Tx coalescing on, off an
+ * hrtimer. There, the completed skbs are put on the wire (looped back) or
+ * freed, in bulk, and reported to BQL (Byte Queue Limits), which in turn
+ * throttles the qdisc above us - just as with a real NIC.
+ */
+static enum hrtimer_restart vnet_tx_timer_fn(struct hrtimer *timer)
+{
+	struct vnet_txq *txq = container_of(timer, struct vnet_txq, timer);
+
+	napi_schedule(&txq->pstCtx->rq[txq->qid].napi);
+	return HRTIMER_NORESTART;
+}
+
+/* Ring the doorbell: have the 'hardware' process (and complete) the Tx ring */
+static void vnet_tx_kick(struct vnet_txq *txq)
+{
+	u32 usecs = READ_ONCE(txq->pstCtx->tx_coal_usecs);
+
+	if (!usecs)
+		napi_schedule(&txq->pstCtx->rq[txq->qid].napi);
+	else if (!hrtimer_is_queued(&txq->timer))
+		hrtimer_start(&txq->timer, us_to_ktime(usecs), HRTIMER_MODE_REL_SOFT);
+}
+
+/*
+ * Put a completed Tx frame 'on the wire': it lands in the Rx ring of @dst - our
+ * peer, else ourselves - that RSS picks. That's often @self, the Rx side of the
+ * queue pair it was sent on, to be received by the very NAPI poll we're running
+ * in; any other queue of @dst is added to @kick, to have it's poll raised once
+ * we're done. Consumes the skb; returns 0 if it was queued for Rx.
+ * Call under RCU; @dst's rings only exist while it's carrier is on.
+ */
+static int vnet_loopback(struct stVnetIntfCtx *dst, struct sk_buff *skb, struct vnet_rq *self,
+			 unsigned long *kick)
+{
+	struct vnet_rq *rq;
+
+	if (unlikely(!netif_carrier_ok(dst->netdev))) {
+		kfree_skb(skb);
+		return -ENETDOWN;
+	}
+	/* scrub the Tx state (and more, if @dst's in another netns), set
+	 * skb->protocol and pull the eth header; on failure, the skb's already
+	 * been freed
+	 */
+	if (__dev_forward_skb(dst->netdev, skb) != NET_RX_SUCCESS)
+		return -EINVAL;
+
+	/* our peer may well have fewer queues than we do */
+	rq = &dst->rq[vnet_rss_select(dst, skb, self->qid % READ_ONCE(dst->num_queues))];
+	if (unlikely(ptr_ring_produce(&rq->ring, skb))) {
+		kfree_skb(skb);
+		return -ENOSPC;
+	}
+	if (rq != self)
+		__set_bit(rq->qid, kick);
+	return 0;
+}
+
+/* Where a Tx completion run puts frames on the wire, and what became of them */
+struct vnet_wire {
+	struct stVnetIntfCtx *dst;	/* our peer, else ourselves */
+	struct vnet_rq *self;		/* the Rx side of the queue pair we're completing */
+	bool lb;			/* else there's no other end; frames just vanish */
+	unsigned long kick;		/* @dst's Rx queues to raise a poll on */
+	unsigned int pkts, drops;
+	u64 bytes;
+};
+
+/* The frame's on the wire: deliver it to the other end, if any */
+static void vnet_wire_out(struct vnet_wire *w, struct sk_buff *skb, int budget)
+{
+	/* a TSO/GSO super-frame is that many packets on the wire */
+	unsigned int len = skb->len, segs = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+
+	if (w->lb) {
+		if (vnet_loopback(w->dst, skb, w->self, &w->kick)) {
+			w->drops++;
+			return;
+		}
+	} else
+		napi_consume_skb(skb, budget);
+	w->pkts += segs;
+	w->bytes += len;
+}
+
+/* Put the frames that are due off the delay line on the wire; up to @budget */
+static void vnet_delayq_drain(struct vnet_txq *txq, struct vnet_wire *w, u64 now, int budget)
+{
+	struct sk_buff *skb;
+	int n = 0;
+
+	while (n++ < budget && (skb = skb_peek(&txq->delayq)) && VNET_WIRE_CB(skb)->due <= now) {
+		__skb_unlink(skb, &txq->delayq);
+		vnet_wire_out(w, skb, budget);
+	}
+}
+
+/*
+ * Tx completion, from the queue pair's NAPI poll; reaps up to @budget frames.
+ * Returns the # reaped.
+ */
+static int vnet_tx_complete(struct vnet_txq *txq, int budget)
+{
+	struct stVnetIntfCtx *pstCtx = txq->pstCtx;
+	struct netdev_queue *nq = netdev_get_tx_queue(pstCtx->netdev, txq->qid);
+	struct vnet_impair *imp = &pstCtx->impair;
+	struct vnet_wire w = { .dst = pstCtx, .self = &pstCtx->rq[txq->qid] };
+	unsigned int done = 0, bql_bytes = 0;
+	bool impair = READ_ONCE(imp->on), shaping = false;
+	u64 now = 0, avail = 0, burst = 0, wait = 0;
+	struct net_device *peer;
+	struct sk_buff *skb;
+
+	/* keeps our peer around (see vnet_remove()) */
+	rcu_read_lock();
+	peer = rcu_dereference(pstCtx->peer);
+	if (peer)
+		w.dst = netdev_priv(peer);
+	w.lb = peer || READ_ONCE(loopback);
+
+	if (unlikely(impair || !skb_queue_empty(&txq->delayq))) {
+		now = ktime_get_ns();
+		/* these were sent before anything still in the Tx ring */
+		vnet_delayq_drain(txq, &w, now, budget);
+		shaping = impair && READ_ONCE(imp->rate);
+		if (shaping) {
+			avail = vnet_shaper_take(imp, now);
+			burst = READ_ONCE(imp->burst);
+		}
+	}
+
+	while (done < budget) {
+		skb = __ptr_ring_peek(&txq->ring);
+		if (!skb)
+			break;
+		if (unlikely(shaping)) {
+			/* out of tokens? the frame stays in the Tx ring till there're
+			 * enough - or the bucket's full; a frame bigger than the burst
+			 * (BIG TCP) mustn't stall us for ever
+			 */
+			if (skb->len > avail && avail < burst) {
+				wait = max_t(u64, vnet_shaper_wait(imp, min_t(u64, skb->len, burst), avail), 1);
+				u64_stats_update_begin(&txq->istats.syncp);
+				txq->istats.throttled++;
+				u64_stats_update_end(&txq->istats.syncp);
+				break;
+			}
+			avail -= min_t(u64, avail, skb->len);
+		}
+		__ptr_ring_discard_one(&txq->ring);
+		done++;
+		bql_bytes += skb->len;
+		/* the Tx 'hardware' timestamp: the frame's just gone out on the wire */
+		if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS)) {
+			struct skb_shared_hwtstamps hwts = { .hwtstamp = ktime_get_real() };
+
+			skb_tstamp_tx(skb, &hwts);
+		}
+
+		if (unlikely(impair) && vnet_impair(txq, imp, skb, now, &w.drops))
+			continue;
+		vnet_wire_out(&w, skb, budget);
+	}
+	if (w.kick)
+		vnet_rq_kick(w.dst, w.kick);
+	rcu_read_unlock();
+
+	if (unlikely(shaping)) {
+		vnet_shaper_give(imp, avail);
+		if (wait)
+			vnet_wire_timer_arm(txq, now + wait);
+	}
+	/* the delay line's head may be due already, if @budget ran out draining it */
+	if (unlikely(!skb_queue_empty(&txq->delayq)))
+		vnet_wire_timer_arm(txq, VNET_WIRE_CB(skb_peek(&txq->delayq))->due);
+
+	if (w.pkts || w.drops) {
+		u64_stats_update_begin(&txq->stats.syncp);
+		txq->stats.packets += w.pkts;
+		txq->stats.bytes += w.bytes;
+		txq->stats.drops += w.drops;
+		u64_stats_update_end(&txq->stats.syncp);
+	}
+	if (!done)
+		return 0;
+
+	netdev_tx_completed_queue(nq, done, bql_bytes);
+
+	/* pairs with the smp_mb() in vnet_start_xmit(); don't miss a wakeup */
+	smp_mb();
+	if (unlikely(netif_tx_queue_stopped(nq)) && !__ptr_ring_full(&txq->ring))
+		netif_tx_wake_queue(nq);
+	return done;
+}
+
+static int vnet_poll(struct napi_struct *napi, int budget)
+{
+	struct vnet_rq *rq = container_of(napi, struct vnet_rq, napi);
+	struct vnet_rx_cnt xc = { };
+	struct xsk_buff_pool *pool;
+	struct bpf_prog *prog;
+	int done, tx_done, xsk_done = 0;
+
+	/* Tx completion first; in loopback mode, it feeds the Rx ring we drain next */
+	tx_done = vnet_tx_complete(&rq->pstCtx->txq[rq->qid], budget);
+
+	rcu_read_lock();
+	prog = rcu_dereference(rq->pstCtx->xdp_prog);
+	pool = READ_ONCE(rq->xsk_pool);
+
+	if (pool)
+		xsk_done = vnet_xsk_xmit(rq, pool, prog, budget, &xc);
+	done = vnet_rx(rq, prog, pool, budget, &xc);
+	vnet_xdp_tx_flush(rq, &xc);
+
+	if (xc.redirect)
+		xdp_do_flush();
+	rcu_read_unlock();
+
+	if (xc.rcvd || xc.drop || xc.xsk_tx || prog)
+		vnet_rx_stats_fold(rq, &xc, !!prog);
+
+	/* more to Tx from the socket, or to complete? keep polling */
+	if (xsk_done == budget || tx_done == budget)
+		return budget;
+
+	if (done < budget && napi_complete_done(napi, done)) {
+		/*
+		 * A frame may have been produced after we found the ring empty but
+		 * before NAPI was marked idle; it's napi_schedule() then was a no-op,
+		 * so recheck, else it'd sit in the ring until the next Tx.
+		 */
+		smp_mb();
+		if (unlikely(!__ptr_ring_empty(&rq->ring)))
+			napi_schedule(napi);
+		else if (pool && xsk_uses_need_wakeup(pool)) {
+			/* idle; the socket must kick us (ndo_xsk_wakeup) for more */
+			xsk_set_rx_need_wakeup(pool);
+			xsk_set_tx_need_wakeup(pool);
+		}
+	} else if (pool && xsk_uses_need_wakeup(pool)) {
+		xsk_clear_rx_need_wakeup(pool);
+		xsk_clear_tx_need_wakeup(pool);
+	}
+	return done;
+}
+
+/*----------------------- In-kernel traffic generator ------------------------
+ * A pktgen-like, repeatable load source that needs no other setup: one kthread
+ * per CPU (on the first 'threads' online CPUs) injects UDP/IPv4 frames straight
+ * into the Rx ring of queue (thread# % num_queues), bypassing the Tx side
+ * altogether. The frames are built just once, per flow (the UDP source port
+ * differs), when the generator's started; each one injected is but a clone of
+ * one of them. Driven via /sys/kernel/debug/vnet/<intf>/gen :
+ *   echo "size 64 flows 16 threads 4 rate 0" > gen	# rate in frames/s, 0 = flat out
+ *   echo "dst 10.10.1.5 dport 54295" > gen		# default: our talker/listener's
+ *   echo start > gen ; sleep 10 ; echo stop > gen
+ *   cat gen				# config and per-thread packets & Mpps
+ * The interface must be up; taking it down stops the generator.
+ */
+#define VNET_GEN_BURST		32
+#define VNET_GEN_MAX_FLOWS	1024
+#define VNET_GEN_SPORT_BASE	10000
+#define VNET_GEN_HDRS_LEN	(ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+static const u8 vnet_gen_src_mac[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x76, 0x67, 0x6e };
+
+static struct sk_buff *vnet_gen_build(struct stVnetIntfCtx *pstCtx, unsigned int flow, int node)
+{
+	struct net_device *ndev = pstCtx->netdev;
+	struct vnet_gen *gen = &pstCtx->gen;
+	unsigned int plen = gen->size - VNET_GEN_HDRS_LEN;
+	struct sk_buff *skb;
+	struct udphdr *udph;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+
+	skb = __alloc_skb(NET_IP_ALIGN + gen->size, GFP_KERNEL, 0, node);
+	if (!skb)
+		return NULL;
+	skb_reserve(skb, NET_IP_ALIGN);
+
+	eth = skb_put(skb, ETH_HLEN);
+	ether_addr_copy(eth->h_dest, ndev->dev_addr);
+	ether_addr_copy(eth->h_source, vnet_gen_src_mac);
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph = skb_put(skb, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tos = 0;
+	iph->tot_len = htons(gen->size - ETH_HLEN);
+	iph->id = 0;
+	iph->frag_off = htons(IP_DF);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = gen->saddr;
+	iph->daddr = gen->daddr;
+	ip_send_check(iph);
+
+	udph = skb_put(skb, sizeof(*udph));
+	udph->source = htons(VNET_GEN_SPORT_BASE + flow);
+	udph->dest = gen->dport;
+	udph->len = htons(sizeof(*udph) + plen);
+	udph->check = 0;	/* 'no checksum'; legal for UDP over IPv4 */
+
+	skb_put_zero(skb, plen);
+	return skb;
+}
+
+static void vnet_gen_free_tmpl(struct vnet_gen_thread *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->ntmpl; i++)
+		kfree_skb(t->tmpl[i]);
+	kfree(t->tmpl);
+	t->tmpl = NULL;
+	t->ntmpl = 0;
+}
+
+/* Hold off till it's time for frame # @sent, at @rate frames/s */
+static void vnet_gen_pace(u64 t_start, u64 sent, u64 rate)
+{
+	u64 due = t_start + mul_u64_u64_div_u64(sent, NSEC_PER_SEC, rate);
+	s64 ahead = due - ktime_get_ns();
+	ktime_t to;
+
+	if (ahead <= 0)
+		return;
+	if (ahead > 20 * NSEC_PER_USEC) {
+		to = ns_to_ktime(due);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&to, 5 * NSEC_PER_USEC, HRTIMER_MODE_ABS);
+	} else {
+		/* too short to sleep for */
+		while (ktime_get_ns() < due)
+			cpu_relax();
+	}
+}
+
+static int vnet_gen_thread_fn(void *arg)
+{
+	struct vnet_gen_thread *t = arg;
+	struct stVnetIntfCtx *pstCtx = t->pstCtx;
+	struct net_device *ndev = pstCtx->netdev;
+	struct vnet_rq *rq = &pstCtx->rq[t->qid];
+	u64 t_start = pstCtx->gen.t_start, rate = 0, sent = 0;
+	unsigned int flow = 0, burst = VNET_GEN_BURST;
+
+	if (pstCtx->gen.rate) {
+		rate = max_t(u64, div_u64(pstCtx->gen.rate, pstCtx->gen.nthr), 1);
+		/* smaller bursts at lower rates, for smoother pacing */
+		burst = clamp_t(u64, div_u64(rate, 10000), 1, VNET_GEN_BURST);
+	}
+
+	while (!kthread_should_stop()) {
+		unsigned int i, n = 0, full = 0;
+
+		/* the Rx ring's producer lock is also taken in softirq context */
+		local_bh_disable();
+		for (i = 0; i < burst; i++) {
+			struct sk_buff *skb = skb_clone(t->tmpl[flow], GFP_ATOMIC);
+
+			if (++flow == t->ntmpl)
+				flow = 0;
+			if (unlikely(!skb))
+				break;
+			skb->protocol = eth_type_trans(skb, ndev);
+			/* the 'NIC' hashes it (skb->hash); the thread's queue stays put though */
+			vnet_rss_select(pstCtx, skb, t->qid);
+			if (unlikely(ptr_ring_produce(&rq->ring, skb))) {
+				kfree_skb(skb);
+				full++;
+				break;
+			}
+			n++;
+		}
+		if (n)
+			napi_schedule(&rq->napi);
+		/* NAPI (most likely) runs right here, on this CPU, draining the ring */
+		local_bh_enable();
+
+		sent += n;
+		u64_stats_update_begin(&t->syncp);
+		t->sent = sent;
+		t->ring_full += full;
+		u64_stats_update_end(&t->syncp);
+
+		if (rate)
+			vnet_gen_pace(t_start, sent, rate);
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Called holding the RTNL lock */
+static void vnet_gen_stop(struct stVnetIntfCtx *pstCtx)
+{
+	struct vnet_gen *gen = &pstCtx->gen;
+	unsigned int i;
+
+	ASSERT_RTNL();
+	if (!gen->running)
+		return;
+	for (i = 0; i < gen->nthr; i++) {
+		kthread_stop(gen->thr[i].task);
+		vnet_gen_free_tmpl(&gen->thr[i]);
+	}
+	gen->t_end = ktime_get_ns();
+	gen->running = false;
+}
+
+/* Called holding the RTNL lock; the per-thread results are kept till the next start */
+static int vnet_gen_start(struct stVnetIntfCtx *pstCtx)
+{
+	struct vnet_gen *gen = &pstCtx->gen;
+	unsigned int i, f, cpu, nmax, n = 0;
+	struct vnet_gen_thread *thr;
+	int ret = -ENOMEM;
+
+	ASSERT_RTNL();
+	if (gen->running)
+		return -EBUSY;
+	if (!netif_running(pstCtx->netdev))
+		return -ENETDOWN;
+	if (gen->size > pstCtx->netdev->mtu + ETH_HLEN)
+		return -EMSGSIZE;
+
+	nmax = min(gen->threads, num_online_cpus());
+	thr = kcalloc(nmax, sizeof(*thr), GFP_KERNEL);
+	if (!thr)
+		return -ENOMEM;
+	kfree(gen->thr);
+	gen->thr = thr;
+	gen->nthr = 0;
+
+	for_each_online_cpu(cpu) {
+		struct vnet_gen_thread *t = &thr[n];
+
+		if (n == nmax)
+			break;
+		t->pstCtx = pstCtx;
+		t->cpu = cpu;
+		t->qid = n % pstCtx->num_queues;
+		u64_stats_init(&t->syncp);
+
+		t->tmpl = kcalloc_node(gen->flows, sizeof(*t->tmpl), GFP_KERNEL, cpu_to_node(cpu));
+		if (!t->tmpl)
+			goto out_fail;
+		for (f = 0; f < gen->flows; f++) {
+			t->tmpl[f] = vnet_gen_build(pstCtx, f, cpu_to_node(cpu));
+			if (!t->tmpl[f])
+				goto out_fail;
+			t->ntmpl++;
+		}
+		t->task = kthread_create_on_cpu(vnet_gen_thread_fn, t, cpu, "vnet_gen/%u");
+		if (IS_ERR(t->task)) {
+			ret = PTR_ERR(t->task);
+			t->task = NULL;
+			goto out_fail;
+		}
+		n++;
+	}
+	gen->nthr = n;
+
+	gen->t_start = ktime_get_ns();
+	gen->running = true;
+	for (i = 0; i < n; i++)
+		wake_up_process(thr[i].task);
+	return 0;
+
+ out_fail:
+	vnet_gen_free_tmpl(&thr[n]);
+	for (i = 0; i < n; i++) {
+		/* never woken up, so they just exit */
+		kthread_stop(thr[i].task);
+		vnet_gen_free_tmpl(&thr[i]);
+	}
+	return ret;
+}
+
+static int vnet_gen_set(struct vnet_gen *gen, const char *key, const char *val)
+{
+	unsigned int v;
+	u64 rate;
+	u16 port;
+
+	if (gen->running)
+		return -EBUSY;
+
+	if (!strcmp(key, "rate")) {
+		if (kstrtou64(val, 0, &rate))
+			return -EINVAL;
+		gen->rate = rate;
+	} else if (!strcmp(key, "dport")) {
+		if (kstrtou16(val, 0, &port))
+			return -EINVAL;
+		gen->dport = htons(port);
+	} else if (!strcmp(key, "src")) {
+		if (!in4_pton(val, -1, (u8 *)&gen->saddr, -1, NULL))
+			return -EINVAL;
+	} else if (!strcmp(key, "dst")) {
+		if (!in4_pton(val, -1, (u8 *)&gen->daddr, -1, NULL))
+			return -EINVAL;
+	} else {
+		if (kstrtouint(val, 0, &v))
+			return -EINVAL;
+		if (!strcmp(key, "size")) {
+			/* also checked against the MTU, on start */
+			if (v < max_t(unsigned int, ETH_ZLEN, VNET_GEN_HDRS_LEN) || v > IP_MAX_MTU)
+				return -EINVAL;
+			gen->size = v;
+		} else if (!strcmp(key, "flows")) {
+			if (!v || v > VNET_GEN_MAX_FLOWS)
+				return -EINVAL;
+			gen->flows = v;
+		} else if (!strcmp(key, "threads")) {
+			if (!v || v > num_possible_cpus())
+				return -EINVAL;
+			gen->threads = v;
+		} else
+			return -EINVAL;
+	}
+	return 0;
+}
+
+static void vnet_gen_init(struct vnet_gen *gen)
+{
+	gen->size = ETH_ZLEN;
+	gen->flows = 1;
+	gen->threads = 1;
+	gen->saddr = htonl(0x0a0a0101);		/* 10.10.1.1 */
+	gen->daddr = htonl(0x0a0a0105);		/* 10.10.1.5 */
+	gen->dport = htons(PORTNUM);
+}
+
+/* "start", "stop" and/or any number of "<param> <value>" pairs */
+static ssize_t vnet_gen_write(struct file *filp, const char __user *ubuf, size_t count,
+			      loff_t *ppos)
+{
+	struct stVnetIntfCtx *pstCtx = file_inode(filp)->i_private;
+	char kbuf[160], *buf, *key, *val;
+	int ret = 0;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, ubuf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+	buf = strim(kbuf);
+
+	ret = vnet_dbg_rtnl_lock();
+	if (ret)
+		return ret;
+	while (!ret && (key = vnet_next_tok(&buf))) {
+		if (!strcmp(key, "start"))
+			ret = vnet_gen_start(pstCtx);
+		else if (!strcmp(key, "stop"))
+			vnet_gen_stop(pstCtx);
+		else {
+			val = vnet_next_tok(&buf);
+			ret = val ? vnet_gen_set(&pstCtx->gen, key, val) : -EINVAL;
+		}
+	}
+	rtnl_unlock();
+
+	return ret ? ret : count;
+}
+
+/* Mpps, to 3 decimal places, as thousandths */
+static u64 vnet_gen_mpps_x1000(u64 pkts, u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	return us ? div64_u64(pkts * 1000, us) : 0;
+}
+
+static int vnet_gen_show(struct seq_file *m, void *v)
+{
+	struct stVnetIntfCtx *pstCtx = m->private;
+	struct vnet_gen *gen = &pstCtx->gen;
+	u64 tot_sent = 0, tot_full = 0, ns;
+	unsigned int i;
+	int ret;
+
+	ret = vnet_dbg_rtnl_lock();
+	if (ret)
+		return ret;
+	seq_printf(m, "%s: size %u flows %u threads %u rate %llu src %pI4 dst %pI4 dport %u\n",
+		   gen->running ? "running" : "stopped", gen->size, gen->flows, gen->threads,
+		   gen->rate, &gen->saddr, &gen->daddr, ntohs(gen->dport));
+	if (!gen->nthr)
+		goto out;
+
+	ns = (gen->running ? ktime_get_ns() : gen->t_end) - gen->t_start;
+	seq_puts(m, "# cpu queue packets ring_full Mpps\n");
+	for (i = 0; i < gen->nthr; i++) {
+		struct vnet_gen_thread *t = &gen->thr[i];
+		unsigned int start;
+		u64 sent, full, r;
+
+		do {
+			start = u64_stats_fetch_begin(&t->syncp);
+			sent = t->sent;
+			full = t->ring_full;
+		} while (u64_stats_fetch_retry(&t->syncp, start));
+		r = vnet_gen_mpps_x1000(sent, ns);
+		seq_printf(m, "%u %u %llu %llu %llu.%03llu\n",
+			   t->cpu, t->qid, sent, full, div_u64(r, 1000), r % 1000);
+		tot_sent += sent;
+		tot_full += full;
+	}
+	ns = vnet_gen_mpps_x1000(tot_sent, ns);
+	seq_printf(m, "total - %llu %llu %llu.%03llu (over %llu ms)\n", tot_sent, tot_full,
+		   div_u64(ns, 1000), ns % 1000,
+		   div_u64((gen->running ? ktime_get_ns() : gen->t_end) - gen->t_start,
+			   NSEC_PER_MSEC));
+ out:
+	rtnl_unlock();
+	return 0;
+}
+
+static int vnet_gen_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, vnet_gen_show, inode->i_private);
+}
+
+static const struct file_operations vnet_gen_fops = {
+	.owner = THIS_MODULE,
+	.open = vnet_gen_open,
+	.read = seq_read,
+	.write = vnet_gen_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * The Tx entry point.
+ * Runs in process context (with BHs disabled), holding this Tx queue's lock.
+ * To get to the Tx path, try:
+ * - running our "custom" simple datagram app "talker_dgram"
+ *   ./talker_dgram <IP addr> "<some msg>"
+ * - 'ping -c1 10.10.1.x , with 'x' != IP addr (5, in our current setup;
+ *   also but realize that ping won't actually work on a local interface).
+ * Use a network analyzer (eg Wireshark) to see packets flowing across the interface..
+ * Frames are only queued here; they're 'sent' - and with the 'loopback' module
+ * parameter set, received right back on this interface - on Tx completion (see
+ * vnet_tx_complete()).
+*/
+static netdev_tx_t vnet_start_xmit(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct netdev_queue *nq;
+	struct vnet_txq *txq;
+	unsigned int len;
+	bool more;
+	u16 qid;
+
+	if (!skb) {		// paranoia!
+		pr_alert("skb NULL!\n");
+		return NETDEV_TX_OK;
+	}
+	/*
+	 * Timestamp as early as we can: a 'hardware' one's requested here and
+	 * delivered on Tx completion; the software one's taken right now (unless
+	 * the former's pending, and the socket didn't ask for both with
+	 * SOF_TIMESTAMPING_OPT_TX_SWHW).
+	 */
+	if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+	    READ_ONCE(pstCtx->tstamp.tx_type) == HWTSTAMP_TX_ON)
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+	skb_tx_timestamp(skb);
+
+	qid = skb_get_queue_mapping(skb);
+	txq = &pstCtx->txq[qid];
+	nq = netdev_get_tx_queue(ndev, qid);
+	len = skb->len;
+	/*
+	 * No SKB_PEEK() or printk's per packet here - that'd cap our throughput at
+	 * printk speed! To look at the packets, enable the (sampled, rate-limited)
+	 * capture instead; see vnet_capture().
+	 */
+	vnet_capture(pstCtx, skb, qid, 'T');
+	vnet_flow_classify(pstCtx, skb);
+
+	if (unlikely(__ptr_ring_produce(&txq->ring, skb))) {
+		/* shouldn't happen, we stop the queue before the ring fills up */
+		netif_tx_stop_queue(nq);
+		vnet_tx_kick(txq);
+		return NETDEV_TX_BUSY;
+	}
+
+	more = netdev_xmit_more();
+	if (unlikely(__ptr_ring_full(&txq->ring))) {
+		netif_tx_stop_queue(nq);
+		/* pairs with the smp_mb() in vnet_tx_complete() */
+		smp_mb();
+		if (!__ptr_ring_full(&txq->ring))
+			netif_tx_start_queue(nq);
+		more = false;
+	}
+	/* BQL accounting; also tells us whether the doorbell's due now */
+	if (__netdev_tx_sent_queue(nq, len, more))
+		vnet_tx_kick(txq);
+	return NETDEV_TX_OK;
+}
+
+static int vnet_open(struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	int i, ret;
+
+	QP;
+	for (i = 0; i < pstCtx->num_queues; i++) {
+		struct vnet_rq *rq = &pstCtx->rq[i];
+
+		ret = ptr_ring_init(&pstCtx->txq[i].ring, pstCtx->tx_ring_size, GFP_KERNEL);
+		if (ret)
+			goto out_unwind;
+		ret = ptr_ring_init(&rq->ring, pstCtx->rx_ring_size, GFP_KERNEL);
+		if (ret) {
+			ptr_ring_cleanup(&pstCtx->txq[i].ring, NULL);
+			goto out_unwind;
+		}
+		netdev_tx_reset_queue(netdev_get_tx_queue(ndev, i));
+		ret = vnet_rq_create_page_pool(rq);
+		if (ret) {
+			ptr_ring_cleanup(&rq->ring, NULL);
+			ptr_ring_cleanup(&pstCtx->txq[i].ring, NULL);
+			goto out_unwind;
+		}
+		napi_enable(&rq->napi);
+
+		ret = xdp_rxq_info_reg(&rq->xdp_rxq, ndev, i, rq->napi.napi_id);
+		if (ret)
+			goto out_napi;
+		ret = vnet_rxq_reg_mem_model(rq);
+		if (ret) {
+			xdp_rxq_info_unreg(&rq->xdp_rxq);
+			goto out_napi;
+		}
+	}
+
+	netif_carrier_on(ndev);
+	netif_tx_start_all_queues(ndev);
+	return 0;
+
+ out_napi:
+	napi_disable(&pstCtx->rq[i].napi);
+	ptr_ring_cleanup(&pstCtx->rq[i].ring, vnet_ring_free);
+	ptr_ring_cleanup(&pstCtx->txq[i].ring, vnet_ring_free);
+	vnet_rq_destroy_page_pool(&pstCtx->rq[i]);
+ out_unwind:
+	while (--i >= 0) {
+		napi_disable(&pstCtx->rq[i].napi);
+		ptr_ring_cleanup(&pstCtx->rq[i].ring, vnet_ring_free);
+		ptr_ring_cleanup(&pstCtx->txq[i].ring, vnet_ring_free);
+		xdp_rxq_info_unreg(&pstCtx->rq[i].xdp_rxq);
+		vnet_rq_destroy_page_pool(&pstCtx->rq[i]);
+	}
+	return ret;
+}
+
+static int vnet_stop(struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	int i;
+
+	QP;
+	/* the generator feeds our Rx rings directly */
+	vnet_gen_stop(pstCtx);
+	netif_carrier_off(ndev);
+	/* waits for any in-flight xmit; no more producers after this */
+	netif_tx_disable(ndev);
+	/* ... and ndo_xdp_xmit (which checks the carrier) runs under RCU */
+	synchronize_net();
+	for (i = 0; i < pstCtx->num_queues; i++) {
+		/* no more doorbells can ring now; silence any pending one */
+		hrtimer_cancel(&pstCtx->txq[i].timer);
+		napi_disable(&pstCtx->rq[i].napi);
+		/* NAPI's the only one to arm it */
+		hrtimer_cancel(&pstCtx->txq[i].wire_timer);
+		/* ... and the frames still on the wire are lost, with the link */
+		__skb_queue_purge(&pstCtx->txq[i].delayq);
+		pstCtx->txq[i].delay_last = 0;
+		/* frames never completed are simply dropped, as a NIC reset would */
+		ptr_ring_cleanup(&pstCtx->txq[i].ring, vnet_ring_free);
+		netdev_tx_reset_queue(netdev_get_tx_queue(ndev, i));
+		ptr_ring_cleanup(&pstCtx->rq[i].ring, vnet_ring_free);
+		/* drops the mem model's hold on the pool first */
+		xdp_rxq_info_unreg(&pstCtx->rq[i].xdp_rxq);
+		vnet_rq_destroy_page_pool(&pstCtx->rq[i]);
+	}
+	return 0;
+}
+
+static void vnet_qstats_read(struct vnet_qstats *qs, u64 *packets, u64 *bytes, u64 *drops)
+{
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&qs->syncp);
+		*packets = qs->packets;
+		*bytes = qs->bytes;
+		*drops = qs->drops;
+	} while (u64_stats_fetch_retry(&qs->syncp, start));
+}
+
+/*
+ * Do an 'ip -s link show veth' to see the effect of this 'getstats' routine..
+ * We sum across all queues, including currently inactive ones, so that the
+ * totals never go backwards.
+ */
+static void vnet_get_stats64(struct net_device *ndev, struct rtnl_link_stats64 *stats)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	u64 packets, bytes, drops;
+	int i;
+
+	for (i = 0; i < VNET_MAX_QUEUES; i++) {
+		struct vnet_rq *rq = &pstCtx->rq[i];
+		unsigned int start;
+		u64 xdp_drop, xdp_tx;
+
+		vnet_qstats_read(&pstCtx->txq[i].stats, &packets, &bytes, &drops);
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+		stats->tx_dropped += drops;
+
+		/* frames redirected to us count as transmitted by us */
+		vnet_qstats_read(&rq->xmit_stats, &packets, &bytes, &drops);
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+		stats->tx_dropped += drops;
+
+		vnet_qstats_read(&rq->xsk_tx_stats, &packets, &bytes, &drops);
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+
+		vnet_qstats_read(&rq->stats, &packets, &bytes, &drops);
+		stats->rx_packets += packets;
+		stats->rx_bytes += bytes;
+		stats->rx_dropped += drops;
+
+		do {
+			start = u64_stats_fetch_begin(&rq->xdp_stats.syncp);
+			xdp_drop = rq->xdp_stats.drop;
+			xdp_tx = rq->xdp_stats.tx;
+		} while (u64_stats_fetch_retry(&rq->xdp_stats.syncp, start));
+		stats->rx_dropped += xdp_drop;
+		stats->tx_packets += xdp_tx;
+	}
+}
+
+static void vnet_tx_timeout(struct net_device *ndev, unsigned int txq)
+{
+	pr_info("!! Tx timed out !!\n");
+}
+
+/*--------------------------------- ethtool ----------------------------------
+ * So that the usual NIC tuning tools work on us too, f.e.
+ *   ethtool -L veth combined 4		# queue pairs
+ *   ethtool -G veth tx 1024 rx 1024	# ring sizes
+ *   ethtool -C veth tx-usecs 50		# Tx completion coalescing
+ *   ethtool -S veth			# per-queue counters
+ */
+static void vnet_get_drvinfo(struct net_device *ndev, struct ethtool_drvinfo *info)
+{
+	strscpy(info->driver, KBUILD_MODNAME, sizeof(info->driver));
+	strscpy(info->bus_info, "platform", sizeof(info->bus_info));
+}
+
+/*
+ * Apply a new queue / ring size config. The rings are (re)built on open, so if
+ * the interface is up, bounce it (we're called holding the RTNL lock).
+ */
+static int vnet_reconfig(struct net_device *ndev, unsigned int nq,
+			 unsigned int tx_ring_size, unsigned int rx_ring_size)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	unsigned int old_nq = pstCtx->num_queues;
+	unsigned int old_tx = pstCtx->tx_ring_size, old_rx = pstCtx->rx_ring_size;
+	bool running = netif_running(ndev);
+	int ret;
+
+	if (running)
+		vnet_stop(ndev);
+
+	pstCtx->tx_ring_size = tx_ring_size;
+	pstCtx->rx_ring_size = rx_ring_size;
+	pstCtx->num_queues = nq;
+	netif_set_real_num_tx_queues(ndev, nq);
+	netif_set_real_num_rx_queues(ndev, nq);
+	/* spread over the new set of queues, unless the user's set up RSS themselves */
+	if (!netif_is_rxfh_configured(ndev))
+		vnet_rss_indir_default(pstCtx);
+	if (!running)
+		return 0;
+
+	ret = vnet_open(ndev);
+	if (!ret)
+		return 0;
+
+	/* couldn't allocate the new rings; fall back to what we had */
+	netdev_err(ndev, "reconfig failed (%d), reverting\n", ret);
+	pstCtx->tx_ring_size = old_tx;
+	pstCtx->rx_ring_size = old_rx;
+	pstCtx->num_queues = old_nq;
+	netif_set_real_num_tx_queues(ndev, old_nq);
+	netif_set_real_num_rx_queues(ndev, old_nq);
+	if (!netif_is_rxfh_configured(ndev))
+		vnet_rss_indir_default(pstCtx);
+	if (vnet_open(ndev))
+		netdev_err(ndev, "revert failed too; interface is down\n");
+	return ret;
+}
+
+static void vnet_get_channels(struct net_device *ndev, struct ethtool_channels *ch)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	/* as many as were allocated; see vnet_newlink_common() */
+	ch->max_combined = min(ndev->num_tx_queues, ndev->num_rx_queues);
+	ch->combined_count = pstCtx->num_queues;
+}
+
+static int vnet_set_channels(struct net_device *ndev, struct ethtool_channels *ch)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	/* the core's already checked against our max's; only 'combined' is settable */
+	if (!ch->combined_count)
+		return -EINVAL;
+	if (ch->combined_count == pstCtx->num_queues)
+		return 0;
+	return vnet_reconfig(ndev, ch->combined_count, pstCtx->tx_ring_size, pstCtx->rx_ring_size);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static void vnet_get_ringparam(struct net_device *ndev, struct ethtool_ringparam *ring,
+			       struct kernel_ethtool_ringparam *kring,
+			       struct netlink_ext_ack *extack)
+#else
+static void vnet_get_ringparam(struct net_device *ndev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	ring->tx_max_pending = VNET_RING_MAX;
+	ring->rx_max_pending = VNET_RING_MAX;
+	ring->tx_pending = pstCtx->tx_ring_size;
+	ring->rx_pending = pstCtx->rx_ring_size;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+static int vnet_set_ringparam(struct net_device *ndev, struct ethtool_ringparam *ring,
+			      struct kernel_ethtool_ringparam *kring,
+			      struct netlink_ext_ack *extack)
+#else
+static int vnet_set_ringparam(struct net_device *ndev, struct ethtool_ringparam *ring)
+#endif
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	if (ring->tx_pending < VNET_RING_MIN || ring->rx_pending < VNET_RING_MIN)
+		return -EINVAL;
+	if (ring->tx_pending == pstCtx->tx_ring_size && ring->rx_pending == pstCtx->rx_ring_size)
+		return 0;
+	return vnet_reconfig(ndev, pstCtx->num_queues, ring->tx_pending, ring->rx_pending);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int vnet_get_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+#else
+static int vnet_get_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	ec->tx_coalesce_usecs = READ_ONCE(pstCtx->tx_coal_usecs);
+	return 0;
+}
+
+/* takes effect from the next doorbell on; no need to touch the rings */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+static int vnet_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec,
+			     struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+#else
+static int vnet_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	if (ec->tx_coalesce_usecs > USEC_PER_SEC)
+		return -EINVAL;
+	WRITE_ONCE(pstCtx->tx_coal_usecs, ec->tx_coalesce_usecs);
+	return 0;
+}
+
+/*
+ * 'ethtool -S': these counters, for each active queue pair, in this order.
+ * They're the very ones ndo_get_stats64 sums up.
+ */
+static const char * const vnet_qstat_names[] = {
+	"tx_queue_%u_packets", "tx_queue_%u_bytes", "tx_queue_%u_drops",
+	"tx_queue_%u_xsk_packets", "tx_queue_%u_xsk_bytes",
+	"rx_queue_%u_packets", "rx_queue_%u_bytes", "rx_queue_%u_drops",
+	"rx_queue_%u_xdp_pass", "rx_queue_%u_xdp_drop",
+	"rx_queue_%u_xdp_tx", "rx_queue_%u_xdp_redirect",
+	"rx_queue_%u_xdp_xmit_packets", "rx_queue_%u_xdp_xmit_bytes",
+	"rx_queue_%u_xdp_xmit_drops",
+};
+#define VNET_QSTATS_LEN		ARRAY_SIZE(vnet_qstat_names)
+
+static int vnet_get_sset_count(struct net_device *ndev, int sset)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return pstCtx->num_queues * VNET_QSTATS_LEN
+#ifdef CONFIG_PAGE_POOL_STATS
+		/* followed by the page_pool counters, summed over the queues */
+		+ page_pool_ethtool_stats_get_count()
+#endif
+		;
+}
+
+static void vnet_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	unsigned int q, i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+	for (q = 0; q < pstCtx->num_queues; q++)
+		for (i = 0; i < VNET_QSTATS_LEN; i++)
+			ethtool_sprintf(&data, vnet_qstat_names[i], q);
+#ifdef CONFIG_PAGE_POOL_STATS
+	page_pool_ethtool_stats_get_strings(data);
+#endif
+}
+
+static void vnet_get_ethtool_stats(struct net_device *ndev, struct ethtool_stats *stats,
+				   u64 *data)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	unsigned int q, start;
+
+	BUILD_BUG_ON(VNET_QSTATS_LEN != 15);	/* keep in sync with the names above */
+	for (q = 0; q < pstCtx->num_queues; q++) {
+		struct vnet_rq *rq = &pstCtx->rq[q];
+		u64 drops;
+
+		vnet_qstats_read(&pstCtx->txq[q].stats, &data[0], &data[1], &data[2]);
+		vnet_qstats_read(&rq->xsk_tx_stats, &data[3], &data[4], &drops);
+		vnet_qstats_read(&rq->stats, &data[5], &data[6], &data[7]);
+		do {
+			start = u64_stats_fetch_begin(&rq->xdp_stats.syncp);
+			data[8] = rq->xdp_stats.pass;
+			data[9] = rq->xdp_stats.drop;
+			data[10] = rq->xdp_stats.tx;
+			data[11] = rq->xdp_stats.redirect;
+		} while (u64_stats_fetch_retry(&rq->xdp_stats.syncp, start));
+		vnet_qstats_read(&rq->xmit_stats, &data[12], &data[13], &data[14]);
+		data += VNET_QSTATS_LEN;
+	}
+#ifdef CONFIG_PAGE_POOL_STATS
+	{
+		struct page_pool_stats pp_stats = { };
+
+		/* the pools only exist while we're up; else it's all zeroes */
+		for (q = 0; q < pstCtx->num_queues; q++)
+			if (pstCtx->rq[q].page_pool)
+				page_pool_get_stats(pstCtx->rq[q].page_pool, &pp_stats);
+		page_pool_ethtool_stats_get(data, &pp_stats);
+	}
+#endif
+}
+
+/* Just what 'ethtool -X' needs: the # of Rx rings */
+static int vnet_get_rxnfc(struct net_device *ndev, struct ethtool_rxnfc *info, u32 *rule_locs)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	if (info->cmd != ETHTOOL_GRXRINGS)
+		return -EOPNOTSUPP;
+	info->data = pstCtx->num_queues;
+	return 0;
+}
+
+static u32 vnet_get_rxfh_indir_size(struct net_device *ndev)
+{
+	return VNET_RSS_INDIR_SIZE;
+}
+
+static u32 vnet_get_rxfh_key_size(struct net_device *ndev)
+{
+	return VNET_RSS_KEY_SIZE;
+}
+
+static void vnet_rss_get(struct stVnetIntfCtx *pstCtx, u32 *indir, u8 *key, u8 *hfunc)
+{
+	unsigned int i;
+
+	if (hfunc)
+		*hfunc = ETH_RSS_HASH_TOP;
+	if (indir)
+		for (i = 0; i < VNET_RSS_INDIR_SIZE; i++)
+			indir[i] = pstCtx->rss.indir[i];
+	if (key)
+		memcpy(key, pstCtx->rss.key, VNET_RSS_KEY_SIZE);
+}
+
+/* The core's already checked the indirection table against our # of Rx rings */
+static int vnet_rss_set(struct stVnetIntfCtx *pstCtx, const u32 *indir, const u8 *key, u8 hfunc)
+{
+	unsigned int i;
+
+	if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	if (indir)
+		for (i = 0; i < VNET_RSS_INDIR_SIZE; i++)
+			WRITE_ONCE(pstCtx->rss.indir[i], indir[i]);
+	if (key) {
+		/* frames hashed meanwhile may get a mix of the old & new key; harmless */
+		memcpy(pstCtx->rss.key, key, VNET_RSS_KEY_SIZE);
+		vnet_rss_build_tbl(&pstCtx->rss);
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+static int vnet_get_rxfh(struct net_device *ndev, struct ethtool_rxfh_param *rxfh)
+{
+	vnet_rss_get(netdev_priv(ndev), rxfh->indir, rxfh->key, &rxfh->hfunc);
+	return 0;
+}
+
+static int vnet_set_rxfh(struct net_device *ndev, struct ethtool_rxfh_param *rxfh,
+			 struct netlink_ext_ack *extack)
+{
+	return vnet_rss_set(netdev_priv(ndev), rxfh->indir, rxfh->key, rxfh->hfunc);
+}
+#else
+static int vnet_get_rxfh(struct net_device *ndev, u32 *indir, u8 *key, u8 *hfunc)
+{
+	vnet_rss_get(netdev_priv(ndev), indir, key, hfunc);
+	return 0;
+}
+
+static int vnet_set_rxfh(struct net_device *ndev, const u32 *indir, const u8 *key, const u8 hfunc)
+{
+	return vnet_rss_set(netdev_priv(ndev), indir, key, hfunc);
+}
+#endif
+
+/* 'ethtool -T veth' */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static int vnet_get_ts_info(struct net_device *ndev, struct kernel_ethtool_ts_info *info)
+#else
+static int vnet_get_ts_info(struct net_device *ndev, struct ethtool_ts_info *info)
+#endif
+{
+	info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+	    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+	    SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = -1;	/* no PTP clock; our 'hardware' clock is CLOCK_REALTIME */
+	info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
+	return 0;
+}
+
+static const struct ethtool_ops vnet_ethtool_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+	.supported_coalesce_params = ETHTOOL_COALESCE_TX_USECS,
+#endif
+	.get_drvinfo = vnet_get_drvinfo,
+	.get_link = ethtool_op_get_link,
+	.get_channels = vnet_get_channels,
+	.set_channels = vnet_set_channels,
+	.get_ringparam = vnet_get_ringparam,
+	.set_ringparam = vnet_set_ringparam,
+	.get_coalesce = vnet_get_coalesce,
+	.set_coalesce = vnet_set_coalesce,
+	.get_sset_count = vnet_get_sset_count,
+	.get_strings = vnet_get_strings,
+	.get_ethtool_stats = vnet_get_ethtool_stats,
+	.get_ts_info = vnet_get_ts_info,
+	.get_rxnfc = vnet_get_rxnfc,
+	.get_rxfh_indir_size = vnet_get_rxfh_indir_size,
+	.get_rxfh_key_size = vnet_get_rxfh_key_size,
+	.get_rxfh = vnet_get_rxfh,
+	.set_rxfh = vnet_set_rxfh,
+};
+
+/*
+ * 'Hardware' timestamping config (SIOCSHWTSTAMP / SIOCGHWTSTAMP). We can stamp
+ * every frame, so any Rx filter other than 'none' becomes 'all' - and we say so,
+ * as the API expects. Takes effect right away: the hot paths just READ_ONCE() it.
+ */
+static int vnet_hwtstamp_apply(struct stVnetIntfCtx *pstCtx, int tx_type, int *rx_filter)
+{
+	if (tx_type != HWTSTAMP_TX_OFF && tx_type != HWTSTAMP_TX_ON)
+		return -ERANGE;
+	if (*rx_filter != HWTSTAMP_FILTER_NONE)
+		*rx_filter = HWTSTAMP_FILTER_ALL;
+	WRITE_ONCE(pstCtx->tstamp.tx_type, tx_type);
+	WRITE_ONCE(pstCtx->tstamp.rx_filter, *rx_filter);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static int vnet_hwtstamp_get(struct net_device *ndev, struct kernel_hwtstamp_config *cfg)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	cfg->flags = 0;
+	cfg->tx_type = pstCtx->tstamp.tx_type;
+	cfg->rx_filter = pstCtx->tstamp.rx_filter;
+	return 0;
+}
+
+static int vnet_hwtstamp_set(struct net_device *ndev, struct kernel_hwtstamp_config *cfg,
+			     struct netlink_ext_ack *extack)
+{
+	int rx_filter = cfg->rx_filter, ret;
+
+	ret = vnet_hwtstamp_apply(netdev_priv(ndev), cfg->tx_type, &rx_filter);
+	if (ret)
+		return ret;
+	cfg->rx_filter = rx_filter;
+	return 0;
+}
+#else
+static int vnet_ioctl(struct net_device *ndev, struct ifreq *ifr, int cmd)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	struct hwtstamp_config cfg;
+	int ret;
+
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		if (copy_from_user(&cfg, ifr->ifr_data, sizeof(cfg)))
+			return -EFAULT;
+		if (cfg.flags)
+			return -EINVAL;
+		ret = vnet_hwtstamp_apply(pstCtx, cfg.tx_type, &cfg.rx_filter);
+		if (ret)
+			return ret;
+		break;
+	case SIOCGHWTSTAMP:
+		cfg = pstCtx->tstamp;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+	return copy_to_user(ifr->ifr_data, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+}
+#endif
+
+/*
+ * Make @a and @b each other's peer: what one transmits, the other receives.
+ * Like any real link, it then needs ARP to resolve the other end's MAC address.
+ */
+static void vnet_pair(struct stVnetIntfCtx *a, struct stVnetIntfCtx *b)
+{
+	ASSERT_RTNL();
+	rcu_assign_pointer(a->peer, b->netdev);
+	rcu_assign_pointer(b->peer, a->netdev);
+	dev_change_flags(a->netdev, a->netdev->flags & ~IFF_NOARP, NULL);
+	dev_change_flags(b->netdev, b->netdev->flags & ~IFF_NOARP, NULL);
+}
+
+/* The other end's left on it's own; it's Tx goes nowhere (or loops back) */
+static void vnet_unpair(struct stVnetIntfCtx *pstCtx)
+{
+	struct net_device *peer = rtnl_dereference(pstCtx->peer);
+	struct stVnetIntfCtx *pctx;
+
+	if (!peer)
+		return;
+	pctx = netdev_priv(peer);
+	RCU_INIT_POINTER(pctx->peer, NULL);
+	RCU_INIT_POINTER(pstCtx->peer, NULL);
+	/* unless it's going away too (both ends deleted in one go) */
+	if (peer->reg_state == NETREG_REGISTERED)
+		dev_change_flags(peer, peer->flags | IFF_NOARP, NULL);
+}
+
+/* Jumbo frames are fine, but a frame must fit in a page for XDP; see vnet_xdp_set() */
+static int vnet_change_mtu(struct net_device *ndev, int new_mtu)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	if (rtnl_dereference(pstCtx->xdp_prog) && new_mtu > VNET_XDP_MAX_MTU) {
+		netdev_warn(ndev, "MTU %d too large with a XDP program attached (max %lu)\n",
+			    new_mtu, (unsigned long)VNET_XDP_MAX_MTU);
+		return -EINVAL;
+	}
+	WRITE_ONCE(ndev->mtu, new_mtu);
+	return 0;
+}
+
+/*
+ * Unregistering: the interface is already down. Our (former) peer may still be
+ * delivering a frame to us from it's Tx completion; the core waits out that RCU
+ * read-side section before the netdev's freed.
+ */
+static void vnet_uninit(struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	vnet_unpair(pstCtx);
+	/*
+	 * This waits out any in-flight debugfs handler; we hold RTNL here, so
+	 * those mustn't block on it (see vnet_dbg_rtnl_lock()).
+	 */
+	debugfs_remove_recursive(pstCtx->dbg_dir);
+	pstCtx->dbg_dir = NULL;
+}
+
+/*
+ * Called by register_netdevice(), once the name's OK'd. If anything after this
+ * fails, the core undoes it (vnet_uninit() and vnet_dev_free()); if this does,
+ * it's up to us.
+ */
+static int vnet_dev_init(struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	int res;
+
+	res = vnet_cap_alloc(pstCtx);
+	if (res)
+		return res;
+
+	pstCtx->flows = vnet_flow_alloc();
+	if (!pstCtx->flows) {
+		res = -ENOMEM;
+		goto out_cap_free;
+	}
+	/* By default, account the packets our userspace talker app sends */
+	{
+		struct vnet_flow_key key = {
+			.proto = IPPROTO_UDP,
+			.dport = htons(PORTNUM),
+		};
+
+		mutex_lock(&pstCtx->flows->lock);
+		res = vnet_flow_add(pstCtx->flows, &key, VNET_FK_PROTO | VNET_FK_DPORT);
+		mutex_unlock(&pstCtx->flows->lock);
+		if (res)
+			goto out_flow_free;
+	}
+	return 0;
+
+ out_flow_free:
+	vnet_flow_free(pstCtx->flows);
+	pstCtx->flows = NULL;
+ out_cap_free:
+	free_percpu(pstCtx->cap);
+	pstCtx->cap = NULL;
+	return res;
+}
+
+/* The priv_destructor; the core then frees the netdev itself (needs_free_netdev) */
+static void vnet_dev_free(struct net_device *ndev)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+
+	kfree(pstCtx->gen.thr);
+	if (pstCtx->flows)
+		vnet_flow_free(pstCtx->flows);
+	free_percpu(pstCtx->cap);
+}
+
+static const struct net_device_ops vnet_netdev_ops = {
+	.ndo_init = vnet_dev_init,
+	.ndo_uninit = vnet_uninit,
+	.ndo_open = vnet_open,
+	.ndo_stop = vnet_stop,
+	.ndo_change_mtu = vnet_change_mtu,
+	.ndo_get_stats64 = vnet_get_stats64,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	.ndo_hwtstamp_get = vnet_hwtstamp_get,
+	.ndo_hwtstamp_set = vnet_hwtstamp_set,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	.ndo_eth_ioctl = vnet_ioctl,
+#else
+	.ndo_do_ioctl = vnet_ioctl,
+#endif
+	.ndo_start_xmit = vnet_start_xmit,
+	.ndo_tx_timeout = vnet_tx_timeout,
+	.ndo_bpf = vnet_bpf,
+	.ndo_xdp_xmit = vnet_xdp_xmit,
+	.ndo_xsk_wakeup = vnet_xsk_wakeup,
+};
+
+/* the base MAC address; each platform instance adds it's id to the last byte */
+static u8 veth_MAC_addr[6] = { 0x48, 0x0F, 0x0E, 0x0D, 0x0A, 0x02 };
+
+/* The net_device level setup; common to all our interfaces, however created */
+static void vnet_setup(struct net_device *ndev)
+{
+	ether_setup(ndev);
+
+	/* keep the default flags, just add NOARP */
+	ndev->flags |= IFF_NOARP;
+
+	ndev->watchdog_timeo = 8 * HZ;
+
+	/* Initializing the netdev ops struct is essential; else, we Oops.. */
+	ndev->netdev_ops = &vnet_netdev_ops;
+	ndev->ethtool_ops = &vnet_ethtool_ops;
+	ndev->needs_free_netdev = true;
+	ndev->priv_destructor = vnet_dev_free;
+
+	ndev->min_mtu = ETH_MIN_MTU;
+	ndev->max_mtu = VNET_MAX_MTU;
+	/*
+	 * Offloads. Without these, the stack segments and checksums every packet in
+	 * software before it even reaches vnet_start_xmit(). Having no hardware, we
+	 * 'offload' it by mostly not doing it at all: the frames are just counted,
+	 * or looped back as-is; see vnet_rx_gso_segment() and vnet_cap_csum_fixup()
+	 * for the only places the work's actually done. All of them may be toggled
+	 * via 'ethtool -K'.
+	 */
+	ndev->hw_features = NETIF_F_SG | NETIF_F_FRAGLIST | NETIF_F_HW_CSUM | NETIF_F_RXCSUM |
+			    NETIF_F_HIGHDMA | NETIF_F_GSO_SOFTWARE | NETIF_F_RXHASH;
+	ndev->vlan_features = ndev->hw_features;
+	/* GRO's on by default (it's a 'soft' feature), but let's be explicit */
+	ndev->features |= ndev->hw_features | NETIF_F_GRO;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	/* native XDP, incl. being the target of a XDP_REDIRECT, and AF_XDP zero-copy */
+	ndev->xdp_features = NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+			     NETDEV_XDP_ACT_NDO_XMIT | NETDEV_XDP_ACT_XSK_ZEROCOPY;
+#endif
+}
+
+/*
+ * Initialize our private context, with @nq queue pairs in use (of the
+ * netdev's allocated ones); the allocations are left to vnet_dev_init().
+ */
+static void vnet_ctx_init(struct net_device *ndev, unsigned int nq)
+{
+	struct stVnetIntfCtx *pstCtx = netdev_priv(ndev);
+	int i;
+
+	spin_lock_init(&pstCtx->lock);
+	pstCtx->netdev = ndev;
+	INIT_LIST_HEAD(&pstCtx->list);
+	pstCtx->num_queues = nq;
+	pstCtx->tx_ring_size = clamp_val(ring_size, VNET_RING_MIN, VNET_RING_MAX);
+	pstCtx->rx_ring_size = pstCtx->tx_ring_size;
+	pstCtx->tx_coal_usecs = clamp_val(tx_coalesce_usecs, 0, USEC_PER_SEC);
+	vnet_gen_init(&pstCtx->gen);
+	vnet_impair_init(&pstCtx->impair);
+	netif_set_real_num_tx_queues(ndev, pstCtx->num_queues);
+	netif_set_real_num_rx_queues(ndev, pstCtx->num_queues);
+	netdev_rss_key_fill(pstCtx->rss.key, VNET_RSS_KEY_SIZE);
+	vnet_rss_build_tbl(&pstCtx->rss);
+	vnet_rss_indir_default(pstCtx);
+
+	for (i = 0; i < VNET_MAX_QUEUES; i++) {
+		struct vnet_txq *txq = &pstCtx->txq[i];
+		struct vnet_rq *rq = &pstCtx->rq[i];
+
+		txq->pstCtx = pstCtx;
+		txq->qid = i;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		hrtimer_setup(&txq->timer, vnet_tx_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+		hrtimer_setup(&txq->wire_timer, vnet_wire_timer_fn, CLOCK_MONOTONIC,
+			      HRTIMER_MODE_ABS_SOFT);
+#else
+		hrtimer_init(&txq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+		txq->timer.function = vnet_tx_timer_fn;
+		hrtimer_init(&txq->wire_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+		txq->wire_timer.function = vnet_wire_timer_fn;
+#endif
+		__skb_queue_head_init(&txq->delayq);
+		prandom_seed_state(&txq->rnd, get_random_u64());
+		u64_stats_init(&txq->istats.syncp);
+		u64_stats_init(&txq->stats.syncp);
+		u64_stats_init(&rq->stats.syncp);
+		u64_stats_init(&rq->xdp_stats.syncp);
+		u64_stats_init(&rq->xmit_stats.syncp);
+		u64_stats_init(&rq->xsk_tx_stats.syncp);
+		rq->pstCtx = pstCtx;
+		rq->qid = i;
+		/* as a NIC driver would spread it's queue IRQs over the CPUs */
+		rq->irq_cpu = cpumask_local_spread(i, NUMA_NO_NODE);
+		INIT_CSD(&rq->csd, vnet_rq_irq, rq);
+		/* (free_netdev() deletes these) */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+		netif_napi_add(ndev, &rq->napi, vnet_poll, NAPI_POLL_WEIGHT);
+#else
+		netif_napi_add(ndev, &rq->napi, vnet_poll);
+#endif
+	}
+}
+
+/* Once registered; debugfs is best-effort, no need to check the return values */
+static void vnet_dbg_add(struct stVnetIntfCtx *pstCtx)
+{
+	pstCtx->dbg_dir = debugfs_create_dir(netdev_name(pstCtx->netdev), vnet_dbg_root);
+	debugfs_create_file("capture", 0400, pstCtx->dbg_dir, pstCtx, &vnet_cap_fops);
+	debugfs_create_file("flows", 0600, pstCtx->dbg_dir, pstCtx, &vnet_flows_fops);
+	debugfs_create_file("gen", 0600, pstCtx->dbg_dir, pstCtx, &vnet_gen_fops);
+	debugfs_create_file("impair", 0600, pstCtx->dbg_dir, pstCtx, &vnet_impair_fops);
+}
+
+/*
+ * One platform device per interface; it's id is the instance #. Instance 0 is
+ * named INTF_NAME ('veth'), the others INTF_NAME<id>.
+ */
+static int vnet_probe(struct platform_device *pdev)
+{
+	char name[IFNAMSIZ];
+	struct net_device *ndev = NULL;
+	struct stVnetIntfCtx *pstCtx;
+	u8 addr[ETH_ALEN];
+	int res = 0;
+
+	QP;
+	if (pdev->id)
+		snprintf(name, sizeof(name), INTF_NAME "%d", pdev->id);
+	else
+		strscpy(name, INTF_NAME, sizeof(name));
+	/* allocate for the max # of queues; the real # in use is set below */
+	ndev = alloc_netdev_mqs(sizeof(struct stVnetIntfCtx), name, NET_NAME_UNKNOWN, vnet_setup,
+				VNET_MAX_QUEUES, VNET_MAX_QUEUES);
+	if (!ndev) {
+		pr_alert("alloc_netdev failed!\n");
+		return -ENOMEM;
+	}
+	/* shows up as /sys/class/net/<intf>/device; the way back to the net_device
+	 * from the platform device is it's drvdata (set once we've registered)
+	 */
+	SET_NETDEV_DEV(ndev, &pdev->dev);
+	/* there's no real DMA; this just keeps AF_XDP's UMEM mapping a direct one */
+	dma_coerce_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+
+	memcpy(addr, veth_MAC_addr, ETH_ALEN);
+	addr[ETH_ALEN - 1] += pdev->id;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	eth_hw_addr_set(ndev, addr);
+#else
+	memcpy(ndev->dev_addr, addr, ETH_ALEN);
+#endif
+
+	vnet_ctx_init(ndev, clamp_val(num_queues, 1, VNET_MAX_QUEUES));
+	pstCtx = netdev_priv(ndev);
+	pstCtx->pdev = pdev;
+
+	res = register_netdev(ndev);
+	if (res) {
+		pr_alert("failed to register net device!\n");
+		free_netdev(ndev);
+		return res;
+	}
+	platform_set_drvdata(pdev, ndev);
+	vnet_dbg_add(pstCtx);
+	return 0;
+}
+
+/* The rest of the teardown is in vnet_uninit() and vnet_dev_free() */
+static int vnet_remove(struct platform_device *pdev)
+{
+	QP;
+	unregister_netdev(platform_get_drvdata(pdev));
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void vnet_remove_void(struct platform_device *pdev)
+{
+	vnet_remove(pdev);
+}
+#endif
+
+/*
+ * rtnetlink: interfaces can also be made (and deleted) with iproute2, as many
+ * as you like, f.e.
+ *   sudo ip link add vn0 numtxqueues 4 numrxqueues 4 mtu 9000 type vnet
+ *   sudo ip link del vn0
+ * The # of queues given is then both the # in use and the max (for
+ * 'ethtool -L'); else it's the num_queues module param, out of VNET_MAX_QUEUES.
+ * These are independent of the platform ones (which 'ip link del' can't
+ * delete), and get a random MAC address unless one's given.
+ */
+static unsigned int vnet_get_num_queues(void)
+{
+	return VNET_MAX_QUEUES;
+}
+
+static int vnet_newlink_common(struct net_device *ndev, struct nlattr *tb[],
+			       struct netlink_ext_ack *extack)
+{
+	unsigned int nq = clamp_val(num_queues, 1, VNET_MAX_QUEUES);
+	int res;
+
+	if (ndev->num_tx_queues > VNET_MAX_QUEUES || ndev->num_rx_queues > VNET_MAX_QUEUES) {
+		NL_SET_ERR_MSG_MOD(extack, "at most " __stringify(VNET_MAX_QUEUES) " Tx/Rx queues");
+		return -EINVAL;
+	}
+	if (tb[IFLA_NUM_TX_QUEUES] || tb[IFLA_NUM_RX_QUEUES])
+		nq = min(ndev->num_tx_queues, ndev->num_rx_queues);
+	if (!is_valid_ether_addr(ndev->dev_addr))
+		eth_hw_addr_random(ndev);
+
+	vnet_ctx_init(ndev, nq);
+	/* on failure, the core frees the netdev */
+	res = register_netdevice(ndev);
+	if (res)
+		return res;
+	vnet_dbg_add(netdev_priv(ndev));
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+static int vnet_newlink(struct net_device *ndev, struct rtnl_newlink_params *params,
+			struct netlink_ext_ack *extack)
+{
+	return vnet_newlink_common(ndev, params->tb, extack);
+}
+#else
+static int vnet_newlink(struct net *src_net, struct net_device *ndev, struct nlattr *tb[],
+			struct nlattr *data[], struct netlink_ext_ack *extack)
+{
+	return vnet_newlink_common(ndev, tb, extack);
+}
+#endif
+
+/* (no dellink: the core's default, unregister_netdevice_queue(), is all we need) */
+static struct rtnl_link_ops vnet_link_ops __read_mostly = {
+	.kind = DRVNAME,
+	.priv_size = sizeof(struct stVnetIntfCtx),
+	.setup = vnet_setup,
+	.newlink = vnet_newlink,
+	.get_num_tx_queues = vnet_get_num_queues,
+	.get_num_rx_queues = vnet_get_num_queues,
+};
+
+/*
+ * Setup a bare-bones platform device & associated driver.
+ * Platform devices get bound to their driver simply on the basis of the 'name' field;
+ * if they match, the driver core "binds" them, invoking the 'probe' routine. Conversely, the
+ * 'remove' method is invoked at unload/shutdown.
+ * Done here mainly so that we have a 'probe' method that will get invoked on it's registration.
+ * The devices themselves are created on the fly (one per interface), via
+ * platform_device_register_simple(), which also gives them the release()
+ * method the driver core insists on.
+ */
+static struct platform_driver virtnet = {
+	.probe = vnet_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	.remove = vnet_remove_void,
+#else
+	.remove = vnet_remove,
+#endif
+	.driver = {
+		   .name = DRVNAME,
+		   .owner = THIS_MODULE,
+		   },
+};
+
+/* Create (and probe) a new interface; returns it's context */
+static struct stVnetIntfCtx *vnet_dev_create(void)
+{
+	struct platform_device *pdev;
+	struct net_device *ndev;
+	struct stVnetIntfCtx *pstCtx;
+	int id;
+
+	lockdep_assert_held(&vnet_devs_lock);
+	id = ida_alloc_max(&vnet_ida, VNET_MAX_DEVS - 1, GFP_KERNEL);
+	if (id < 0)
+		return ERR_PTR(id);
+	pdev = platform_device_register_simple(DRVNAME, id, NULL, 0);
+	if (IS_ERR(pdev)) {
+		ida_free(&vnet_ida, id);
+		return ERR_CAST(pdev);
+	}
+	/* the probe ran right away; it failing doesn't fail the registration though */
+	ndev = platform_get_drvdata(pdev);
+	if (!ndev) {
+		platform_device_unregister(pdev);
+		ida_free(&vnet_ida, id);
+		return ERR_PTR(-ENODEV);
+	}
+	pstCtx = netdev_priv(ndev);
+	list_add_tail(&pstCtx->list, &vnet_devs);
+	return pstCtx;
+}
+
+static void vnet_dev_destroy(struct stVnetIntfCtx *pstCtx)
+{
+	struct platform_device *pdev = pstCtx->pdev;
+	int id = pdev->id;
+
+	lockdep_assert_held(&vnet_devs_lock);
+	list_del(&pstCtx->list);
+	/* invokes vnet_remove(); pstCtx is gone after this */
+	platform_device_unregister(pdev);
+	ida_free(&vnet_ida, id);
+}
+
+/* Add an interface, or a pair of peered ones */
+static int vnet_add(bool pair)
+{
+	struct stVnetIntfCtx *a, *b;
+
+	a = vnet_dev_create();
+	if (IS_ERR(a))
+		return PTR_ERR(a);
+	if (!pair)
+		return 0;
+	b = vnet_dev_create();
+	if (IS_ERR(b)) {
+		vnet_dev_destroy(a);
+		return PTR_ERR(b);
+	}
+	rtnl_lock();
+	vnet_pair(a, b);
+	rtnl_unlock();
+	return 0;
+}
+
+static int vnet_del(const char *name)
+{
+	struct stVnetIntfCtx *pstCtx;
+
+	list_for_each_entry(pstCtx, &vnet_devs, list) {
+		if (!strcmp(netdev_name(pstCtx->netdev), name)) {
+			vnet_dev_destroy(pstCtx);
+			return 0;
+		}
+	}
+	return -ENODEV;
+}
+
+static void vnet_del_all(void)
+{
+	struct stVnetIntfCtx *pstCtx, *tmp;
+
+	mutex_lock(&vnet_devs_lock);
+	list_for_each_entry_safe(pstCtx, tmp, &vnet_devs, list)
+		vnet_dev_destroy(pstCtx);
+	mutex_unlock(&vnet_devs_lock);
+}
+
+/*
+ * Pair two (unpaired) interfaces of ours, however they were created; looked up
+ * in the writer's network namespace
+ */
+static int vnet_pair_byname(const char *name_a, const char *name_b)
+{
+	struct net *net = current->nsproxy->net_ns;
+	struct net_device *a, *b;
+	int ret = 0;
+
+	rtnl_lock();
+	a = __dev_get_by_name(net, name_a);
+	b = __dev_get_by_name(net, name_b);
+	if (!a || !b || a == b || a->netdev_ops != &vnet_netdev_ops ||
+	    b->netdev_ops != &vnet_netdev_ops)
+		ret = -ENODEV;
+	else if (rtnl_dereference(((struct stVnetIntfCtx *)netdev_priv(a))->peer) ||
+		 rtnl_dereference(((struct stVnetIntfCtx *)netdev_priv(b))->peer))
+		ret = -EBUSY;
+	else
+		vnet_pair(netdev_priv(a), netdev_priv(b));
+	rtnl_unlock();
+	return ret;
+}
+
+/*
+ * debugfs vnet/ctl: one command per write -
+ *  "add"               : a new (unpaired) interface
+ *  "add pair"          : two new interfaces, each other's peer
+ *  "del <intf>"        : remove the interface (it's peer, if any, stays, unpaired)
+ *  "pair <intf> <intf>": make two existing ones peers; f.e. ones made with
+ *                        'ip link add ... type vnet'
+ */
+static ssize_t vnet_ctl_write(struct file *filp, const char __user *ubuf, size_t count,
+			      loff_t *ppos)
+{
+	char kbuf[64], *buf, *cmd, *arg, *arg2;
+	int ret;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, ubuf, count))
+		return -EFAULT;
+	kbuf[count] = '\0';
+	buf = strim(kbuf);
+	cmd = vnet_next_tok(&buf);
+	arg = vnet_next_tok(&buf);
+	arg2 = vnet_next_tok(&buf);
+	if (!cmd || vnet_next_tok(&buf))
+		return -EINVAL;
+
+	if (!strcmp(cmd, "pair")) {
+		if (!arg2)
+			return -EINVAL;
+		ret = vnet_pair_byname(arg, arg2);
+		return ret ? ret : count;
+	}
+	if (arg2)
+		return -EINVAL;
+
+	mutex_lock(&vnet_devs_lock);
+	if (!strcmp(cmd, "add") && (!arg || !strcmp(arg, "pair")))
+		ret = vnet_add(!!arg);
+	else if (!strcmp(cmd, "del") && arg)
+		ret = vnet_del(arg);
+	else
+		ret = -EINVAL;
+	mutex_unlock(&vnet_devs_lock);
+
+	return ret ? ret : count;
+}
+
+static int vnet_ctl_show(struct seq_file *m, void *v)
+{
+	struct stVnetIntfCtx *pstCtx;
+
+	seq_puts(m, "# intf queues peer\n");
+	mutex_lock(&vnet_devs_lock);
+	rtnl_lock();
+	list_for_each_entry(pstCtx, &vnet_devs, list) {
+		struct net_device *peer = rtnl_dereference(pstCtx->peer);
+
+		seq_printf(m, "%s %u %s\n", netdev_name(pstCtx->netdev), pstCtx->num_queues,
+			   peer ? netdev_name(peer) : "-");
+	}
+	rtnl_unlock();
+	mutex_unlock(&vnet_devs_lock);
+	return 0;
+}
+
+static int vnet_ctl_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, vnet_ctl_show, inode->i_private);
+}
+
+static const struct file_operations vnet_ctl_fops = {
+	.owner = THIS_MODULE,
+	.open = vnet_ctl_open,
+	.read = seq_read,
+	.write = vnet_ctl_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init vnet_init(void)
+{
+	int res = 0, i, ndevs = clamp_val(num_devs, 0, VNET_MAX_DEVS);
+
+	pr_debug("%s: Initializing network driver...\n", DRVNAME);
+	vnet_flow_init_mask_order();
+	vnet_dbg_root = debugfs_create_dir(DRVNAME, NULL);
+
+	/* (it's name doesn't match our driver's, so it never gets probed) */
+	vnet_dma_pdev = platform_device_register_simple(DRVNAME "_dma", PLATFORM_DEVID_NONE,
+							NULL, 0);
+	if (IS_ERR(vnet_dma_pdev)) {
+		res = PTR_ERR(vnet_dma_pdev);
+		pr_alert("registering the DMA platform device failed!\n");
+		goto out_fail_dma;
+	}
+	dma_coerce_mask_and_coherent(&vnet_dma_pdev->dev, DMA_BIT_MASK(64));
+
+	res = platform_driver_register(&virtnet);
+	if (res) {
+		pr_alert("platform_driver_register failed!\n");
+		goto out_fail_pdr;
+	}
+	// with the driver registered, every platform device we now create has
+	// it's 'probe' method invoked right away..
+	mutex_lock(&vnet_devs_lock);
+	for (i = 0; i < ndevs && !res; i += paired ? 2 : 1)
+		res = vnet_add(paired && i + 1 < ndevs);
+	mutex_unlock(&vnet_devs_lock);
+	if (res) {
+		pr_alert("creating the interfaces failed (%d)!\n", res);
+		goto out_fail_add;
+	}
+	res = rtnl_link_register(&vnet_link_ops);
+	if (res) {
+		pr_alert("rtnl_link_register failed!\n");
+		goto out_fail_add;
+	}
+	vnet_dbg_ctl = debugfs_create_file("ctl", 0600, vnet_dbg_root, NULL, &vnet_ctl_fops);
+
+	pr_info("loaded.\n");
+	return res;
+
+ out_fail_add:
+	vnet_del_all();
+	platform_driver_unregister(&virtnet);
+ out_fail_pdr:
+	platform_device_unregister(vnet_dma_pdev);
+ out_fail_dma:
+	debugfs_remove_recursive(vnet_dbg_root);
+	return res;
+}
+
+static void __exit vnet_exit(void)
+{
+	/* first, so that no new interfaces can show up meanwhile */
+	debugfs_remove(vnet_dbg_ctl);
+	/* deletes all the ones made via 'ip link add' */
+	rtnl_link_unregister(&vnet_link_ops);
+	vnet_del_all();
 	platform_driver_unregister(&virtnet);
-	platform_device_unregister(&veth0);
-	kfree(gpstCtx);
+	/* all interfaces (and so, any UMEM mappings) are gone by now */
+	platform_device_unregister(vnet_dma_pdev);
+	debugfs_remove_recursive(vnet_dbg_root);
+	ida_destroy(&vnet_ida);
+	/* wait out any deleted flow rules still pending their RCU free */
+	rcu_barrier();
 	pr_info("unloaded.\n");
 }
 
@@ -380,4 +4186,6 @@ module_exit(vnet_exit);
 MODULE_DESCRIPTION("Simple demo virtual ethernet (NIC) driver; allows a user \
 app to transmit a UDP packet via this network driver");
 MODULE_AUTHOR("Kaiwan N Billimoria");
+/* so that 'ip link add ... type vnet' loads us */
+MODULE_ALIAS_RTNL_LINK(DRVNAME);
 MODULE_LICENSE("Dual MIT/GPL");
@@ -1,19 +1,88 @@
 /*
 ** listener.c - a datagram sockets "server" demo
 ** From Beej's Guide to Network Programming close(sockfd);
+**
+** Now a sustained receiver too - the sink to pair with talker_dgram:
+** N threads (optionally pinned to CPUs), each with it's own SO_REUSEPORT
+** socket (so the kernel shards the flows across them), receiving batches via
+** recvmmsg(2), optionally busy polling (SO_BUSY_POLL) and with UDP GRO.
+** It reports pps & throughput, socket drops (SO_RXQ_OVFL), sequence gaps and
+** reordering, and one-way latency from the talker's timestamps (struct
+** veth_payload_hdr, see veth_common.h; same host only). F.e.
+**   ./listener_dgram -t 4 -c 4 -b 64 -B 50 -g -d 10
+** With -T, we also ask for Rx timestamps (SO_TIMESTAMPING) and report the Rx
+** stack latency: from the veth driver handing the datagram up (it's
+** 'hardware' stamp, which we enable with SIOCSHWTSTAMP) and from the core
+** stack's software stamp, to our receive call returning it.
+** With -v, every datagram's printed, as the original demo did (and with -n 1,
+** it's just that: receive one datagram, show it, exit).
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include "../veth_common.h"
 
-#define MYPORT 54295		//56100 // the port users will be connecting to
-#define MAXBUFLEN 1024
+#define MYPORT PORTNUM		//56100 // the port users will be connecting to
+#define MAXBUFLEN 9216		/* a jumbo frame's worth */
+#define MAXGROBUFLEN 65536	/* a UDP GRO super-datagram */
+#define MAX_BATCH 1024
+#define MAX_SENDERS 1024	/* talker threads we track sequence #s for */
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+static struct {
+	unsigned int threads;
+	int cpu;			/* -1: don't pin */
+	unsigned int batch;
+	int busy_poll;			/* us; 0: off */
+	int gro;
+	int rcvbuf;
+	unsigned long long count;	/* pkts, over all threads; 0 = no limit */
+	unsigned int duration;		/* s; 0 = no limit */
+	unsigned int interval;		/* s between progress reports; 0 = none */
+	int tstamp;
+	int verbose;
+} cfg = {
+	.threads = 1,
+	.cpu = -1,
+	.batch = 64,
+};
+
+static volatile sig_atomic_t stop;
+static unsigned long long total_pkts;	/* for the -n limit; updated atomically */
+
+struct thr_ctx {
+	pthread_t tid;
+	unsigned int idx;
+	/* results; pkts & bytes are also read, racily, for progress reports */
+	unsigned long long pkts, bytes, calls, drops, gaps, reordered, foreign;
+	struct lat_stats lat;		/* one-way, from the talker's timestamp */
+	struct lat_stats ts_sw, ts_hw;	/* -T: Rx timestamp to our receive returning */
+	unsigned long long next_seq[MAX_SENDERS];
+	unsigned int last_ovfl;
+	double secs;
+};
 
 static void hexdump(unsigned char *srcbuf, unsigned int len)
 {
@@ -25,60 +94,13 @@ static void hexdump(unsigned char *srcbuf, unsigned int len)
 	printf("\n");
 }
 
-int main(int argc, char **argv)
+/* The original demo's output, for a single datagram */
+static void print_pkt(struct sockaddr_in *their_addr, unsigned char *buf, int numbytes)
 {
-	int sockfd;
-	struct sockaddr_in my_addr;	// my address information
-	struct sockaddr_in their_addr;	// connector's address information
-	int numbytes;
-	socklen_t addr_len;
-	unsigned char buf[MAXBUFLEN];
-
-#if 0
-	if (argc == 1) {
-		fprintf(stderr, "Usage: %s interface-to-bind-to\n", argv[0]);
-		exit(1);
-	}
-#endif
-
-	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
-		perror("socket");
-		exit(1);
-	}
-
-#if 0
-	if (setsockopt
-	    (sockfd, SOL_SOCKET, SO_BINDTODEVICE, argv[1],
-	     strlen(argv[1]) + 1) < 0) {
-		printf("\n%s:setsockopt failed...\n", argv[0]);
-		close(sockfd);
-		exit(1);
-	}
-	printf("%s: successfully bound to interface '%s'\n", argv[0], argv[1]);
-#endif
-
-	my_addr.sin_family = AF_INET;	// host byte order
-	my_addr.sin_port = htons(MYPORT);	// short, network byte order
-	//my_addr.sin_addr.s_addr = inet_addr("10.10.1.5"); // DEST IP address
-	my_addr.sin_addr.s_addr = INADDR_ANY;	// automatically fill with my IP zero the rest of the struct
-	memset(&(my_addr.sin_zero), '\0', 8);
-	if (bind(sockfd, (struct sockaddr *)&my_addr,
-		 sizeof(struct sockaddr)) == -1) {
-		perror("bind");
-		exit(1);
-	}
-	addr_len = sizeof(struct sockaddr);
-	printf("%s: blocking on recvfrom...\n", argv[0]);
-	if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN - 1, 0,
-				 (struct sockaddr *)&their_addr,
-				 &addr_len)) == -1) {
-		perror("recvfrom");
-		exit(1);
-	}
-	printf("got packet from %s\n", inet_ntoa(their_addr.sin_addr));
+	printf("got packet from %s\n", inet_ntoa(their_addr->sin_addr));
 	printf("packet is %d bytes long\n", numbytes);
-	if (numbytes == 58) {	/* 42+16=58; we know then that for this app/drv, 
-				   it's the "meta-data" functionality, where the net driver gives us the 
+	if (numbytes == 58) {	/* 42+16=58; we know then that for this app/drv,
+				   it's the "meta-data" functionality, where the net driver gives us the
 				   actual packet content, i.e., skb->data for pkt len bytes */
 		printf("42+16=58; we know then that for this app/drv, \n\
 it's the \"meta-data\" functionality, where the net driver gives us the \n\
@@ -97,8 +119,402 @@ Interpret as:\n\
 ");
 		hexdump(buf, numbytes);
 	}
-	buf[numbytes] = '\0';
-	printf("packet contains \"%s\"\n", buf);
+	if (numbytes >= (int)sizeof(struct veth_payload_hdr) &&
+	    ntohl(((struct veth_payload_hdr *)buf)->magic) == VETH_PAYLOAD_MAGIC) {
+		struct veth_payload_hdr *h = (void *)buf;
+
+		printf("talker thread %u, seq %llu\n", ntohl(h->thread),
+		       (unsigned long long)be64toh(h->seq));
+		buf += sizeof(*h);
+		numbytes -= sizeof(*h);
+	}
+	printf("packet contains \"%.*s\"\n", numbytes, buf);
+}
+
+/* Account for one datagram (or GRO segment) */
+static void account(struct thr_ctx *t, const unsigned char *p, unsigned int len,
+		    unsigned long long now)
+{
+	const struct veth_payload_hdr *h = (const void *)p;
+	unsigned long long seq, tx_ns;
+	unsigned int sender;
+
+	if (len < sizeof(*h) || ntohl(h->magic) != VETH_PAYLOAD_MAGIC) {
+		t->foreign++;
+		return;
+	}
+	sender = ntohl(h->thread) % MAX_SENDERS;
+	seq = be64toh(h->seq);
+	tx_ns = be64toh(h->tx_ns);
+
+	if (seq > t->next_seq[sender])
+		t->gaps += seq - t->next_seq[sender];
+	if (seq < t->next_seq[sender])
+		t->reordered++;
+	else
+		t->next_seq[sender] = seq + 1;
+
+	if (now > tx_ns)
+		lat_record(&t->lat, now - tx_ns);
+}
+
+/*
+ * Have the veth driver timestamp received frames in 'hardware' (on delivery to
+ * the stack); it's global to the interface, so we leave the Tx side as it is.
+ */
+static void hwtstamp_enable(void)
+{
+	struct hwtstamp_config hwc;
+	struct ifreq ifr;
+	int sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sd < 0)
+		return;
+	memset(&ifr, 0, sizeof(ifr));
+	memset(&hwc, 0, sizeof(hwc));
+	strncpy(ifr.ifr_name, INTF_NAME, IFNAMSIZ - 1);
+	ifr.ifr_data = (void *)&hwc;
+	if (ioctl(sd, SIOCGHWTSTAMP, &ifr) < 0)
+		hwc.tx_type = HWTSTAMP_TX_OFF;
+	hwc.flags = 0;
+	hwc.rx_filter = HWTSTAMP_FILTER_ALL;
+	if (ioctl(sd, SIOCSHWTSTAMP, &ifr) < 0)
+		perror("listener: SIOCSHWTSTAMP (only software timestamps then)");
+	close(sd);
+}
+
+static int open_socket(void)
+{
+	struct sockaddr_in my_addr;	// my address information
+	struct timeval tmo = { .tv_usec = 100000 };
+	int sd, one = 1;
+
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("listener: socket");
+		return -1;
+	}
+	/* every thread binds the same port; the kernel spreads the flows across them */
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("listener: setsockopt SO_REUSEPORT");
+		goto out_close;
+	}
+	/* have the socket's (cumulative) drop count reported with each datagram */
+	if (setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+		perror("listener: setsockopt SO_RXQ_OVFL");
+	/* so that a blocked receive notices a stop request */
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+	if (cfg.busy_poll &&
+	    setsockopt(sd, SOL_SOCKET, SO_BUSY_POLL, &cfg.busy_poll, sizeof(cfg.busy_poll)) < 0)
+		perror("listener: setsockopt SO_BUSY_POLL (need root?)");
+	if (cfg.gro && setsockopt(sd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+		perror("listener: setsockopt UDP_GRO");
+	if (cfg.tstamp) {
+		int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+		    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+		if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+			perror("listener: setsockopt SO_TIMESTAMPING");
+	}
+	if (cfg.rcvbuf &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) < 0 &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) < 0)
+		perror("listener: setsockopt SO_RCVBUF");
+
+	memset(&my_addr, 0, sizeof(my_addr));
+	my_addr.sin_family = AF_INET;	// host byte order
+	my_addr.sin_port = htons(MYPORT);	// short, network byte order
+	my_addr.sin_addr.s_addr = INADDR_ANY;	// automatically fill with my IP
+	if (bind(sd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1) {
+		perror("listener: bind");
+		goto out_close;
+	}
+	return sd;
+
+ out_close:
+	close(sd);
+	return -1;
+}
+
+#define CMSG_BUFLEN	(CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(unsigned int)) + \
+			 CMSG_SPACE(sizeof(struct scm_timestamping)))
+
+static void *receiver(void *arg)
+{
+	struct thr_ctx *t = arg;
+	unsigned int bufsz = cfg.gro ? MAXGROBUFLEN : MAXBUFLEN, i;
+	struct sockaddr_in *addrs;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned long long t_start;
+	unsigned char *bufs;
+	char *cbufs;
+	int sd, n;
+
+	if (cfg.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cfg.cpu + t->idx, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "listener: thread %u: couldn't pin to CPU %d\n",
+				t->idx, cfg.cpu + t->idx);
+	}
+	sd = open_socket();
+	if (sd < 0) {
+		stop = 1;
+		return NULL;
+	}
+	msgs = calloc(cfg.batch, sizeof(*msgs));
+	iovs = calloc(cfg.batch, sizeof(*iovs));
+	addrs = calloc(cfg.batch, sizeof(*addrs));
+	bufs = malloc((size_t)cfg.batch * bufsz);
+	cbufs = calloc(cfg.batch, CMSG_BUFLEN);
+	if (!msgs || !iovs || !addrs || !bufs || !cbufs) {
+		fprintf(stderr, "listener: out of memory\n");
+		stop = 1;
+		goto out;
+	}
+	for (i = 0; i < cfg.batch; i++) {
+		iovs[i].iov_base = bufs + (size_t)i * bufsz;
+		iovs[i].iov_len = bufsz;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	t_start = 0;
+	while (!stop) {
+		unsigned long long now, now_rt = 0, pkts = 0;
+
+		for (i = 0; i < cfg.batch; i++) {
+			/* the kernel updates these; reset them every time */
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_control = cbufs + i * CMSG_BUFLEN;
+			msgs[i].msg_hdr.msg_controllen = CMSG_BUFLEN;
+		}
+		n = recvmmsg(sd, msgs, cfg.batch, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("listener: recvmmsg");
+			break;
+		}
+		now = now_ns();
+		if (cfg.tstamp)
+			now_rt = realtime_ns();
+		if (!t_start)	/* measure from the first datagram on */
+			t_start = now;
+		t->calls++;
+
+		for (i = 0; i < (unsigned int)n; i++) {
+			struct msghdr *mh = &msgs[i].msg_hdr;
+			unsigned char *p = iovs[i].iov_base;
+			unsigned int len = msgs[i].msg_len, seg = len;
+			struct cmsghdr *cm;
+
+			for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+				if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+					memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+				else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+					unsigned int ovfl;
+
+					/* cumulative, for the socket's lifetime */
+					memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+					t->drops += ovfl - t->last_ovfl;
+					t->last_ovfl = ovfl;
+				} else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+					struct scm_timestamping tss;
+					unsigned long long ts;
+
+					/* ts[0]: software (the core stack), ts[2]: the driver's 'hardware' */
+					memcpy(&tss, CMSG_DATA(cm), sizeof(tss));
+					ts = tss.ts[0].tv_sec * NSEC_PER_SEC + tss.ts[0].tv_nsec;
+					if (tss.ts[0].tv_sec && now_rt > ts)
+						lat_record(&t->ts_sw, now_rt - ts);
+					ts = tss.ts[2].tv_sec * NSEC_PER_SEC + tss.ts[2].tv_nsec;
+					if (tss.ts[2].tv_sec && now_rt > ts)
+						lat_record(&t->ts_hw, now_rt - ts);
+				}
+			}
+			if (cfg.verbose)
+				print_pkt(&addrs[i], p, len);
+
+			/* a GRO super-datagram: 'seg'-sized segments, the last maybe shorter */
+			if (!seg)
+				seg = len;
+			while (len) {
+				unsigned int l = len < seg ? len : seg;
+
+				account(t, p, l, now);
+				pkts++;
+				p += l;
+				len -= l;
+			}
+			__atomic_store_n(&t->bytes, t->bytes + msgs[i].msg_len, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&t->pkts, t->pkts + pkts, __ATOMIC_RELAXED);
+
+		if (cfg.count && __atomic_add_fetch(&total_pkts, pkts, __ATOMIC_RELAXED) >= cfg.count)
+			stop = 1;
+		t->secs = (now - t_start) / 1e9;
+	}
+
+ out:
+	free(cbufs);
+	free(bufs);
+	free(addrs);
+	free(iovs);
+	free(msgs);
+	close(sd);
+	return NULL;
+}
+
+static void report(struct thr_ctx *thr)
+{
+	unsigned long long pkts = 0, bytes = 0, drops = 0, gaps = 0, reord = 0, foreign = 0;
+	struct lat_stats lat = { 0 }, ts_sw = { 0 }, ts_hw = { 0 };
+	double secs = 0;
+	unsigned int i;
+
+	printf("\n# thread  packets  drops  seq-gaps  reordered  secs      pps        Mbps\n");
+	for (i = 0; i < cfg.threads; i++) {
+		struct thr_ctx *t = &thr[i];
+
+		printf("  %-6u  %-7llu  %-5llu  %-8llu  %-9llu  %-8.3f  %-9.0f  %.1f\n", i, t->pkts,
+		       t->drops, t->gaps, t->reordered, t->secs, t->secs ? t->pkts / t->secs : 0,
+		       t->secs ? t->bytes * 8 / t->secs / 1e6 : 0);
+		pkts += t->pkts;
+		bytes += t->bytes;
+		drops += t->drops;
+		gaps += t->gaps;
+		reord += t->reordered;
+		foreign += t->foreign;
+		lat_merge(&lat, &t->lat);
+		lat_merge(&ts_sw, &t->ts_sw);
+		lat_merge(&ts_hw, &t->ts_hw);
+		if (t->secs > secs)
+			secs = t->secs;
+	}
+	printf("total: %llu packets (%llu payload bytes)", pkts, bytes);
+	if (secs)
+		printf(" in %.3f s: %.0f pps, %.1f Mbps", secs, pkts / secs, bytes * 8 / secs / 1e6);
+	printf("\n       %llu socket drops, %llu sequence gaps, %llu reordered, %llu not from talker_dgram\n",
+	       drops, gaps, reord, foreign);
+	lat_print("one-way latency", &lat);
+	lat_print("driver Rx (hw timestamp) to receive call return", &ts_hw);
+	lat_print("stack Rx (sw timestamp) to receive call return", &ts_sw);
+	report_cpu(pkts);
+}
+
+static void sig_handler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -t threads  # of receiver threads, each with it's own SO_REUSEPORT socket (default 1)\n"
+		"  -c cpu      pin thread i to CPU (cpu + i) (default: don't pin)\n"
+		"  -b batch    max # of datagrams per recvmmsg() call (default 64, max %d)\n"
+		"  -B usecs    busy poll (SO_BUSY_POLL) for this long\n"
+		"  -g          enable UDP GRO\n"
+		"  -R bytes    socket receive buffer size\n"
+		"  -n packets  stop after receiving this many\n"
+		"  -d secs     stop after this many seconds\n"
+		"  -i secs     print the rate every so many seconds\n"
+		"  -T          measure the Rx stack latency, via SO_TIMESTAMPING\n"
+		"  -v          print every datagram\n", name, MAX_BATCH);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long prev = 0, elapsed = 0;
+	struct thr_ctx *thr;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:c:b:B:gR:n:d:i:Tv")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.cpu = atoi(optarg);
+			break;
+		case 'b':
+			cfg.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			cfg.busy_poll = atoi(optarg);
+			break;
+		case 'g':
+			cfg.gro = 1;
+			break;
+		case 'R':
+			cfg.rcvbuf = atoi(optarg);
+			break;
+		case 'n':
+			cfg.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			cfg.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.tstamp = 1;
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !cfg.threads || !cfg.batch || cfg.batch > MAX_BATCH)
+		usage(argv[0]);
+
+	if (cfg.tstamp)
+		hwtstamp_enable();
+
+	thr = calloc(cfg.threads, sizeof(*thr));
+	if (!thr) {
+		perror("calloc");
+		exit(1);
+	}
+	signal(SIGINT, sig_handler);
+
+	printf("%s: %u thread(s) receiving on UDP port %d...\n", argv[0], cfg.threads, MYPORT);
+	for (i = 0; i < cfg.threads; i++) {
+		thr[i].idx = i;
+		if (pthread_create(&thr[i].tid, NULL, receiver, &thr[i])) {
+			fprintf(stderr, "%s: pthread_create failed, aborting.\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* the main thread just keeps time */
+	while (!stop && (!cfg.duration || elapsed < cfg.duration)) {
+		unsigned long long pkts = 0;
+
+		sleep(1);
+		elapsed++;
+		if (!cfg.interval || elapsed % cfg.interval)
+			continue;
+		for (i = 0; i < cfg.threads; i++)
+			pkts += __atomic_load_n(&thr[i].pkts, __ATOMIC_RELAXED);
+		printf("%llus: %llu pps\n", elapsed, (pkts - prev) / cfg.interval);
+		prev = pkts;
+	}
+	stop = 1;
+	for (i = 0; i < cfg.threads; i++)
+		pthread_join(thr[i].tid, NULL);
 
+	if (!cfg.verbose || cfg.count != 1)
+		report(thr);
+	free(thr);
 	return 0;
 }
@@ -0,0 +1,525 @@
+/*
+ * listener_uring.c -- listener_dgram, but on io_uring
+ *
+ * Part of the 'virtual ethernet' / veth NIC driver demo.
+ * The same sink as listener_dgram - N threads, each with it's own
+ * SO_REUSEPORT socket, reporting pps, socket drops (SO_RXQ_OVFL), sequence
+ * gaps / reordering and one-way latency - but each socket has just the one
+ * multishot recvmsg armed on it's thread's io_uring. Every datagram that
+ * arrives then completes into a buffer picked from a ring of provided buffers
+ * (registered with the kernel once, and handed back as soon as we're done with
+ * each), so there's no syscall per packet nor per batch; we only enter the
+ * kernel to wait for completions. With -B, the ring busy polls the NAPI
+ * context(s) the socket's traffic arrives on (io_uring's own NAPI busy
+ * polling; SO_BUSY_POLL doesn't apply here). F.e.
+ *   ./listener_uring -t 4 -c 4 -m 1024 -B 50 -g -d 10
+ * Needs liburing (2.4 or later; 2.6 for -B) and a 6.0+ kernel (6.9 for -B).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <liburing.h>
+#include "../veth_common.h"
+
+#define MYPORT PORTNUM
+#define MAXBUFLEN 9216		/* a jumbo frame's worth */
+#define MAXGROBUFLEN 65536	/* a UDP GRO super-datagram */
+#define MAX_BUFS 32768		/* the most a provided buffer ring can have */
+#define MAX_SENDERS 1024	/* talker threads we track sequence #s for */
+#define BGID 0			/* our (only) provided buffer group */
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+static struct {
+	unsigned int threads;
+	int cpu;			/* -1: don't pin */
+	unsigned int nbufs;		/* provided buffers per thread; a power of 2 */
+	int busy_poll;			/* us; 0: off */
+	int gro;
+	int rcvbuf;
+	unsigned long long count;	/* pkts, over all threads; 0 = no limit */
+	unsigned int duration;		/* s; 0 = no limit */
+	unsigned int interval;		/* s between progress reports; 0 = none */
+	int verbose;
+} cfg = {
+	.threads = 1,
+	.cpu = -1,
+	.nbufs = 512,
+};
+
+static volatile sig_atomic_t stop;
+static unsigned long long total_pkts;	/* for the -n limit; updated atomically */
+
+struct thr_ctx {
+	pthread_t tid;
+	unsigned int idx;
+	/* results; pkts & bytes are also read, racily, for progress reports */
+	unsigned long long pkts, bytes, calls, drops, gaps, reordered, foreign, nobufs;
+	struct lat_stats lat;		/* one-way, from the talker's timestamp */
+	unsigned long long next_seq[MAX_SENDERS];
+	unsigned int last_ovfl;
+	double secs;
+};
+
+static void print_pkt(struct sockaddr_in *their_addr, unsigned char *buf, int numbytes)
+{
+	printf("got packet from %s\n", inet_ntoa(their_addr->sin_addr));
+	printf("packet is %d bytes long\n", numbytes);
+	if (numbytes >= (int)sizeof(struct veth_payload_hdr) &&
+	    ntohl(((struct veth_payload_hdr *)buf)->magic) == VETH_PAYLOAD_MAGIC) {
+		struct veth_payload_hdr *h = (void *)buf;
+
+		printf("talker thread %u, seq %llu\n", ntohl(h->thread),
+		       (unsigned long long)be64toh(h->seq));
+		buf += sizeof(*h);
+		numbytes -= sizeof(*h);
+	}
+	printf("packet contains \"%.*s\"\n", numbytes, buf);
+}
+
+/* Account for one datagram (or GRO segment) */
+static void account(struct thr_ctx *t, const unsigned char *p, unsigned int len,
+		    unsigned long long now)
+{
+	const struct veth_payload_hdr *h = (const void *)p;
+	unsigned long long seq, tx_ns;
+	unsigned int sender;
+
+	if (len < sizeof(*h) || ntohl(h->magic) != VETH_PAYLOAD_MAGIC) {
+		t->foreign++;
+		return;
+	}
+	sender = ntohl(h->thread) % MAX_SENDERS;
+	seq = be64toh(h->seq);
+	tx_ns = be64toh(h->tx_ns);
+
+	if (seq > t->next_seq[sender])
+		t->gaps += seq - t->next_seq[sender];
+	if (seq < t->next_seq[sender])
+		t->reordered++;
+	else
+		t->next_seq[sender] = seq + 1;
+
+	if (now > tx_ns)
+		lat_record(&t->lat, now - tx_ns);
+}
+
+static int open_socket(void)
+{
+	struct sockaddr_in my_addr;	// my address information
+	int sd, one = 1;
+
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("listener: socket");
+		return -1;
+	}
+	/* every thread binds the same port; the kernel spreads the flows across them */
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("listener: setsockopt SO_REUSEPORT");
+		goto out_close;
+	}
+	/* have the socket's (cumulative) drop count reported with each datagram */
+	if (setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+		perror("listener: setsockopt SO_RXQ_OVFL");
+	if (cfg.gro && setsockopt(sd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+		perror("listener: setsockopt UDP_GRO");
+	if (cfg.rcvbuf &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) < 0 &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &cfg.rcvbuf, sizeof(cfg.rcvbuf)) < 0)
+		perror("listener: setsockopt SO_RCVBUF");
+
+	memset(&my_addr, 0, sizeof(my_addr));
+	my_addr.sin_family = AF_INET;	// host byte order
+	my_addr.sin_port = htons(MYPORT);	// short, network byte order
+	my_addr.sin_addr.s_addr = INADDR_ANY;	// automatically fill with my IP
+	if (bind(sd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1) {
+		perror("listener: bind");
+		goto out_close;
+	}
+	return sd;
+
+ out_close:
+	close(sd);
+	return -1;
+}
+
+#define CMSG_BUFLEN	(CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(unsigned int)))
+
+static int setup_ring(struct io_uring *ring)
+{
+	struct io_uring_params p;
+	int ret;
+
+	/*
+	 * Each thread's the only submitter to it's ring; fewer task_work IPIs too.
+	 * A CQ with room for a completion per buffer, so that it doesn't overflow.
+	 */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+	p.cq_entries = cfg.nbufs * 2;
+	ret = io_uring_queue_init_params(8, ring, &p);
+	if (ret == -EINVAL) {	/* an older kernel */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = cfg.nbufs * 2;
+		ret = io_uring_queue_init_params(8, ring, &p);
+	}
+	if (ret < 0)
+		fprintf(stderr, "listener: io_uring_queue_init: %s\n", strerror(-ret));
+	return ret;
+}
+
+/* (Re)arm the socket's multishot recvmsg; buffers come from our provided buffer ring */
+static int arm_recv(struct io_uring *ring, struct msghdr *msg)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	if (!sqe)
+		return -EBUSY;
+	io_uring_prep_recvmsg_multishot(sqe, 0, msg, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	return 0;
+}
+
+static void *receiver(void *arg)
+{
+	struct thr_ctx *t = arg;
+	/*
+	 * A buffer holds a struct io_uring_recvmsg_out, then the source address,
+	 * the control msgs and the payload, in that order
+	 */
+	unsigned int bufsz = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) +
+		CMSG_BUFLEN + (cfg.gro ? MAXGROBUFLEN : MAXBUFLEN);
+	unsigned int mask = io_uring_buf_ring_mask(cfg.nbufs), i;
+	struct io_uring_buf_ring *br = NULL;
+	struct __kernel_timespec tmo = { .tv_nsec = 100000000 };
+	unsigned long long t_start;
+	struct io_uring ring;
+	struct msghdr msg;
+	unsigned char *bufs;
+	int sd, ret;
+
+	if (cfg.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cfg.cpu + t->idx, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "listener: thread %u: couldn't pin to CPU %d\n",
+				t->idx, cfg.cpu + t->idx);
+	}
+	sd = open_socket();
+	if (sd < 0) {
+		stop = 1;
+		return NULL;
+	}
+	bufs = malloc((size_t)cfg.nbufs * bufsz);
+	if (!bufs) {
+		fprintf(stderr, "listener: out of memory\n");
+		stop = 1;
+		goto out_close;
+	}
+	if (setup_ring(&ring) < 0) {
+		stop = 1;
+		goto out_free;
+	}
+	ret = io_uring_register_files(&ring, &sd, 1);
+	if (ret < 0) {
+		fprintf(stderr, "listener: io_uring_register_files: %s\n", strerror(-ret));
+		stop = 1;
+		goto out;
+	}
+	/* the provided buffer ring: shared with the kernel, which picks a buffer per datagram */
+	br = io_uring_setup_buf_ring(&ring, cfg.nbufs, BGID, 0, &ret);
+	if (!br) {
+		fprintf(stderr, "listener: io_uring_setup_buf_ring: %s\n", strerror(-ret));
+		stop = 1;
+		goto out;
+	}
+	for (i = 0; i < cfg.nbufs; i++)
+		io_uring_buf_ring_add(br, bufs + (size_t)i * bufsz, bufsz, i, mask, i);
+	io_uring_buf_ring_advance(br, cfg.nbufs);
+
+	if (cfg.busy_poll) {
+		struct io_uring_napi napi = {
+			.busy_poll_to = cfg.busy_poll,
+			.prefer_busy_poll = 1,
+		};
+
+		ret = io_uring_register_napi(&ring, &napi);
+		if (ret < 0)
+			fprintf(stderr, "listener: io_uring_register_napi: %s\n", strerror(-ret));
+	}
+
+	/* only the lengths matter to a multishot recvmsg */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_controllen = CMSG_BUFLEN;
+	arm_recv(&ring, &msg);
+
+	t_start = 0;
+	while (!stop) {
+		unsigned long long now, pkts = 0;
+		unsigned int head, n = 0, nret = 0;
+		struct io_uring_cqe *cqe;
+		int rearm = 0;
+
+		/* time out now and then, so as to notice a stop request */
+		ret = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &tmo, NULL);
+		if (ret < 0) {
+			if (ret == -ETIME || ret == -EINTR)
+				continue;
+			fprintf(stderr, "listener: io_uring_submit_and_wait: %s\n", strerror(-ret));
+			break;
+		}
+		now = now_ns();
+		if (!t_start)	/* measure from the first datagram on */
+			t_start = now;
+		t->calls++;
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			struct io_uring_recvmsg_out *o;
+			unsigned int bid, len, seg;
+			struct cmsghdr *cm;
+			unsigned char *p;
+
+			n++;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				rearm = 1;	/* the multishot's ended */
+			if (cqe->res < 0) {
+				if (cqe->res == -ENOBUFS) {	/* we've not handed buffers back fast enough */
+					t->nobufs++;
+				} else if (cqe->res != -EINTR) {
+					fprintf(stderr, "listener: recvmsg: %s\n", strerror(-cqe->res));
+					stop = 1;
+				}
+				continue;
+			}
+			if (!(cqe->flags & IORING_CQE_F_BUFFER))
+				continue;
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			p = bufs + (size_t)bid * bufsz;
+
+			o = io_uring_recvmsg_validate(p, cqe->res, &msg);
+			if (o) {
+				len = io_uring_recvmsg_payload_length(o, cqe->res, &msg);
+				seg = len;
+				for (cm = io_uring_recvmsg_cmsg_firsthdr(o, &msg); cm;
+				     cm = io_uring_recvmsg_cmsg_nexthdr(o, &msg, cm)) {
+					if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+						memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+					else if (cm->cmsg_level == SOL_SOCKET &&
+						 cm->cmsg_type == SO_RXQ_OVFL) {
+						unsigned int ovfl;
+
+						/* cumulative, for the socket's lifetime */
+						memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+						t->drops += ovfl - t->last_ovfl;
+						t->last_ovfl = ovfl;
+					}
+				}
+				p = io_uring_recvmsg_payload(o, &msg);
+				if (cfg.verbose)
+					print_pkt(io_uring_recvmsg_name(o), p, len);
+
+				t->bytes += len;
+				/* a GRO super-datagram: 'seg'-sized segments, the last maybe shorter */
+				if (!seg)
+					seg = len;
+				while (len) {
+					unsigned int l = len < seg ? len : seg;
+
+					account(t, p, l, now);
+					pkts++;
+					p += l;
+					len -= l;
+				}
+			}
+			/* done with it; hand the buffer back */
+			io_uring_buf_ring_add(br, bufs + (size_t)bid * bufsz, bufsz, bid, mask, nret++);
+		}
+		io_uring_buf_ring_advance(br, nret);
+		io_uring_cq_advance(&ring, n);
+		if (rearm && !stop && arm_recv(&ring, &msg) < 0) {
+			fprintf(stderr, "listener: couldn't re-arm the receive\n");
+			break;
+		}
+
+		__atomic_store_n(&t->pkts, t->pkts + pkts, __ATOMIC_RELAXED);
+		if (cfg.count && __atomic_add_fetch(&total_pkts, pkts, __ATOMIC_RELAXED) >= cfg.count)
+			stop = 1;
+		t->secs = (now - t_start) / 1e9;
+	}
+
+ out:
+	if (br)
+		io_uring_free_buf_ring(&ring, br, cfg.nbufs, BGID);
+	io_uring_queue_exit(&ring);
+ out_free:
+	free(bufs);
+ out_close:
+	close(sd);
+	return NULL;
+}
+
+static void report(struct thr_ctx *thr)
+{
+	unsigned long long pkts = 0, bytes = 0, drops = 0, gaps = 0, reord = 0, foreign = 0;
+	unsigned long long nobufs = 0, calls = 0;
+	struct lat_stats lat = { 0 };
+	double secs = 0;
+	unsigned int i;
+
+	printf("\n# thread  packets  drops  seq-gaps  reordered  secs      pps        Mbps\n");
+	for (i = 0; i < cfg.threads; i++) {
+		struct thr_ctx *t = &thr[i];
+
+		printf("  %-6u  %-7llu  %-5llu  %-8llu  %-9llu  %-8.3f  %-9.0f  %.1f\n", i, t->pkts,
+		       t->drops, t->gaps, t->reordered, t->secs, t->secs ? t->pkts / t->secs : 0,
+		       t->secs ? t->bytes * 8 / t->secs / 1e6 : 0);
+		pkts += t->pkts;
+		bytes += t->bytes;
+		drops += t->drops;
+		gaps += t->gaps;
+		reord += t->reordered;
+		foreign += t->foreign;
+		nobufs += t->nobufs;
+		calls += t->calls;
+		lat_merge(&lat, &t->lat);
+		if (t->secs > secs)
+			secs = t->secs;
+	}
+	printf("total: %llu packets (%llu payload bytes)", pkts, bytes);
+	if (secs)
+		printf(" in %.3f s: %.0f pps, %.1f Mbps", secs, pkts / secs, bytes * 8 / secs / 1e6);
+	printf("\n       %llu socket drops, %llu sequence gaps, %llu reordered, %llu not from talker_dgram\n",
+	       drops, gaps, reord, foreign);
+	printf("       %llu waits for completions (%.1f pkts/wait), %llu out-of-buffers\n",
+	       calls, calls ? (double)pkts / calls : 0, nobufs);
+	lat_print("one-way latency", &lat);
+	report_cpu(pkts);
+}
+
+static void sig_handler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -t threads  # of receiver threads, each with it's own SO_REUSEPORT socket & ring (default 1)\n"
+		"  -c cpu      pin thread i to CPU (cpu + i) (default: don't pin)\n"
+		"  -m bufs     # of provided receive buffers per thread; a power of 2 (default 512, max %d)\n"
+		"  -B usecs    busy poll (io_uring NAPI busy polling) for this long\n"
+		"  -g          enable UDP GRO\n"
+		"  -R bytes    socket receive buffer size\n"
+		"  -n packets  stop after receiving this many\n"
+		"  -d secs     stop after this many seconds\n"
+		"  -i secs     print the rate every so many seconds\n"
+		"  -v          print every datagram\n", name, MAX_BUFS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long prev = 0, elapsed = 0;
+	struct thr_ctx *thr;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:c:m:B:gR:n:d:i:v")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.cpu = atoi(optarg);
+			break;
+		case 'm':
+			cfg.nbufs = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			cfg.busy_poll = atoi(optarg);
+			break;
+		case 'g':
+			cfg.gro = 1;
+			break;
+		case 'R':
+			cfg.rcvbuf = atoi(optarg);
+			break;
+		case 'n':
+			cfg.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			cfg.interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !cfg.threads || !cfg.nbufs || cfg.nbufs > MAX_BUFS ||
+	    (cfg.nbufs & (cfg.nbufs - 1)))
+		usage(argv[0]);
+
+	thr = calloc(cfg.threads, sizeof(*thr));
+	if (!thr) {
+		perror("calloc");
+		exit(1);
+	}
+	signal(SIGINT, sig_handler);
+
+	printf("%s: %u thread(s) receiving on UDP port %d...\n", argv[0], cfg.threads, MYPORT);
+	for (i = 0; i < cfg.threads; i++) {
+		thr[i].idx = i;
+		if (pthread_create(&thr[i].tid, NULL, receiver, &thr[i])) {
+			fprintf(stderr, "%s: pthread_create failed, aborting.\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	/* the main thread just keeps time */
+	while (!stop && (!cfg.duration || elapsed < cfg.duration)) {
+		unsigned long long pkts = 0;
+
+		sleep(1);
+		elapsed++;
+		if (!cfg.interval || elapsed % cfg.interval)
+			continue;
+		for (i = 0; i < cfg.threads; i++)
+			pkts += __atomic_load_n(&thr[i].pkts, __ATOMIC_RELAXED);
+		printf("%llus: %llu pps\n", elapsed, (pkts - prev) / cfg.interval);
+		prev = pkts;
+	}
+	stop = 1;
+	for (i = 0; i < cfg.threads; i++)
+		pthread_join(thr[i].tid, NULL);
+
+	if (!cfg.verbose || cfg.count != 1)
+		report(thr);
+	free(thr);
+	return 0;
+}
@@ -11,114 +11,480 @@
  * 5. ./runapp
  * ...
  * It should work.. watch the kernel log with 'journalctl -f -k'
+ *
+ * By default, it still sends one packet per second, as the original demo did.
+ * It doubles as a load generator though: N sender threads (optionally pinned
+ * to CPUs), each with it's own (connected) socket, sending batches of
+ * datagrams per sendmmsg(2) call, optionally as UDP GSO super-buffers
+ * (UDP_SEGMENT), at a target rate or flat out. F.e.
+ *   sudo ./talker_dgram -t 4 -c 0 -r 0 -b 64 -s 64 -d 10 10.10.1.5 "hey" 0
+ * At the end, it reports the packets & throughput achieved, and the latency
+ * of the send calls. Every datagram starts with a struct veth_payload_hdr
+ * (see veth_common.h), which lets the listener check for loss & latency.
+ * With -T, the socket asks for Tx timestamps (SO_TIMESTAMPING), and we report
+ * how long a datagram took from the send call to the driver's xmit routine
+ * (the software stamp) and on to it's Tx completion (the veth driver's
+ * 'hardware' stamp, which we enable with SIOCSHWTSTAMP): the Tx stack latency.
  * Kaiwan N Billimoria
  */
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include "../veth_common.h"
 
 //#define PORTNUM 54295 // the port users will be connecting to
 //#define INTF   "veth"
 
-static int send_pkt(int counter, int sd, char *dest_ip, char *msg)
+#define MAX_BATCH	1024
+#define MAX_GSO_SEGS	64
+#define MAX_PAYLOAD	65507	/* max UDP/IPv4 payload */
+#define TS_RING		4096	/* send times kept, to match Tx timestamps against */
+
+static struct {
+	struct sockaddr_in dest_addr;	/* built just once */
+	const char *msg;
+	unsigned int threads;
+	int cpu;			/* -1: don't pin */
+	unsigned long long rate;	/* pkts/s, over all threads; 0 = flat out */
+	unsigned long long count;	/* pkts, over all threads; 0 = no limit */
+	unsigned int batch;
+	unsigned int gso_segs;		/* 0: no GSO */
+	unsigned int size;		/* UDP payload size */
+	unsigned int duration;		/* s; 0 = no limit */
+	int tstamp;
+	int verbose;
+} cfg = {
+	.threads = 1,
+	.cpu = -1,
+	.rate = 1,
+	.batch = 1,
+};
+
+static volatile sig_atomic_t stop;
+
+struct thr_ctx {
+	pthread_t tid;
+	unsigned int idx;
+	unsigned long long quota;	/* pkts this thread's to send; 0 = no limit */
+	/* results */
+	unsigned long long sent, bytes, calls, errors;
+	struct lat_stats call_lat;
+	/* -T: send call to the driver's xmit entry (sw), and to Tx completion (hw) */
+	struct lat_stats ts_sw, ts_hw;
+	unsigned long long ts_t0[TS_RING];	/* CLOCK_REALTIME at send; by timestamp key */
+	unsigned int ts_key;		/* the next datagram's timestamp key (SOF_TIMESTAMPING_OPT_ID) */
+	double secs;
+};
+
+/*
+ * Have the veth driver timestamp Tx'ed frames in 'hardware' (on Tx completion);
+ * it's global to the interface, so we leave the Rx side as it is.
+ */
+static void hwtstamp_enable(void)
 {
-	struct sockaddr_in dest_addr;
-	int numbytes;
-
-	dest_addr.sin_family = AF_INET;	// host byte order
-	dest_addr.sin_port = htons(PORTNUM);	// short, network byte order
-	dest_addr.sin_addr.s_addr = inet_addr(dest_ip);
-	memset(&(dest_addr.sin_zero), '\0', 8);
-
-//printf("port=%d\n",dest_addr.sin_port);
-
-	printf("talker: sending packet %3d over UDP/IP port %d now...\n",
-	       counter, PORTNUM);
-	if ((numbytes = sendto(sd, msg, strlen(msg), 0,
-			       (struct sockaddr *)&dest_addr,
-			       sizeof(dest_addr))) == -1) {
-		perror("talker: sendto");
+	struct hwtstamp_config hwc;
+	struct ifreq ifr;
+	int sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sd < 0)
+		return;
+	memset(&ifr, 0, sizeof(ifr));
+	memset(&hwc, 0, sizeof(hwc));
+	strncpy(ifr.ifr_name, INTF_NAME, IFNAMSIZ - 1);
+	ifr.ifr_data = (void *)&hwc;
+	if (ioctl(sd, SIOCGHWTSTAMP, &ifr) < 0)
+		hwc.rx_filter = HWTSTAMP_FILTER_NONE;
+	hwc.flags = 0;
+	hwc.tx_type = HWTSTAMP_TX_ON;
+	if (ioctl(sd, SIOCSHWTSTAMP, &ifr) < 0)
+		perror("talker: SIOCSHWTSTAMP (only software timestamps then)");
+	close(sd);
+}
+
+/* Drain the Tx timestamps off the socket's error queue */
+static void tstamp_reap(struct thr_ctx *t, int sd)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+		  CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	for (;;) {
+		struct scm_timestamping *tss = NULL;
+		struct sock_extended_err *serr = NULL;
+		unsigned long long t0;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+				tss = (void *)CMSG_DATA(cm);
+			else if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				serr = (void *)CMSG_DATA(cm);
+		}
+		if (!tss || !serr || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+		    serr->ee_info != SCM_TSTAMP_SND)
+			continue;
+		/* ee_data's the key: this socket's datagram # */
+		t0 = t->ts_t0[serr->ee_data % TS_RING];
+		if (tss->ts[0].tv_sec) {
+			unsigned long long ts = tss->ts[0].tv_sec * NSEC_PER_SEC + tss->ts[0].tv_nsec;
+
+			if (ts > t0)
+				lat_record(&t->ts_sw, ts - t0);
+		}
+		if (tss->ts[2].tv_sec) {
+			unsigned long long ts = tss->ts[2].tv_sec * NSEC_PER_SEC + tss->ts[2].tv_nsec;
+
+			if (ts > t0)
+				lat_record(&t->ts_hw, ts - t0);
+		}
+	}
+}
+
+static int open_socket(void)
+{
+	int sd, segsz = cfg.size;
+
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("talker: socket");
 		return -1;
 	}
-	//printf("talker: sent %d bytes.\n", numbytes);
-	return numbytes;
+	// Should be running as root!
+	if (setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, INTF_NAME, strlen(INTF_NAME)) < 0) {
+		perror("talker: setsockopt SO_BINDTODEVICE");
+		goto out_close;
+	}
+	/* connected: no per-send route lookup nor dest addr to pass */
+	if (connect(sd, (struct sockaddr *)&cfg.dest_addr, sizeof(cfg.dest_addr)) < 0) {
+		perror("talker: connect");
+		goto out_close;
+	}
+	if (cfg.gso_segs && setsockopt(sd, IPPROTO_UDP, UDP_SEGMENT, &segsz, sizeof(segsz)) < 0) {
+		perror("talker: setsockopt UDP_SEGMENT");
+		goto out_close;
+	}
+	if (cfg.tstamp) {
+		/*
+		 * Software and 'hardware' Tx stamps (both: OPT_TX_SWHW), each keyed
+		 * with the datagram's # (OPT_ID), without the packet (OPT_TSONLY)
+		 */
+		int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+		    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+		    SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY |
+		    SOF_TIMESTAMPING_OPT_TX_SWHW;
+
+		if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+			perror("talker: setsockopt SO_TIMESTAMPING");
+			goto out_close;
+		}
+	}
+	return sd;
+
+ out_close:
+	close(sd);
+	return -1;
 }
 
-#if 0
-#define MAXBUFLEN 1000
-static int recv_pkt(int sd)
+static void *sender(void *arg)
 {
-	struct sockaddr_in src_addr;	// connector's (peers) address information
-	int numbytes;
-	socklen_t addr_len;
-	char buf[MAXBUFLEN];
-
-	addr_len = sizeof(struct sockaddr);
-	if ((numbytes = recvfrom(sd, buf, MAXBUFLEN - 1, 0,
-				 (struct sockaddr *)&src_addr,
-				 &addr_len)) == -1) {
-		perror("recvfrom");
-		exit(1);
+	struct thr_ctx *t = arg;
+	unsigned int segs = cfg.gso_segs ? cfg.gso_segs : 1;
+	unsigned int bufsz = cfg.size * segs, i, j;
+	unsigned long long rate = 0, seq = 0, t_start, t0, t1;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char *bufs;
+	int sd, n;
+
+	if (cfg.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cfg.cpu + t->idx, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "talker: thread %u: couldn't pin to CPU %d\n",
+				t->idx, cfg.cpu + t->idx);
+	}
+	if (cfg.rate) {
+		rate = cfg.rate / cfg.threads;
+		if (!rate)
+			rate = 1;
 	}
-	printf("got packet from %s\n", inet_ntoa(src_addr.sin_addr));
-	printf("packet is %d bytes long\n", numbytes);
-	buf[numbytes] = '\0';
-	printf("packet contains \"%s\"\n", buf);
 
-	return numbytes;
+	sd = open_socket();
+	if (sd < 0)
+		return NULL;
+	msgs = calloc(cfg.batch, sizeof(*msgs));
+	iovs = calloc(cfg.batch, sizeof(*iovs));
+	bufs = calloc(cfg.batch, bufsz);
+	if (!msgs || !iovs || !bufs) {
+		fprintf(stderr, "talker: out of memory\n");
+		goto out;
+	}
+	/* the (fixed) payload: header, then the message; only the header changes */
+	for (i = 0; i < cfg.batch; i++) {
+		for (j = 0; j < segs; j++) {
+			char *p = bufs + i * bufsz + j * cfg.size;
+			unsigned int room = cfg.size - sizeof(struct veth_payload_hdr);
+			unsigned int len = strlen(cfg.msg);
+
+			memcpy(p + sizeof(struct veth_payload_hdr), cfg.msg, len < room ? len : room);
+		}
+		iovs[i].iov_base = bufs + i * bufsz;
+		iovs[i].iov_len = bufsz;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	t_start = now_ns();
+	while (!stop && (!t->quota || t->sent < t->quota)) {
+		unsigned int vlen = cfg.batch;
+
+		/* don't overshoot the quota (by more than a GSO buffer) */
+		if (t->quota && (t->quota - t->sent + segs - 1) / segs < vlen)
+			vlen = (t->quota - t->sent + segs - 1) / segs;
+
+		t0 = now_ns();
+		for (i = 0; i < vlen; i++) {
+			for (j = 0; j < segs; j++) {
+				struct veth_payload_hdr *h = (void *)(bufs + i * bufsz + j * cfg.size);
+
+				h->magic = htonl(VETH_PAYLOAD_MAGIC);
+				h->thread = htonl(t->idx);
+				h->seq = htobe64(seq++);
+				h->tx_ns = htobe64(t0);
+			}
+		}
+		if (cfg.tstamp) {
+			unsigned long long rt = realtime_ns();
+
+			for (i = 0; i < vlen; i++)
+				t->ts_t0[(t->ts_key + i) % TS_RING] = rt;
+		}
+		n = sendmmsg(sd, msgs, vlen, 0);
+		t1 = now_ns();
+		t->calls++;
+		lat_record(&t->call_lat, t1 - t0);
+		if (cfg.tstamp) {
+			/* a failed send may or may not have used up a key; close enough */
+			t->ts_key += n > 0 ? n : 0;
+			tstamp_reap(t, sd);
+		}
+		if (n < 0) {
+			/*
+			 * f.e. ENOBUFS when the qdisc is full, or ECONNREFUSED (an ICMP
+			 * port unreachable) while nobody's listening; just carry on
+			 */
+			t->errors++;
+			seq -= (unsigned long long)vlen * segs;
+			if (errno != ENOBUFS && errno != EAGAIN && errno != ECONNREFUSED) {
+				perror("talker: sendmmsg");
+				break;
+			}
+			continue;
+		}
+		seq -= (unsigned long long)(vlen - n) * segs;
+		t->sent += (unsigned long long)n * segs;
+		t->bytes += (unsigned long long)n * bufsz;
+		if (cfg.verbose)
+			printf("talker[%u]: sent %d x %u packet(s) over UDP/IP port %d (total %llu)\n",
+			       t->idx, n, segs, PORTNUM, t->sent);
+
+		if (rate)
+			sleep_until_ns(t_start + t->sent * NSEC_PER_SEC / rate);
+	}
+	t->secs = (now_ns() - t_start) / 1e9;
+	if (cfg.tstamp) {	/* the last few stamps */
+		usleep(10000);
+		tstamp_reap(t, sd);
+	}
+
+ out:
+	free(bufs);
+	free(iovs);
+	free(msgs);
+	close(sd);
+	return NULL;
+}
+
+static void report(struct thr_ctx *thr)
+{
+	unsigned long long sent = 0, bytes = 0, calls = 0, errors = 0;
+	struct lat_stats call_lat = { 0 }, ts_sw = { 0 }, ts_hw = { 0 };
+	char what[64];
+	double secs = 0;
+	unsigned int i;
+
+	printf("\n# thread  packets  errors  secs      pps        Mbps\n");
+	for (i = 0; i < cfg.threads; i++) {
+		struct thr_ctx *t = &thr[i];
+
+		printf("  %-6u  %-7llu  %-6llu  %-8.3f  %-9.0f  %.1f\n", i, t->sent, t->errors, t->secs,
+		       t->secs ? t->sent / t->secs : 0, t->secs ? t->bytes * 8 / t->secs / 1e6 : 0);
+		sent += t->sent;
+		bytes += t->bytes;
+		calls += t->calls;
+		errors += t->errors;
+		lat_merge(&call_lat, &t->call_lat);
+		lat_merge(&ts_sw, &t->ts_sw);
+		lat_merge(&ts_hw, &t->ts_hw);
+		if (t->secs > secs)
+			secs = t->secs;
+	}
+	if (!secs || !calls)
+		return;
+	printf("total: %llu packets (%llu payload bytes) in %.3f s: %.0f pps, %.1f Mbps; %llu send errors\n",
+	       sent, bytes, secs, sent / secs, bytes * 8 / secs / 1e6, errors);
+	snprintf(what, sizeof(what), "send call latency, up to %u x %u pkts/call",
+		 cfg.batch, cfg.gso_segs ? cfg.gso_segs : 1);
+	lat_print(what, &call_lat);
+	lat_print("send call to driver xmit (sw timestamp)", &ts_sw);
+	lat_print("send call to Tx completion (hw timestamp)", &ts_hw);
+	report_cpu(sent);
+}
+
+static void sig_handler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] DEST-IP-address message number-of-packets-to-transmit\n"
+		" (0 packets: no limit; stop with ^C or -d)\n"
+		"  -t threads  # of sender threads, each with it's own socket (default 1)\n"
+		"  -c cpu      pin thread i to CPU (cpu + i) (default: don't pin)\n"
+		"  -r pps      target rate in packets/s, over all threads; 0 = flat out (default 1)\n"
+		"  -b batch    # of datagrams (or GSO buffers) per sendmmsg() call (default 1, max %d)\n"
+		"  -g segs     UDP GSO: send 'segs' packets per buffer, via UDP_SEGMENT (max %d)\n"
+		"  -s size     UDP payload size (default: just fits the header and message)\n"
+		"  -d secs     stop after this many seconds\n"
+		"  -T          measure the Tx stack latency, via SO_TIMESTAMPING\n"
+		"  -v          print every send\n", name, MAX_BATCH, MAX_GSO_SEGS);
+	exit(1);
 }
-#endif
 
 int main(int argc, char *argv[])
 {
-	int sockfd, i;
+	struct thr_ctx *thr;
+	unsigned int i;
+	int opt;
 
 	if (geteuid()) {
 		fprintf(stderr, "%s: need to run as root.\n", argv[0]);
 		exit(1);
 	}
-	if (argc != 4) {
-		fprintf(stderr, "Usage: %s DEST-IP-address message number-of-packets-to-transmit\n", argv[0]);
-		exit(1);
+	while ((opt = getopt(argc, argv, "t:c:r:b:g:s:d:Tv")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.cpu = atoi(optarg);
+			break;
+		case 'r':
+			cfg.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			cfg.gso_segs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.tstamp = 1;
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3)
+		usage(argv[0]);
+	cfg.msg = argv[optind + 1];
+	cfg.count = strtoull(argv[optind + 2], NULL, 0);
+
+	if (!cfg.size)
+		cfg.size = sizeof(struct veth_payload_hdr) + strlen(cfg.msg);
+	if (!cfg.threads || !cfg.batch || cfg.batch > MAX_BATCH || cfg.gso_segs > MAX_GSO_SEGS ||
+	    cfg.size < sizeof(struct veth_payload_hdr) ||
+	    cfg.size * (cfg.gso_segs ? cfg.gso_segs : 1) > MAX_PAYLOAD) {
+		fprintf(stderr, "%s: invalid option value(s)\n", argv[0]);
+		usage(argv[0]);
 	}
 
-	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
-		perror("socket");
+	cfg.dest_addr.sin_family = AF_INET;	// host byte order
+	cfg.dest_addr.sin_port = htons(PORTNUM);	// short, network byte order
+	if (inet_pton(AF_INET, argv[optind], &cfg.dest_addr.sin_addr) != 1) {
+		fprintf(stderr, "%s: invalid IP address %s\n", argv[0], argv[optind]);
 		exit(1);
 	}
-#if 1
-	// Should be running as root!
-	if (setsockopt
-	    (sockfd, SOL_SOCKET, SO_BINDTODEVICE, INTF_NAME,
-	     strlen(INTF_NAME)) < 0) {
-		printf("\n%s:setsockopt failed...\n", argv[0]);
-		close(sockfd);
+
+	if (cfg.tstamp)
+		hwtstamp_enable();
+
+	thr = calloc(cfg.threads, sizeof(*thr));
+	if (!thr) {
+		perror("calloc");
 		exit(1);
 	}
-	printf("%s: successfully bound to interface '%s'\n", argv[0],
-	       INTF_NAME);
-#endif
-	for (i = 0; i < atoi(argv[3]); i++) {
-	//while (1) {
-		if (send_pkt(i, sockfd, argv[1], argv[2]) == -1) {
-			fprintf(stderr, "%s: send_pkt failed, aborting.\n",
-				argv[0]);
-			close(sockfd);
+	signal(SIGINT, sig_handler);
+	signal(SIGALRM, sig_handler);
+	if (cfg.duration)
+		alarm(cfg.duration);
+
+	printf("%s: %u thread(s) sending to %s:%d via interface '%s'; rate %llu pps%s\n",
+	       argv[0], cfg.threads, argv[optind], PORTNUM, INTF_NAME, cfg.rate,
+	       cfg.rate ? "" : " (flat out)");
+	for (i = 0; i < cfg.threads; i++) {
+		thr[i].idx = i;
+		/* share out the packet count; the first threads get any remainder */
+		if (cfg.count)
+			thr[i].quota = cfg.count / cfg.threads + (i < cfg.count % cfg.threads);
+		if (cfg.count && !thr[i].quota)
+			continue;
+		if (pthread_create(&thr[i].tid, NULL, sender, &thr[i])) {
+			fprintf(stderr, "%s: pthread_create failed, aborting.\n", argv[0]);
 			exit(1);
 		}
-		sleep(1);
 	}
-	//recv_pkt(sockfd);
-	close(sockfd);
+	for (i = 0; i < cfg.threads; i++)
+		if (!cfg.count || thr[i].quota)
+			pthread_join(thr[i].tid, NULL);
 
+	report(thr);
+	free(thr);
 	return 0;
 }
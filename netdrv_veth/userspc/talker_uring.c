@@ -0,0 +1,453 @@
+/*
+ * talker_uring.c -- talker_dgram, but on io_uring
+ *
+ * Part of the 'virtual ethernet' / veth NIC driver demo.
+ * The same job as talker_dgram's load generator mode - N sender threads, each
+ * with it's own connected socket, at a target rate or flat out - but the
+ * sends are io_uring SQEs, submitted in batches (-b) with up to -q of them in
+ * flight per thread. The socket's a registered (fixed) file; with -z, the
+ * sends are IORING_OP_SEND_ZC from registered (fixed) buffers, which is the
+ * only way to have a send use those.
+ *   sudo ./talker_uring -t 2 -c 0 -r 0 -b 64 -q 256 10.10.1.5 "hey" 0
+ * The datagrams are the same as talker_dgram's (a struct veth_payload_hdr,
+ * then the message), so listener_dgram / listener_uring can sink them. Note
+ * that a failed send leaves a hole in the sequence #s (it's counted as an
+ * error here); talker_dgram instead reuses the seq # on the next try.
+ * Needs liburing (2.3 or later) and a 6.0+ kernel.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <liburing.h>
+#include "../veth_common.h"
+
+#define MAX_BATCH	1024
+#define MAX_QDEPTH	4096
+#define MAX_GSO_SEGS	64
+#define MAX_PAYLOAD	65507	/* max UDP/IPv4 payload */
+
+static struct {
+	struct sockaddr_in dest_addr;	/* built just once */
+	const char *msg;
+	unsigned int threads;
+	int cpu;			/* -1: don't pin */
+	unsigned long long rate;	/* pkts/s, over all threads; 0 = flat out */
+	unsigned long long count;	/* pkts, over all threads; 0 = no limit */
+	unsigned int batch;		/* SQEs per submit */
+	unsigned int qdepth;		/* max sends in flight, per thread */
+	unsigned int gso_segs;		/* 0: no GSO */
+	unsigned int size;		/* UDP payload size */
+	unsigned int duration;		/* s; 0 = no limit */
+	int zc;
+	int verbose;
+} cfg = {
+	.threads = 1,
+	.cpu = -1,
+	.rate = 1,
+	.batch = 32,
+	.qdepth = 256,
+};
+
+static volatile sig_atomic_t stop;
+
+struct thr_ctx {
+	pthread_t tid;
+	unsigned int idx;
+	unsigned long long quota;	/* pkts this thread's to send; 0 = no limit */
+	/* results */
+	unsigned long long sent, bytes, calls, errors;
+	struct lat_stats call_lat;
+	double secs;
+};
+
+static int open_socket(void)
+{
+	int sd, segsz = cfg.size;
+
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("talker: socket");
+		return -1;
+	}
+	// Should be running as root!
+	if (setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, INTF_NAME, strlen(INTF_NAME)) < 0) {
+		perror("talker: setsockopt SO_BINDTODEVICE");
+		goto out_close;
+	}
+	/* connected: no per-send route lookup nor dest addr to pass */
+	if (connect(sd, (struct sockaddr *)&cfg.dest_addr, sizeof(cfg.dest_addr)) < 0) {
+		perror("talker: connect");
+		goto out_close;
+	}
+	if (cfg.gso_segs && setsockopt(sd, IPPROTO_UDP, UDP_SEGMENT, &segsz, sizeof(segsz)) < 0) {
+		perror("talker: setsockopt UDP_SEGMENT");
+		goto out_close;
+	}
+	return sd;
+
+ out_close:
+	close(sd);
+	return -1;
+}
+
+static int setup_ring(struct io_uring *ring)
+{
+	struct io_uring_params p;
+	int ret;
+
+	/* each thread's the only submitter to it's ring; fewer task_work IPIs too */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+	p.flags |= IORING_SETUP_CQSIZE;
+	p.cq_entries = cfg.qdepth * 2;	/* room for the zero-copy notifications */
+	ret = io_uring_queue_init_params(cfg.batch, ring, &p);
+	if (ret == -EINVAL) {	/* an older kernel */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = cfg.qdepth * 2;
+		ret = io_uring_queue_init_params(cfg.batch, ring, &p);
+	}
+	if (ret < 0)
+		fprintf(stderr, "talker: io_uring_queue_init: %s\n", strerror(-ret));
+	return ret;
+}
+
+static void *sender(void *arg)
+{
+	struct thr_ctx *t = arg;
+	unsigned int segs = cfg.gso_segs ? cfg.gso_segs : 1;
+	unsigned int bufsz = cfg.size * segs, nfree, inflight = 0, i, j;
+	unsigned long long rate = 0, seq = 0, queued = 0, t_start, t0;
+	unsigned int *free_slots = NULL;
+	struct io_uring ring;
+	struct iovec iov;
+	char *bufs = NULL;
+	int sd, ret;
+
+	if (cfg.cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cfg.cpu + t->idx, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "talker: thread %u: couldn't pin to CPU %d\n",
+				t->idx, cfg.cpu + t->idx);
+	}
+	if (cfg.rate) {
+		rate = cfg.rate / cfg.threads;
+		if (!rate)
+			rate = 1;
+	}
+
+	sd = open_socket();
+	if (sd < 0)
+		return NULL;
+	if (setup_ring(&ring) < 0)
+		goto out_close;
+
+	/* a buffer 'slot' per send in flight; it's free again once the send completes */
+	free_slots = calloc(cfg.qdepth, sizeof(*free_slots));
+	bufs = calloc(cfg.qdepth, bufsz);
+	if (!free_slots || !bufs) {
+		fprintf(stderr, "talker: out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < cfg.qdepth; i++) {
+		for (j = 0; j < segs; j++) {
+			char *p = bufs + (size_t)i * bufsz + j * cfg.size;
+			unsigned int room = cfg.size - sizeof(struct veth_payload_hdr);
+			unsigned int len = strlen(cfg.msg);
+
+			memcpy(p + sizeof(struct veth_payload_hdr), cfg.msg, len < room ? len : room);
+		}
+		free_slots[i] = cfg.qdepth - 1 - i;
+	}
+	nfree = cfg.qdepth;
+
+	/* fixed file 0: saves an fget/fput per send */
+	ret = io_uring_register_files(&ring, &sd, 1);
+	if (ret < 0) {
+		fprintf(stderr, "talker: io_uring_register_files: %s\n", strerror(-ret));
+		goto out;
+	}
+	/* registered buffers: pinned & mapped once, rather than on every send */
+	iov.iov_base = bufs;
+	iov.iov_len = (size_t)cfg.qdepth * bufsz;
+	if (cfg.zc) {
+		ret = io_uring_register_buffers(&ring, &iov, 1);
+		if (ret < 0) {
+			fprintf(stderr, "talker: io_uring_register_buffers: %s\n", strerror(-ret));
+			goto out;
+		}
+	}
+
+	t_start = now_ns();
+	/* on stop, carry on until every slot's back (SEND_ZC notifications included) */
+	while (!stop || nfree < cfg.qdepth) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, n = 0, vlen = 0;
+
+		t0 = now_ns();
+		/* queue up to a batch, as the free slots, quota and rate allow */
+		while (!stop && nfree && vlen < cfg.batch &&
+		       (!t->quota || t->sent + (unsigned long long)inflight * segs < t->quota) &&
+		       (!rate || queued * NSEC_PER_SEC / rate <= t0 - t_start)) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+			unsigned int slot;
+			char *buf;
+
+			if (!sqe)
+				break;
+			slot = free_slots[--nfree];
+			buf = bufs + (size_t)slot * bufsz;
+			for (j = 0; j < segs; j++) {
+				struct veth_payload_hdr *h = (void *)(buf + j * cfg.size);
+
+				h->magic = htonl(VETH_PAYLOAD_MAGIC);
+				h->thread = htonl(t->idx);
+				h->seq = htobe64(seq++);
+				h->tx_ns = htobe64(t0);
+			}
+			if (cfg.zc)
+				io_uring_prep_send_zc_fixed(sqe, 0, buf, bufsz, 0, 0, 0);
+			else
+				io_uring_prep_send(sqe, 0, buf, bufsz, 0);
+			sqe->flags |= IOSQE_FIXED_FILE;
+			io_uring_sqe_set_data64(sqe, slot);
+			inflight++;
+			queued += segs;
+			vlen++;
+		}
+		if (!vlen && nfree == cfg.qdepth) {
+			if (stop || !rate || (t->quota && t->sent >= t->quota))
+				break;
+			/* rate limited, nothing outstanding */
+			sleep_until_ns(t_start + queued * NSEC_PER_SEC / rate);
+			continue;
+		}
+
+		/* only block when there's nothing more we may queue */
+		ret = io_uring_submit_and_wait(&ring, (!vlen || !nfree) ? 1 : 0);
+		if (vlen) {
+			t->calls++;
+			lat_record(&t->call_lat, now_ns() - t0);
+		}
+		if (ret < 0 && ret != -EINTR) {
+			fprintf(stderr, "talker: io_uring_submit: %s\n", strerror(-ret));
+			break;
+		}
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			unsigned int slot = cqe->user_data;
+
+			n++;
+			/* SEND_ZC: the buffer's ours again only with the notification */
+			if (cqe->flags & IORING_CQE_F_NOTIF) {
+				free_slots[nfree++] = slot;
+				continue;
+			}
+			if (cqe->res < 0) {
+				/*
+				 * f.e. ENOBUFS when the qdisc is full, or ECONNREFUSED (an ICMP
+				 * port unreachable) while nobody's listening; just carry on
+				 */
+				t->errors++;
+				queued -= segs;
+				if (cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+				    cqe->res != -ECONNREFUSED) {
+					fprintf(stderr, "talker: send: %s\n", strerror(-cqe->res));
+					stop = 1;
+				}
+			} else {
+				t->sent += segs;
+				t->bytes += cqe->res;
+			}
+			inflight--;
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				free_slots[nfree++] = slot;
+		}
+		io_uring_cq_advance(&ring, n);
+		if (cfg.verbose && n)
+			printf("talker[%u]: reaped %u completion(s) (total %llu)\n",
+			       t->idx, n, t->sent);
+	}
+	t->secs = (now_ns() - t_start) / 1e9;
+
+ out:
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	free(free_slots);
+ out_close:
+	close(sd);
+	return NULL;
+}
+
+static void report(struct thr_ctx *thr)
+{
+	unsigned long long sent = 0, bytes = 0, calls = 0, errors = 0;
+	struct lat_stats call_lat = { 0 };
+	char what[64];
+	double secs = 0;
+	unsigned int i;
+
+	printf("\n# thread  packets  errors  secs      pps        Mbps\n");
+	for (i = 0; i < cfg.threads; i++) {
+		struct thr_ctx *t = &thr[i];
+
+		printf("  %-6u  %-7llu  %-6llu  %-8.3f  %-9.0f  %.1f\n", i, t->sent, t->errors, t->secs,
+		       t->secs ? t->sent / t->secs : 0, t->secs ? t->bytes * 8 / t->secs / 1e6 : 0);
+		sent += t->sent;
+		bytes += t->bytes;
+		calls += t->calls;
+		errors += t->errors;
+		lat_merge(&call_lat, &t->call_lat);
+		if (t->secs > secs)
+			secs = t->secs;
+	}
+	if (!secs || !calls)
+		return;
+	printf("total: %llu packets (%llu payload bytes) in %.3f s: %.0f pps, %.1f Mbps; %llu send errors\n",
+	       sent, bytes, secs, sent / secs, bytes * 8 / secs / 1e6, errors);
+	snprintf(what, sizeof(what), "submit call latency, up to %u x %u pkts/call",
+		 cfg.batch, cfg.gso_segs ? cfg.gso_segs : 1);
+	lat_print(what, &call_lat);
+	report_cpu(sent);
+}
+
+static void sig_handler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] DEST-IP-address message number-of-packets-to-transmit\n"
+		" (0 packets: no limit; stop with ^C or -d)\n"
+		"  -t threads  # of sender threads, each with it's own socket & ring (default 1)\n"
+		"  -c cpu      pin thread i to CPU (cpu + i) (default: don't pin)\n"
+		"  -r pps      target rate in packets/s, over all threads; 0 = flat out (default 1)\n"
+		"  -b batch    # of sends (SQEs) per io_uring_enter() (default 32, max %d)\n"
+		"  -q depth    max # of sends in flight, per thread (default 256, max %d)\n"
+		"  -z          zero-copy sends (IORING_OP_SEND_ZC) from registered buffers\n"
+		"  -g segs     UDP GSO: send 'segs' packets per buffer, via UDP_SEGMENT (max %d)\n"
+		"  -s size     UDP payload size (default: just fits the header and message)\n"
+		"  -d secs     stop after this many seconds\n"
+		"  -v          print every batch of completions\n",
+		name, MAX_BATCH, MAX_QDEPTH, MAX_GSO_SEGS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct thr_ctx *thr;
+	unsigned int i;
+	int opt;
+
+	if (geteuid()) {
+		fprintf(stderr, "%s: need to run as root.\n", argv[0]);
+		exit(1);
+	}
+	while ((opt = getopt(argc, argv, "t:c:r:b:q:zg:s:d:v")) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.cpu = atoi(optarg);
+			break;
+		case 'r':
+			cfg.rate = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			cfg.qdepth = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			cfg.zc = 1;
+			break;
+		case 'g':
+			cfg.gso_segs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 3)
+		usage(argv[0]);
+	cfg.msg = argv[optind + 1];
+	cfg.count = strtoull(argv[optind + 2], NULL, 0);
+
+	if (!cfg.size)
+		cfg.size = sizeof(struct veth_payload_hdr) + strlen(cfg.msg);
+	if (!cfg.threads || !cfg.batch || cfg.batch > MAX_BATCH ||
+	    !cfg.qdepth || cfg.qdepth > MAX_QDEPTH || cfg.gso_segs > MAX_GSO_SEGS ||
+	    cfg.size < sizeof(struct veth_payload_hdr) ||
+	    cfg.size * (cfg.gso_segs ? cfg.gso_segs : 1) > MAX_PAYLOAD) {
+		fprintf(stderr, "%s: invalid option value(s)\n", argv[0]);
+		usage(argv[0]);
+	}
+
+	cfg.dest_addr.sin_family = AF_INET;	// host byte order
+	cfg.dest_addr.sin_port = htons(PORTNUM);	// short, network byte order
+	if (inet_pton(AF_INET, argv[optind], &cfg.dest_addr.sin_addr) != 1) {
+		fprintf(stderr, "%s: invalid IP address %s\n", argv[0], argv[optind]);
+		exit(1);
+	}
+
+	thr = calloc(cfg.threads, sizeof(*thr));
+	if (!thr) {
+		perror("calloc");
+		exit(1);
+	}
+	signal(SIGINT, sig_handler);
+	signal(SIGALRM, sig_handler);
+	if (cfg.duration)
+		alarm(cfg.duration);
+
+	printf("%s: %u thread(s) sending to %s:%d via interface '%s'; rate %llu pps%s%s\n",
+	       argv[0], cfg.threads, argv[optind], PORTNUM, INTF_NAME, cfg.rate,
+	       cfg.rate ? "" : " (flat out)", cfg.zc ? "; zero-copy" : "");
+	for (i = 0; i < cfg.threads; i++) {
+		thr[i].idx = i;
+		/* share out the packet count; the first threads get any remainder */
+		if (cfg.count)
+			thr[i].quota = cfg.count / cfg.threads + (i < cfg.count % cfg.threads);
+		if (cfg.count && !thr[i].quota)
+			continue;
+		if (pthread_create(&thr[i].tid, NULL, sender, &thr[i])) {
+			fprintf(stderr, "%s: pthread_create failed, aborting.\n", argv[0]);
+			exit(1);
+		}
+	}
+	for (i = 0; i < cfg.threads; i++)
+		if (!cfg.count || thr[i].quota)
+			pthread_join(thr[i].tid, NULL);
+
+	report(thr);
+	free(thr);
+	return 0;
+}
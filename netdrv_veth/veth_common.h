@@ -8,25 +8,203 @@
 #define PORTNUM     54295 // the port users will be connecting to
 #define INTF_NAME  "veth"
 
+#ifndef __KERNEL__
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * The header our userspace talker stamps at the start of every datagram (of
+ * every GSO segment, even), so that the listener can account for loss,
+ * reordering and latency. All fields are in network byte order.
+ */
+#define VETH_PAYLOAD_MAGIC	0x76657468	/* "veth" */
+struct veth_payload_hdr {
+	uint32_t magic;
+	uint32_t thread;	/* sender thread #; sequence #s are per thread */
+	uint64_t seq;
+	uint64_t tx_ns;		/* CLOCK_MONOTONIC at send: same-host latency only */
+};
+
+/*
+ * Helpers shared by the userspace talker/listener apps (static inline, so an
+ * app that doesn't use one isn't warned about it).
+ */
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC	1000000000ULL
+#endif
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* the clock the kernel's (sw and hw) packet timestamps are in */
+static inline unsigned long long realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void sleep_until_ns(unsigned long long due)
+{
+	struct timespec ts;
+	long long ahead = due - now_ns();
+
+	if (ahead <= 0)
+		return;
+	if (ahead < 50000) {	/* too short to sleep for; spin */
+		while (now_ns() < due)
+			;
+		return;
+	}
+	ts.tv_sec = due / NSEC_PER_SEC;
+	ts.tv_nsec = due % NSEC_PER_SEC;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Latency stats: kept per thread, merged for the report */
+struct lat_stats {
+	unsigned long long n, min, max, sum;
+	unsigned long long hist[64];	/* log2(ns) buckets */
+};
+
+static inline void lat_record(struct lat_stats *l, unsigned long long ns)
+{
+	if (!l->n++ || ns < l->min)
+		l->min = ns;
+	l->hist[ns ? 63 - __builtin_clzll(ns) : 0]++;
+	l->sum += ns;
+	if (ns > l->max)
+		l->max = ns;
+}
+
+static inline void lat_merge(struct lat_stats *to, const struct lat_stats *from)
+{
+	int b;
+
+	if (!from->n)
+		return;
+	if (!to->n || from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+	to->n += from->n;
+	to->sum += from->sum;
+	for (b = 0; b < 64; b++)
+		to->hist[b] += from->hist[b];
+}
+
+/* The (upper bound of the) bucket the p'th percentile falls in */
+static inline unsigned long long lat_pctile(const struct lat_stats *l, double p)
+{
+	unsigned long long want = l->n * p / 100, cum = 0;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		cum += l->hist[i];
+		if (cum > want)
+			return 1ULL << (i + 1);
+	}
+	return 0;
+}
+
+static inline void lat_print(const char *what, const struct lat_stats *l)
+{
+	if (!l->n)
+		return;
+	printf("%s (ns, %llu samples): min %llu avg %llu p50 <%llu p99 <%llu max %llu\n",
+	       what, l->n, l->min, l->sum / l->n, lat_pctile(l, 50), lat_pctile(l, 99), l->max);
+}
+
+/*
+ * Our CPU time (user + sys, all threads) per packet; the cost compare_modes
+ * compares the modes on.
+ */
+static inline void report_cpu(unsigned long long pkts)
+{
+	struct rusage ru;
+	double usr, sys;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return;
+	usr = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	printf("cpu: %.3f s user, %.3f s sys; %.0f ns/pkt\n", usr, sys,
+	       pkts ? (usr + sys) * 1e9 / pkts : 0);
+}
+#endif
+
 #ifdef __KERNEL__
 #define pr_fmt(fmt) "%s:%s(): " fmt, KBUILD_MODNAME, __func__
 
+#include <linux/version.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/sched.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>	/* restart_syscall() */
+#endif
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/rtnetlink.h>
 
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
 #include <linux/skbuff.h>
 #include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
 #include <linux/ip.h>
 #include <linux/udp.h>
+#include <linux/inet.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/nsproxy.h>
+#include <linux/random.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#include <linux/prandom.h>
+#endif
+#include <net/ip.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#include <net/gso.h>		/* skb_gso_segment() & co moved here in 6.4 */
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 #include <linux/debugfs.h>
+#include <linux/ptr_ring.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <net/xdp.h>
+#include <net/xdp_sock_drv.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#include <net/page_pool/helpers.h>
+#else
+#include <net/page_pool.h>
+#endif
 
 #include "convenient.h"
 
@@ -43,8 +221,21 @@
 
 #define MAXPKTSZ	1500
 
+/* Tx/Rx queue pairs; each Rx queue has it's own ring and NAPI instance */
+#define VNET_MAX_QUEUES	16
+#define VNET_RING_SIZE	256	/* default # of frames per Tx/Rx ring */
+#define VNET_RING_MIN	16
+#define VNET_RING_MAX	16384
+
+/* interfaces one module instance can drive: veth, veth1, veth2, ... */
+#define VNET_MAX_DEVS	64
+
+#define VNET_MAX_MTU	9000	/* jumbo frames */
+
 /*
  * SKB_PEEK : glean info about the passed socket buffer, esp it's memory (n/w packet).
+ * Debug aid only - it printk's (and hex dumps) the whole buffer; keep it out of
+ * the data path (use the driver's sampled capture for that).
  * Ref: http://vger.kernel.org/~davem/skb_data.html
  * Minor note: The printk o/p of print_hex_dump_bytes may not appear straight away
  * (on minicom) due to the KERN_ loglevel it's written at; use dmesg to see everything...
@@ -3,6 +3,10 @@
  * Simple demo driver; readers are put to sleep on a
  * wait queue. Any writer coming along awakens the readers.
  * This version does implement proper SMP locking.
+ * It's a real message channel: each write() is a message, queued onto a
+ * lock-free ring; each read() gets one. Readers sleep only when the ring's
+ * empty (and writers only when it's full). Or, open it O_NONBLOCK and wait
+ * in poll()/epoll/io_uring, with as many fds as you like in one thread.
  * Uses the 'misc' char driver framework.
  *
  * Author: Kaiwan N Billimoria
@@ -17,6 +21,10 @@
 #include <linux/mm.h>		// kvmalloc()
 #include <linux/fs.h>		// the fops
 #include <linux/sched.h>	// get_task_comm()
+#include <linux/wait.h>
+#include <linux/log2.h>		// roundup_pow_of_two()
+#include <linux/poll.h>
+#include <linux/uio.h>		// iov_iter
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -28,84 +36,270 @@
 
 #include "../convenient.h"
 
-static atomic_t data_present = ATOMIC_INIT(0);	/* event condition flag */
-DECLARE_WAIT_QUEUE_HEAD(wq);
+DECLARE_WAIT_QUEUE_HEAD(wq);			/* readers wait here for data */
+static DECLARE_WAIT_QUEUE_HEAD(wq_space);	/* writers wait here for space */
 
 static int exclusive_wakeup;
 module_param(exclusive_wakeup, int, 0644);
 MODULE_PARM_DESC(exclusive_wakeup, "set this to 1 to perform exclusive waiter/wakeups (only 1 sleeper will be awoken at a time);"
 "default (0) is that all sleepers are awoken immd");
 
+static int ring_slots = 256;
+module_param(ring_slots, int, 0444);
+MODULE_PARM_DESC(ring_slots, "# of messages the ring holds (rounded up to a power of 2; default 256)");
+
 MODULE_AUTHOR("Kaiwan");
-MODULE_DESCRIPTION("Trivial demo of using a wait queue");
+MODULE_DESCRIPTION("Demo of using a wait queue, for a lock-free message channel");
 MODULE_LICENSE("GPL/MIT");
 
 /*
- * In this demo driver, we just put the current reader to sleep
- * trivially..; in a 'real' driver one would check at the h/w level: is data
- * available? If no, put the reader to sleep, else continue...stuff like that.
+ * The message ring: bounded, lock-free, multi-producer/multi-consumer (it's
+ * D. Vyukov's algorithm). Every slot has a sequence # that says who may use it
+ * next; for the slot at ring position 'pos':
+ *  seq == pos     : it's free; the writer that claims 'pos' fills it
+ *  seq == pos + 1 : it's full; the reader that claims 'pos' empties it, then
+ *                   sets seq = pos + # slots, freeing it for the next lap
+ * Writers claim positions with a cmpxchg on 'enq', readers with one on 'deq';
+ * so there's no lock, and writers and readers don't contend with each other
+ * (just among themselves, on their own - separate cacheline - index).
+ * The data's copied straight to/from user-space within the claimed slot; a
+ * fault there only holds up that one slot.
  */
-static ssize_t sleepy_read(struct file *filp, char __user *buf, size_t count, loff_t *offp)
+#define SLPY_MSG_MAX	1024	/* a longer write's truncated to this */
+
+struct slpy_slot {
+	atomic_long_t seq;
+	size_t len;		/* 0 : the writer faulted; it's not a message */
+	char data[SLPY_MSG_MAX];
+};
+
+static struct {
+	atomic_long_t enq ____cacheline_aligned_in_smp;
+	atomic_long_t deq ____cacheline_aligned_in_smp;
+	struct slpy_slot *slots;
+	unsigned long mask;	/* # slots - 1 */
+} ring;
+
+/* Claim the next free slot (it's position in *ppos), or NULL if the ring's full */
+static struct slpy_slot *slpy_claim_free(unsigned long *ppos)
 {
-	/*
-	 * We don't make any assumptions when we're awoken; no, we recheck the
-	 * predicate (condition) via the while()... only if data is available
-	 * we proceed outside the loop, else we put the process ctx to sleep
-	 * once again!
-	 */
-	while (atomic_read(&data_present) == 0) {
-		pr_debug("process %d (%s) going to sleep\n", current->pid, current->comm);
+	unsigned long pos = atomic_long_read(&ring.enq);
+	struct slpy_slot *sl;
+	long diff;
+
+	for (;;) {
+		sl = &ring.slots[pos & ring.mask];
+		diff = (long)(atomic_long_read_acquire(&sl->seq) - pos);
+		if (!diff) {
+			if (atomic_long_cmpxchg(&ring.enq, pos, pos + 1) == pos)
+				break;
+		} else if (diff < 0)	/* not yet emptied since the last lap */
+			return NULL;
+		/* lost the race (or we're behind): retry with the current position */
+		pos = atomic_long_read(&ring.enq);
+	}
+	*ppos = pos;
+	return sl;
+}
+
+/* Claim the next full slot (it's position in *ppos), or NULL if the ring's empty */
+static struct slpy_slot *slpy_claim_full(unsigned long *ppos)
+{
+	unsigned long pos = atomic_long_read(&ring.deq);
+	struct slpy_slot *sl;
+	long diff;
+
+	for (;;) {
+		sl = &ring.slots[pos & ring.mask];
+		diff = (long)(atomic_long_read_acquire(&sl->seq) - (pos + 1));
+		if (!diff) {
+			if (atomic_long_cmpxchg(&ring.deq, pos, pos + 1) == pos)
+				break;
+		} else if (diff < 0)	/* not yet filled */
+			return NULL;
+		pos = atomic_long_read(&ring.deq);
+	}
+	*ppos = pos;
+	return sl;
+}
+
+/* The wait conditions; just a peek at the next slot */
+static bool slpy_ring_empty(void)
+{
+	unsigned long pos = atomic_long_read(&ring.deq);
+
+	return (long)(atomic_long_read_acquire(&ring.slots[pos & ring.mask].seq) - (pos + 1)) < 0;
+}
+
+static bool slpy_ring_full(void)
+{
+	unsigned long pos = atomic_long_read(&ring.enq);
+
+	return (long)(atomic_long_read_acquire(&ring.slots[pos & ring.mask].seq) - pos) < 0;
+}
+
+/*
+ * Under load, there usually isn't anyone sleeping; wq_has_sleeper() makes that
+ * case cheap (no wait queue spinlock). It's full barrier also orders our
+ * (release) store of the slot's seq before the check, pairing with the barrier
+ * in the sleeper's set_current_state(); so a wakeup can't be missed.
+ * Pollers (poll/select/epoll, io_uring) wait on the same queues; the @key
+ * lets epoll skip waking those that aren't interested in this event.
+ */
+static inline void slpy_wake(wait_queue_head_t *q, __poll_t key)
+{
+	if (wq_has_sleeper(q))
+		wake_up_interruptible_poll(q, key);
+}
 
-		if (exclusive_wakeup == 1) {
-			if (wait_event_interruptible_exclusive(wq, (atomic_read(&data_present) == 1))) {
-				pr_debug("wait interrupted by signal, ret -EINTR to VFS..\n");
-				return -EINTR;
-				//return -ERESTARTSYS; // old way
-			}
-		} else {
-			if (wait_event_interruptible(wq, (atomic_read(&data_present) == 1))) {
-				pr_debug("wait interrupted by signal, ret -EINTR to VFS..\n");
-				return -EINTR;
-				//return -ERESTARTSYS; // old way
-			}
+/* Don't sleep: the fd's non-blocking, or it's a nowait attempt (f.e. io_uring's) */
+static inline bool slpy_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Get the next message; if the ring's empty, the reader's put to sleep (on our
+ * wait queue) until a writer comes along.
+ * A message is read in one go; if the user buffer's smaller than it, the rest
+ * is discarded (as with a datagram socket).
+ */
+static ssize_t sleepy_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t count = iov_iter_count(to), len;
+	struct slpy_slot *sl;
+	unsigned long pos;
+	ssize_t ret;
+
+	for (;;) {
+		sl = slpy_claim_full(&pos);
+		if (sl) {
+			/*
+			 * Pass the wakeup on if there's more: an exclusive one can be
+			 * 'used up' for nothing, as slots get published out of order
+			 * (a writer preempted, or faulting, between it's claim and the
+			 * seq store). F.e. N+1's published while N is still pending; the
+			 * reader woken for it peeks at N, finds the ring 'empty' and
+			 * sleeps again. N's publication then wakes just one reader - and,
+			 * but for this, N+1 would sit there with the others asleep.
+			 */
+			if (!slpy_ring_empty())
+				slpy_wake(&wq, EPOLLIN | EPOLLRDNORM);
+			len = sl->len;
+			ret = min(count, len);
+			if (len && copy_to_iter(sl->data, ret, to) != ret)
+				ret = -EFAULT;
+			/* free the slot for the next lap, and let a waiting writer know */
+			atomic_long_set_release(&sl->seq, pos + ring.mask + 1);
+			slpy_wake(&wq_space, EPOLLOUT | EPOLLWRNORM);
+			if (len)
+				return ret;
+			continue;	/* a dud (the writer faulted); on to the next one */
 		}
 
+		/*
+		 * The ring's empty: sleep until it isn't.
+		 * We don't make any assumptions when we're awoken; no, we loop
+		 * back and try to claim a message again - another reader may
+		 * well have beaten us to it!
+		 */
+		if (slpy_nowait(iocb))
+			return -EAGAIN;
+		pr_debug("process %d (%s) going to sleep\n", current->pid, current->comm);
+		if (exclusive_wakeup == 1)
+			ret = wait_event_interruptible_exclusive(wq, !slpy_ring_empty());
+		else
+			ret = wait_event_interruptible(wq, !slpy_ring_empty());
+		if (ret) {
+			pr_debug("wait interrupted by signal, ret -EINTR to VFS..\n");
+			return -EINTR;
+			//return -ERESTARTSYS; // old way
+		}
 		/*
 		 * Blocks here..the reader (user context) process/thread is put to sleep;
 		 * this is actually effected by making the
 		 * task state <- TASK_INTERRUPTIBLE and invoking the scheduler.
 		 */
-		pr_debug("awoken %d (%s), data_present=%d\n",
-			 current->pid, current->comm, atomic_read(&data_present));
+		pr_debug("awoken %d (%s)\n", current->pid, current->comm);
 	}
-	pr_debug("%d (%s): Data is available, proceeding...\n", current->pid, current->comm);
-	/* Actual read work done here (in a 'real' driver)... 
-	 * Perhaps with a mutex to avoid the 'thundering herd' issue..
-	 */
+}
 
-	return count;
+/*
+ * Queue a message (of up to SLPY_MSG_MAX bytes) and awaken a reader - one, or
+ * all of the lazy sleepy heads :-) (see the exclusive_wakeup param). If the
+ * ring's full, the writer sleeps until a reader makes space.
+ */
+static ssize_t sleepy_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t count = min_t(size_t, iov_iter_count(from), SLPY_MSG_MAX);
+	struct slpy_slot *sl;
+	unsigned long pos;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	while (!(sl = slpy_claim_free(&pos))) {
+		if (slpy_nowait(iocb))
+			return -EAGAIN;
+		/* one freed slot is of use to one writer only; so, exclusive */
+		if (wait_event_interruptible_exclusive(wq_space, !slpy_ring_full()))
+			return -EINTR;
+	}
+	/* slots are freed out of order too; pass the wakeup on (as the reader does) */
+	if (!slpy_ring_full())
+		slpy_wake(&wq_space, EPOLLOUT | EPOLLWRNORM);
+	ret = count;
+	sl->len = count;
+	if (copy_from_iter(sl->data, count, from) != count) {
+		/* we've claimed the slot, so must publish it; as a dud */
+		sl->len = 0;
+		ret = -EFAULT;
+	}
+	atomic_long_set_release(&sl->seq, pos + 1);
+	slpy_wake(&wq, EPOLLIN | EPOLLRDNORM);
+
+	return ret;
 }
 
-static ssize_t sleepy_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *offp)
+/*
+ * poll/select/epoll: readable when there's a message, writable when there's
+ * space. poll_wait() merely hooks the caller onto our wait queues (it doesn't
+ * sleep); the writer/reader wakeups above then do the rest.
+ */
+static __poll_t sleepy_poll(struct file *filp, poll_table *wait)
 {
-	pr_debug("process %d (%s) awakening %s...\n",
-		current->pid, current->comm,
-		(exclusive_wakeup==1?"just 1 reader process (exclusive)":"all reader processes"));
+	__poll_t mask = 0;
 
-	/* Set the wake-up event condition to True, simulating the
-	 * "data is available" condition... */
-	atomic_set(&data_present, 1);
-	/* and awaken one or all of the lazy sleepy heads :-) */
-	wake_up_interruptible(&wq);
+	poll_wait(filp, &wq, wait);
+	poll_wait(filp, &wq_space, wait);
+	if (!slpy_ring_empty())
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (!slpy_ring_full())
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
 
-	return count;
+static int sleepy_open(struct inode *inode, struct file *filp)
+{
+	/*
+	 * We honour IOCB_NOWAIT (see slpy_nowait()); saying so lets io_uring
+	 * try a non-blocking read/write first and, on -EAGAIN, wait via our
+	 * poll method - instead of tying up one of it's worker threads per
+	 * blocked request.
+	 */
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
+	return 0;
 }
 
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations slpy_misc_fops = {
-	.read = sleepy_read,
-	.write = sleepy_write,
+	.open = sleepy_open,
+	.read_iter = sleepy_read_iter,
+	.write_iter = sleepy_write_iter,
+	.poll = sleepy_poll,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0) // commit 868941b
 	.llseek = no_llseek,	// dummy, we don't support lseek(2)
 #endif
@@ -123,20 +317,30 @@ static struct miscdevice slpy_miscdev = {
 static int __init miscdrv_rdwr_init(void)
 {
 	int ret = 0;
+	unsigned long i, nslots;
 	struct device *dev;
 
+	nslots = roundup_pow_of_two(clamp(ring_slots, 2, 65536));
+	ring.slots = kvmalloc_array(nslots, sizeof(struct slpy_slot), GFP_KERNEL);
+	if (!ring.slots)
+		return -ENOMEM;
+	for (i = 0; i < nslots; i++)
+		atomic_long_set(&ring.slots[i].seq, i);
+	ring.mask = nslots - 1;
+
 	ret = misc_register(&slpy_miscdev);
 	if (ret) {
 		pr_err("misc device registration failed, aborting\n");
+		kvfree(ring.slots);
 		return ret;
 	}
 	/* Retrieve the device pointer for this device */
 	dev = slpy_miscdev.this_device;
 	dev_info(dev, "'sleepy' misc driver (major # 10) registered, minor# = %d,"
 		" dev node is /dev/%s\n"
-		" exclusive waiter/wakeup? %s\n",
+		" exclusive waiter/wakeup? %s; ring of %lu messages (of max %d bytes)\n",
 		slpy_miscdev.minor, slpy_miscdev.name,
-		(exclusive_wakeup==1?"yes":"no"));
+		(exclusive_wakeup==1?"yes":"no"), nslots, SLPY_MSG_MAX);
 
 	return 0;		/* success */
 }
@@ -144,6 +348,7 @@ static int __init miscdrv_rdwr_init(void)
 static void __exit miscdrv_rdwr_exit(void)
 {
 	misc_deregister(&slpy_miscdev);
+	kvfree(ring.slots);
 	pr_info("slpy misc driver deregistered\n");
 }
 
@@ -0,0 +1,158 @@
+/*
+ * slpy_bench.c
+ * Throughput test for the "sleepy" driver's (slpy.c) message channel:
+ * runs N writer and M reader threads flat out on the device, for a while, and
+ * reports the messages (and MB) per second that got through.
+ *
+ * Author: Kaiwan N Billimoria <kaiwan@kaiwantech.com>
+ * License: Dual MIT/GPL
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define MAXTHRDS	256
+#define MSGMAX		1024	/* as the driver's SLPY_MSG_MAX */
+
+static const char *devfile = "/dev/slpy_miscdrv";
+static size_t msgsz = 64;
+
+/* one per thread, on it's own cacheline so that the counting doesn't bounce */
+struct stat_s {
+	unsigned long msgs, bytes;
+} __attribute__((aligned(64)));
+static struct stat_s wr_stat[MAXTHRDS], rd_stat[MAXTHRDS];
+
+static void *writer(void *arg)
+{
+	struct stat_s *st = arg;
+	char buf[MSGMAX];
+	ssize_t n;
+	int fd;
+
+	fd = open(devfile, O_WRONLY);
+	if (fd == -1) {
+		perror("open (writer)");
+		exit(1);
+	}
+	memset(buf, 'w', sizeof(buf));
+	for (;;) {
+		n = write(fd, buf, msgsz);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		st->msgs++;
+		st->bytes += n;
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct stat_s *st = arg;
+	char buf[MSGMAX];
+	ssize_t n;
+	int fd;
+
+	fd = open(devfile, O_RDONLY);
+	if (fd == -1) {
+		perror("open (reader)");
+		exit(1);
+	}
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		st->msgs++;
+		st->bytes += n;
+	}
+	return NULL;
+}
+
+static void sum(struct stat_s *st, int nthrds, unsigned long *msgs, unsigned long *bytes)
+{
+	int i;
+
+	*msgs = *bytes = 0;
+	for (i = 0; i < nthrds; i++) {
+		*msgs += __atomic_load_n(&st[i].msgs, __ATOMIC_RELAXED);
+		*bytes += __atomic_load_n(&st[i].bytes, __ATOMIC_RELAXED);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-w writers] [-r readers] [-s msg-size] [-d secs] [device_file]\n"
+		" defaults: 1 writer, 1 reader, %zu byte messages, 5 s, %s\n",
+		name, msgsz, devfile);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int nwr = 1, nrd = 1, secs = 5, opt, i;
+	unsigned long m0, b0, m1, b1, wm, wb;
+	pthread_t t;
+
+	while ((opt = getopt(argc, argv, "w:r:s:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nwr = atoi(optarg);
+			break;
+		case 'r':
+			nrd = atoi(optarg);
+			break;
+		case 's':
+			msgsz = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		devfile = argv[optind];
+	if (nwr < 1 || nwr > MAXTHRDS || nrd < 1 || nrd > MAXTHRDS ||
+	    !msgsz || msgsz > MSGMAX || secs < 1)
+		usage(argv[0]);
+
+	for (i = 0; i < nrd; i++)
+		if (pthread_create(&t, NULL, reader, &rd_stat[i]))
+			perror("pthread_create"), exit(1);
+	for (i = 0; i < nwr; i++)
+		if (pthread_create(&t, NULL, writer, &wr_stat[i]))
+			perror("pthread_create"), exit(1);
+
+	/* let it warm up a bit, then measure */
+	sleep(1);
+	sum(rd_stat, nrd, &m0, &b0);
+	sleep(secs);
+	sum(rd_stat, nrd, &m1, &b1);
+	sum(wr_stat, nwr, &wm, &wb);
+
+	printf("%d writer(s), %d reader(s), %zu byte msgs, %d s:\n"
+	       " %.0f msgs/s, %.1f MB/s (%lu msgs written in all)\n",
+	       nwr, nrd, msgsz, secs, (double)(m1 - m0) / secs,
+	       (double)(b1 - b0) / secs / 1e6, wm);
+	/* the threads are still at it (the readers maybe asleep); just exit */
+	exit(0);
+}
+
+// end slpy_bench.c
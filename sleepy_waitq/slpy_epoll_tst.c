@@ -0,0 +1,94 @@
+/*
+ * slpy_epoll_tst.c
+ * Test the "sleepy" driver's (slpy.c) poll support: one thread, one epoll
+ * instance, lots of non-blocking slpy fds. Every message written to the
+ * device (f.e. by wr_tst or slpy_bench) makes some fd readable; we drain it
+ * (until -EAGAIN) and keep count.
+ *
+ * Author: Kaiwan N Billimoria <kaiwan@kaiwantech.com>
+ * License: Dual MIT/GPL
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAXEVENTS	64
+
+int main(int argc, char **argv)
+{
+	int nfds = 1000, epfd, fd, i, n;
+	struct epoll_event ev, events[MAXEVENTS];
+	struct rlimit rl;
+	unsigned long msgs = 0, wakeups = 0;
+	time_t t0;
+	char buf[1024];
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s device_file [num-fds (default %d)]\n", argv[0], nfds);
+		exit(1);
+	}
+	if (argc == 3)
+		nfds = atoi(argv[2]);
+	/* we'll need more than the usual 1024 open fds, likely */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nfds + 16) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	for (i = 0; i < nfds; i++) {
+		fd = open(argv[1], O_RDONLY | O_NONBLOCK);
+		if (fd == -1) {
+			perror("open");
+			exit(1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	printf("%s: %d non-blocking fds on %s, waiting in epoll; ^C to stop\n",
+	       argv[0], nfds, argv[1]);
+
+	t0 = time(NULL);
+	for (;;) {
+		n = epoll_wait(epfd, events, MAXEVENTS, 1000);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		wakeups += n;
+		for (i = 0; i < n; i++) {
+			/* drain it; it's non-blocking, so we never get stuck here */
+			while (read(events[i].data.fd, buf, sizeof(buf)) >= 0)
+				msgs++;
+			if (errno != EAGAIN) {
+				perror("read");
+				exit(1);
+			}
+		}
+		if (time(NULL) - t0 >= 1) {
+			printf("%lu msgs, %lu fd wakeups in the last ~1s\n", msgs, wakeups);
+			msgs = wakeups = 0;
+			t0 = time(NULL);
+		}
+	}
+	exit(0);
+}
+
+// end slpy_epoll_tst.c